@@ -39,7 +39,6 @@ SCRIPTS_DIR=/home/hackathon/bin
 BIN_DIR=/home/hackathon/bin
 GET_DAILY_RESULTS=${SCRIPTS_DIR}/get-daily-results.py
 ATLAS2DNST=${BIN_DIR}/atlas2dnst
-SORT_DNST=${BIN_DIR}/sort_dnst
 
 check_mtime() {
 	eval `/usr/bin/stat -s $1`
@@ -55,26 +54,8 @@ check_mtime() {
 for d in atlas
 do
 	cd ${DNSTHOUGHT_HOME}/$d
-	(
-		TO_MAKE=""
-		for f in `/usr/bin/find . -type f -name 20[12][7890]-[0-9][0-9]-[0-9][0-9]`
-		do
-			rm -f ${f}.dnst
-			TO_RM=${f%/*}
-			DAY=${f#${TO_RM}/}
-			cat << EOM
-${f}.dnst:
-	(  ${ATLAS2DNST} ${f} \\
-	&& ${SORT_DNST} ${f}.dnst ${f}.sdnst \\
-	&& /bin/mv -v ${f}.sdnst ${f}.dnst \\
-	&& TZ=UTC /usr/bin/touch -d "${DAY}T00:00:00Z" ${f}.dnst \\
-	&& /bin/rm -v ${f} \\
-	)  || rm -f ${f}.dnst ${f}.sdnst
-EOM
-			TO_MAKE="$TO_MAKE ${f}.dnst"
-		done
-		echo "all:${TO_MAKE}"
-	) > Makefile && make -j 6 all
+	/usr/bin/find . -type f -name 20[12][7890]-[0-9][0-9]-[0-9][0-9] \
+	| ${ATLAS2DNST} -j 6 --remove --batch -
 done
 exit 0
 
@@ -35,7 +35,9 @@
 from datetime import datetime, timedelta
 from dateutil.tz import *
 from sys import argv, exit
+import os
 import os.path
+import subprocess
 import certifi
 import urllib3
 import threadpool
@@ -63,14 +65,37 @@ def fetch_msm_results(msm_id):
 	url  = 'https://atlas.ripe.net/api/v2/measurements/'
 	url += '%s/results/?start=%d&stop=%d' % (msm_id, start, stop)
 	#print 'fetching', fn
-	r = http.request('GET', url)
+	r = http.request('GET', url, preload_content = False)
 	results[msm_id] = r.status
-	if r.status == 200:
+	if r.status == 200 and ATLAS2DNST:
+		# Convert while downloading, the json never hits the disk
+		print 'converting ', fn
+		p = subprocess.Popen( [ ATLAS2DNST, '--sorted', '-d'
+		                      , '-o', fn + '.dnst.tmp', '-' ]
+		                    , stdin = subprocess.PIPE)
+		for chunk in r.stream(1048576):
+			p.stdin.write(chunk)
+		p.stdin.close()
+		if p.wait() == 0:
+			os.utime(fn + '.dnst.tmp', (start, start))
+			os.rename(fn + '.dnst.tmp', fn + '.dnst')
+			# atlas2dnst names the sidecar index after its output
+			os.rename(fn + '.dnst.tmp.idx', fn + '.dnst.idx')
+		else:
+			for tmp_fn in (fn + '.dnst.tmp', fn + '.dnst.tmp.idx'):
+				if os.path.exists(tmp_fn):
+					os.remove(tmp_fn)
+			results[msm_id] = 500
+
+	elif r.status == 200:
 		print 'writing ', fn
 		with open(fn, 'wb') as fh:
-			fh.write(r.data)
+			for chunk in r.stream(1048576):
+				fh.write(chunk)
+	r.release_conn()
 
 if __name__ == '__main__':
+	ATLAS2DNST = os.environ.get('ATLAS2DNST')
 	http = urllib3.PoolManager( cert_reqs='CERT_REQUIRED'
 	                          , ca_certs=certifi.where())
 	results = dict()
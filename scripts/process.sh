@@ -61,7 +61,23 @@ do
 	fi
 done
 echo $start $next
-time $HOME/dnsthought/dnst-processing/src/iter_dnsts $start $next ../atlas/[0-9]*
+# Measurements that are not built into iter_dnsts (see src/dnst-obs.h)
+MSMS=""
+if [ -f ../msms.conf ]
+then
+	MSMS="-m ../msms.conf"
+fi
+if [ -d ../merged ]
+then
+	# All measurements of the day in a single file
+	if [ ! -f ../merged/${start}.dnst ]
+	then
+		( cd ../atlas && $HOME/dnsthought/dnst-processing/src/merge_dnst $start ../merged [0-9]* )
+	fi
+	time $HOME/dnsthought/dnst-processing/src/iter_dnsts $MSMS $start $next ../merged
+else
+	time $HOME/dnsthought/dnst-processing/src/iter_dnsts $MSMS $start $next ../atlas/[0-9]*
+fi
 time $HOME/dnsthought/dnst-processing/src/cap_counter ${next}.res ../daily8
 for c in *.csv
 do
@@ -29,518 +29,1409 @@
  * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
-/* #define WITHOUT_MMAP 1 */
+#define _DEFAULT_SOURCE
 #include "config.h"
-#include "jsmn.h"
+#include "json-scan.h"
 #include "rbtree.h"
 #include "dnst.h"
+#include "b64.h"
+#include "instream.h"
+#include "dnst-sort.h"
+#include "dnst-file.h"
 #include <arpa/inet.h>
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#ifndef WITHOUT_MMAP
-#include <fcntl.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
-#endif
 
-int b64_pton(char const *src, size_t srcsize, uint8_t *target, size_t targsize)
-{
-	const uint8_t pad64 = 64; /* is 64th in the b64 array */
-	const char* s = src;
-	uint8_t in[4];
-	size_t o = 0, incount = 0;
-
-	while(s < src + srcsize) {
-		/* skip any character that is not base64 */
-		/* conceptually we do:
-		const char* b64 =      pad'=' is appended to array
-		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
-		const char* d = strchr(b64, *s++);
-		and use d-b64;
-		*/
-		char d = *s++;
-		if(d <= 'Z' && d >= 'A')
-			d -= 'A';
-		else if(d <= 'z' && d >= 'a')
-			d = d - 'a' + 26;
-		else if(d <= '9' && d >= '0')
-			d = d - '0' + 52;
-		else if(d == '+')
-			d = 62;
-		else if(d == '/')
-			d = 63;
-		else if(d == '=')
-			d = 64;
-		else	continue;
-		in[incount++] = (uint8_t)d;
-		if(incount != 4)
-			continue;
-		/* process whole block of 4 characters into 3 output bytes */
-		incount = 0;
-		if(in[3] == pad64 && in[2] == pad64) { /* A B = = */
-			if(o+1 > targsize)
-				return -1;
-			target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
-			o += 1;
-			break; /* we are done */
-		} else if(in[3] == pad64) { /* A B C = */
-			if(o+2 > targsize)
-				return -1;
-			target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
-			target[o+1]= ((in[1]&0x0f)<<4) | ((in[2]&0x3c)>>2);
-			o += 2;
-			break; /* we are done */
-		} else {
-			if(o+3 > targsize)
-				return -1;
-			/* write xxxxxxyy yyyyzzzz zzwwwwww */
-			target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
-			target[o+1]= ((in[1]&0x0f)<<4) | ((in[2]&0x3c)>>2);
-			target[o+2]= ((in[2]&0x03)<<6) | in[3];
-			o += 3;
-		}
-	}
-	switch (incount) {
-	case 0: break;
-	case 1: assert(incount != 1);
-		break;
-	case 2: if(o+1 > targsize)
-			return -1;
-		target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
-		o += 1;
-		break;
-	case 3: if(o+2 > targsize)
-			return -1;
-		target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
-		target[o+1]= ((in[1]&0x0f)<<4) | ((in[2]&0x3c)>>2);
-		o += 2;
-		break;
-	default:
-		assert(incount < 4);
-		break;
-	}
-	return (int)o;
-}
-
-static const char *j;
-static int32_t prb_id;
-static uint8_t resultset_spc[65536];
-static uint8_t *resultset = resultset_spc;
-static size_t resultset_sz = sizeof(resultset_spc);
-static dnst *d1st;
-static dnst *dcur;
-static const char *msg_start;
-static size_t msg_len;
-static FILE *out_fh;
-
-
-size_t skip_array(jsmntok_t *t, size_t count);
-size_t skip_object(jsmntok_t *t, size_t count) {
-	size_t i = 0;
-
-	for (i = 0; count > 0; i++, count--) {
-		assert(t[i].type == JSMN_STRING);
-		if (t[i].size == 0)
-			; /* key without value */
-		else switch(t[++i].type) {
-		case JSMN_OBJECT: i += skip_object(&t[i+1], t[i].size);
-		                  break;
-		case JSMN_ARRAY : i += skip_array(&t[i+1], t[i].size);
-		                  break;
-		default         : break;
-		}
-	}
-	return i;
-};
+/* A batch is a run of complete top-level objects from the input, which is
+ * converted as a whole into the out buffer.  Batches are converted in
+ * parallel but written in the order in which they were read.
+ */
+typedef struct batch {
+	char    *json;
+	size_t   json_len;
+	size_t   json_sz;
+	size_t  *objs;    /* Offsets of the ends of the objects in json */
+	size_t   n_objs;
+	size_t   objs_sz;
+	int      lines;   /* Newline delimited objects, still to be split */
+	int      unterminated; /* Last line is missing its newline */
 
+	uint8_t *out;
+	size_t   out_len;
+	size_t   out_sz;
+	uint32_t msm_id;  /* Of the objects in this batch, 0 when not seen */
 
-size_t skip_array(jsmntok_t *t, size_t count) {
-	size_t i = 0;
+	int      r;
+	int      state;
+} batch;
 
-	for (i = 0; count > 0; i++, count--) {
-		switch (t[i].type) {
-		case JSMN_OBJECT: i += skip_object(&t[i+1], t[i].size);
-		                  break;
-		case JSMN_ARRAY : i += skip_array(&t[i+1], t[i].size);
-		                  break;
-		default         : break;
-		}
+#define BATCH_FREE   0
+#define BATCH_QUEUED 1
+#define BATCH_DONE   2
+
+#define BATCH_SIZE   4194304
+
+typedef struct msm_parser {
+	batch       *b;
+	int32_t      prb_id;
+	dnst        *d1st;
+	dnst        *dcur;
+	const char  *msg_start;
+	size_t       msg_len;
+	json_scan    scan;
+} msm_parser;
+
+/* Make room for sz more bytes from dcur onwards.  The resultset of a single
+ * probe can be any size, so grow the output buffer and rebase d1st and dcur.
+ */
+static int resultset_reserve(msm_parser *mp, size_t sz)
+{
+	batch *b = mp->b;
+	size_t d1st_off = (uint8_t *)mp->d1st - b->out;
+	size_t dcur_off = (uint8_t *)mp->dcur - b->out;
+	size_t new_sz = b->out_sz ? b->out_sz : 65536;
+	uint8_t *new_out;
+
+	if (b->out && dcur_off + sz <= b->out_sz)
+		return 0;
+
+	while (new_sz < dcur_off + sz)
+		new_sz *= 2;
+	if (!(new_out = realloc(b->out, new_sz))) {
+		fprintf( stderr, "Could not grow resultset to %zu bytes\n"
+		       , new_sz);
+		return JSON_SCAN_ERROR_NOMEM;
 	}
-	return i;
+	b->out = new_out;
+	b->out_sz = new_sz;
+	mp->d1st = (void *)(b->out + d1st_off);
+	mp->dcur = (void *)(b->out + dcur_off);
+	return 0;
+}
+
+
+/* The keys we look at, hashed perfectly by msm_key_hash() */
+#define KEY_OTHER     0
+#define KEY_PRB_ID    1
+#define KEY_RESULTSET 2
+#define KEY_TIME      3
+#define KEY_DST_ADDR  4
+#define KEY_DST_NAME  5
+#define KEY_ERROR     6
+#define KEY_RESULT    7
+#define KEY_RT        8
+#define KEY_ABUF      9
+#define KEY_MSM_ID   10
+
+static const struct {
+	const char *str;
+	size_t      len;
+	int         key;
+} msm_keys[16] = {
+	[ 8] = { "prb_id"   , 6, KEY_PRB_ID    },
+	[ 4] = { "resultset", 9, KEY_RESULTSET },
+	[ 1] = { "time"     , 4, KEY_TIME      },
+	[ 6] = { "dst_addr" , 8, KEY_DST_ADDR  },
+	[ 9] = { "dst_name" , 8, KEY_DST_NAME  },
+	[13] = { "error"    , 5, KEY_ERROR     },
+	[10] = { "result"   , 6, KEY_RESULT    },
+	[ 2] = { "rt"       , 2, KEY_RT        },
+	[15] = { "abuf"     , 4, KEY_ABUF      },
+	[ 5] = { "msm_id"   , 6, KEY_MSM_ID    }
 };
 
+static inline unsigned msm_key_hash(const char *str, size_t len)
+{ return (len * 14 + (uint8_t)str[0] + (uint8_t)str[len - 1]) & 15; }
+
+static inline int msm_key(const char *str, size_t len)
+{
+	unsigned h;
 
-size_t parse_result(jsmntok_t *t, size_t count) {
-	size_t i = 0;
-
-	for (i = 0; count > 0; i++, count--) {
-		assert(t[i].type == JSMN_STRING);
-		if (t[i].size == 0)
-			; /* key without value */
-
-		else if (t[i].end - t[i].start == 2 &&
-		    strncmp(j + t[i].start, "rt", 2) == 0) {
-			char *endptr;
-
-			i += 1;
-			assert(t[i].type == JSMN_PRIMITIVE);
-			dcur->rt = strtof(j + t[i].start, &endptr);
-			assert(j + t[i].end == endptr);
-
-		} else if (t[i].end - t[i].start == 4 &&
-		    strncmp(j + t[i].start, "abuf", 4) == 0) {
-			i += 1;
-			assert(t[i].type == JSMN_STRING);
-			dcur->error = 0;
-			msg_start = j + t[i].start;
-			msg_len = t[i].end - t[i].start;
-			if (msg_len > 1 && j[t[i].end - 1] == '=') {
-				msg_len -= 1;
-				if (msg_len > 1 && j[t[i].end - 2] == '=')
-					msg_len -= 1;
+	if (len == 0)
+		return KEY_OTHER;
+	h = msm_key_hash(str, len);
+	return msm_keys[h].len == len && memcmp(msm_keys[h].str, str, len) == 0
+	     ? msm_keys[h].key : KEY_OTHER;
+}
+
+
+static int parse_result(msm_parser *mp, json_scan *s, size_t *i)
+{
+	const char *key, *val;
+	size_t key_len, val_len;
+	char *endptr;
+	int r;
+
+	while ((r = json_scan_member(s, i, &key, &key_len)) == 1) {
+		switch (msm_key(key, key_len)) {
+		case KEY_RT:
+			if ((r = json_scan_primitive(s, i, &val, &val_len)))
+				return r;
+			mp->dcur->rt = strtof(val, &endptr);
+			assert(val + val_len == endptr);
+			break;
+
+		case KEY_ABUF:
+			if ((r = json_scan_string(s, i, &val, &val_len)))
+				return r;
+			mp->dcur->error = DNST_OK;
+			mp->msg_start = val;
+			mp->msg_len = val_len;
+			if (mp->msg_len > 1 && val[val_len - 1] == '=') {
+				mp->msg_len -= 1;
+				if (mp->msg_len > 1 && val[val_len - 2] == '=')
+					mp->msg_len -= 1;
 			}
+			break;
 
-		} else switch(t[++i].type) {
-		case JSMN_OBJECT: i += skip_object(&t[i+1], t[i].size);
-		                  break;
-		case JSMN_ARRAY : i += skip_array(&t[i+1], t[i].size);
-		                  break;
-		default         : break;
+		default:
+			if ((r = json_scan_skip(s, i)))
+				return r;
+			break;
 		}
 	}
-	return i;
-};
+	return r;
+}
+
+
+static int parse_resultset(msm_parser *mp, json_scan *s, size_t *i)
+{
+	const char *key, *val;
+	size_t key_len, val_len;
+	char *endptr;
+	char buf[48];
+	int r;
+
+	mp->dcur->time = 0;
+	mp->dcur->rt = -1;
+	mp->dcur->prb_id = mp->prb_id;
+	mp->dcur->af = 0;
+	mp->dcur->error = DNST_ERR_NO_RESULT;
+	mp->dcur->len = 0;
+	mp->msg_start = NULL;
+	mp->msg_len = 0;
+
+	while ((r = json_scan_member(s, i, &key, &key_len)) == 1) {
+		switch (msm_key(key, key_len)) {
+		case KEY_TIME:
+			if ((r = json_scan_primitive(s, i, &val, &val_len)))
+				return r;
+			mp->dcur->time = strtoul(val, &endptr, 10);
+			assert(val + val_len == endptr);
+			break;
+
+		case KEY_DST_ADDR:
+			if ((r = json_scan_string(s, i, &val, &val_len)))
+				return r;
+			mp->dcur->af = memchr(val, ':', val_len) ? AF_INET6 : AF_INET;
 
+			assert(val_len < sizeof(buf) - 1);
+			memcpy(buf, val, val_len);
+			buf[val_len] = '\0';
 
-size_t parse_resultset(jsmntok_t *t, size_t count) {
-	size_t i = 0;
-
-	dcur->time = 0;
-	dcur->rt = -1;
-	dcur->prb_id = prb_id;
-	dcur->af = 0;
-	dcur->error = 2;
-	dcur->len = 0;
-	msg_start = NULL;
-	msg_len = 0;
-
-	for (i = 0; count > 0; i++, count--) {
-		assert(t[i].type == JSMN_STRING);
-		if (t[i].size == 0)
-			; /* key without value */
-
-		else if (t[i].end - t[i].start == 4 &&
-		    strncmp(j + t[i].start, "time", 4) == 0) {
-			char *endptr;
-
-			i += 1;
-			assert(t[i].type == JSMN_PRIMITIVE);
-			dcur->time = strtoul(j + t[i].start, &endptr, 10);
-			assert(j + t[i].end == endptr);
-
-		} else if (t[i].end - t[i].start == 8 &&
-		    strncmp(j + t[i].start, "dst_addr", 8) == 0) {
-			char buf[48];
-
-			i += 1;
-			assert(t[i].type == JSMN_STRING);
-			dcur->af =
-			    memchr(j + t[i].start, ':', t[i].end - t[i].start)
-			  ? AF_INET6 : AF_INET;
-
-			assert(t[i].end - t[i].start < sizeof(buf) - 1);
-			memcpy(buf, j + t[i].start, t[i].end - t[i].start);
-			buf[t[i].end - t[i].start] = '\0';
-			
-			int r = inet_pton(dcur->af, buf, dcur->afu.ipv6.addr);
+			r = inet_pton(mp->dcur->af, buf, mp->dcur->afu.ipv6.addr);
 			assert(r == 1);
+			break;
+
+		case KEY_DST_NAME:
+			if ((r = json_scan_string(s, i, &val, &val_len)))
+				return r;
+			if (mp->dcur->af != 0)
+				break;
 
-		} else if (t[i].end - t[i].start == 8 &&
-		    strncmp(j + t[i].start, "dst_name", 8) == 0) {
-			char buf[48];
-
-			i += 1;
-			assert(t[i].type == JSMN_STRING);
-			if (dcur->af != 0)
-				continue;
-
-			dcur->af =
-			    memchr(j + t[i].start, ':', t[i].end - t[i].start)
-			  ? AF_INET6 : AF_INET;
-			if (t[i].end - t[i].start >= sizeof(buf) - 1) {
-				dcur->af = 0;
-				continue;
+			mp->dcur->af = memchr(val, ':', val_len) ? AF_INET6 : AF_INET;
+			if (val_len >= sizeof(buf) - 1) {
+				mp->dcur->af = 0;
+				break;
 			}
-			memcpy(buf, j + t[i].start, t[i].end - t[i].start);
-			buf[t[i].end - t[i].start] = '\0';
-			if (inet_pton(dcur->af, buf, dcur->afu.ipv6.addr) != 1)
-				dcur->af = 0;
-
-		} else if (t[i].end - t[i].start == 5 &&
-		    strncmp(j + t[i].start, "error", 5) == 0) {
-			i += 1;
-			assert(t[i].type == JSMN_OBJECT);
-			dcur->error = 1;
-			msg_start = j + t[i].start;
-			msg_len = t[i].end - t[i].start;
-			i += skip_object(&t[i+1], t[i].size);
-
-		} else if (t[i].end - t[i].start == 6 &&
-		    strncmp(j + t[i].start, "result", 6) == 0) {
-			i += 1;
-			assert(t[i].type == JSMN_OBJECT);
-			i += parse_result(&t[i+1], t[i].size);
-
-		} else switch(t[++i].type) {
-		case JSMN_OBJECT: i += skip_object(&t[i+1], t[i].size);
-		                  break;
-		case JSMN_ARRAY : i += skip_array(&t[i+1], t[i].size);
-		                  break;
-		default         : break;
+			memcpy(buf, val, val_len);
+			buf[val_len] = '\0';
+			if (inet_pton(mp->dcur->af, buf, mp->dcur->afu.ipv6.addr) != 1)
+				mp->dcur->af = 0;
+			break;
+
+		case KEY_ERROR:
+			/* Only the kind of error is kept, from the first key */
+			if (json_scan_c(s, *i + 1) != '{')
+				return JSON_SCAN_ERROR_INVAL;
+			*i += 1;
+			mp->dcur->error = DNST_ERR_OTHER;
+			if ((r = json_scan_member(s, i, &key, &key_len)) == 1)
+				mp->dcur->error = dnst_error_code(key, key_len);
+			while (r == 1) {
+				if ((r = json_scan_skip(s, i)))
+					return r;
+				r = json_scan_member(s, i, &key, &key_len);
+			}
+			if (r)
+				return r;
+			mp->msg_start = NULL;
+			mp->msg_len = 0;
+			break;
+
+		case KEY_RESULT:
+			if (json_scan_c(s, *i + 1) != '{')
+				return JSON_SCAN_ERROR_INVAL;
+			*i += 1;
+			if ((r = parse_result(mp, s, i)))
+				return r;
+			break;
+
+		default:
+			if ((r = json_scan_skip(s, i)))
+				return r;
+			break;
 		}
 	}
-	dcur->len = dcur->error == 0 ? msg_len * 3 / 4
-	          : dcur->error == 1 ? msg_len
-		  : 0;
-	/* TODO allocate more space when needed */
-	size_t dcur_sz  = dnst_sz(dcur);
+	if (r)
+		return r;
+
+	mp->dcur->len = mp->dcur->error == DNST_OK ? mp->msg_len * 3 / 4 : 0;
+	size_t dcur_sz  = dnst_sz(mp->dcur);
 	int b64_len;
-	assert(&((uint8_t *)dcur)[dcur_sz] - resultset < resultset_sz);
-	switch (dcur->error) {
-	case 0:	b64_len = b64_pton( msg_start, msg_len, dnst_msg(dcur)
-		                  , dnst_msg(dcur) - (resultset+resultset_sz));
+	if ((r = resultset_reserve(mp, dcur_sz + sizeof(dnst))))
+		return r;
+	if (mp->dcur->error == DNST_OK) {
+		b64_len = b64_decode( mp->msg_start, mp->msg_len
+		                    , dnst_msg(mp->dcur)
+		                    , (mp->b->out + mp->b->out_sz)
+		                    - dnst_msg(mp->dcur));
 		assert(b64_len > 0);
-		if (b64_len != dcur->len) {
-			dcur->len = b64_len;
-			dcur_sz = dnst_sz(dcur);
+		if (b64_len != mp->dcur->len) {
+			mp->dcur->len = b64_len;
+			dcur_sz = dnst_sz(mp->dcur);
 		}
-		break;
-	case 1: (void) memcpy(dnst_msg(dcur), msg_start, msg_len);
-		break;
-	}
-	size_t dcur_pad = dcur_sz - (sizeof(dnst) - 12) - dcur->len;
-	if (dcur->af == AF_INET6)
-		dcur_pad -= 12;
-	while (dcur_pad) {
-		dnst_msg(dcur)[msg_len + dcur_pad] = '=';
-		dcur_pad--;
-	}
-	return i;
-};
+		/* Pad up to the 4 byte boundary, so no stale bytes end up on disk */
+		memset( dnst_msg(mp->dcur) + mp->dcur->len, '='
+		      , ((uint8_t *)mp->dcur + dcur_sz)
+		      - (dnst_msg(mp->dcur) + mp->dcur->len));
+	}
+	return 0;
+}
 
 
-void handle_msm(const char *json, jsmntok_t *t, size_t r)
+/* Convert the top-level object at i, leaving i past its closing brace */
+static int handle_msm(msm_parser *mp, json_scan *s, size_t *i)
 {
-	size_t i;
-
-	j = json;
-	prb_id = -1;
-	dcur = d1st = (void *)resultset;
+	const char *key, *val;
+	size_t key_len, val_len;
+	char *endptr;
+	int r;
 
-	assert(t[0].type == JSMN_OBJECT);
-	for (i = 1; i < r; i++) {
-		assert(t[i].type == JSMN_STRING);
-		if (t[i].size == 0)
-			; /* key without value */
+	mp->prb_id = -1;
+	mp->dcur = mp->d1st = (void *)(mp->b->out + mp->b->out_len);
+	if ((r = resultset_reserve(mp, sizeof(dnst))))
+		return r;
 
-		else if (t[i].end - t[i].start == 6 &&
-		    strncmp(j + t[i].start, "prb_id", 6) == 0) {
-			char *endptr;
+	if (json_scan_c(s, *i) != '{')
+		return JSON_SCAN_ERROR_INVAL;
 
-			i += 1;
-			assert(t[i].type == JSMN_PRIMITIVE);
-			prb_id = strtol(j + t[i].start, &endptr, 10);
-			assert(j + t[i].end == endptr);
-			if (dcur > d1st) {
-				uint8_t *d = (void *)d1st;
-				while ((void *)d < (void *)dcur) {
-					((dnst *)d)->prb_id = prb_id;
+	while ((r = json_scan_member(s, i, &key, &key_len)) == 1) {
+		switch (msm_key(key, key_len)) {
+		case KEY_PRB_ID:
+			if ((r = json_scan_primitive(s, i, &val, &val_len)))
+				return r;
+			mp->prb_id = strtol(val, &endptr, 10);
+			assert(val + val_len == endptr);
+			if (mp->dcur > mp->d1st) {
+				uint8_t *d = (void *)mp->d1st;
+				while ((void *)d < (void *)mp->dcur) {
+					((dnst *)d)->prb_id = mp->prb_id;
 					d += dnst_sz((dnst *)d);
 				}
-				assert((void *)d == (void *)dcur);
+				assert((void *)d == (void *)mp->dcur);
 			}
+			break;
 
-		} else if (t[i].end - t[i].start == 9 &&
-		    strncmp(j + t[i].start, "resultset", 9) == 0) {
-			size_t count;
-
-			i += 1;
-			assert(t[i].type == JSMN_ARRAY);
-			for (count = t[i].size; count > 0; count--) {
-				i += 1;
-				assert(t[i].type == JSMN_OBJECT);
-				i += parse_resultset(&t[i+1], t[i].size);
-				if (dcur->af == 0 || dcur->error == 2)
+		case KEY_MSM_ID:
+			if ((r = json_scan_primitive(s, i, &val, &val_len)))
+				return r;
+			mp->b->msm_id = strtoul(val, &endptr, 10);
+			assert(val + val_len == endptr);
+			break;
+
+		case KEY_RESULTSET:
+			if (json_scan_c(s, *i + 1) != '[')
+				return JSON_SCAN_ERROR_INVAL;
+			*i += 1;
+			while ((r = json_scan_element(s, i)) == 1) {
+				if (json_scan_c(s, *i + 1) != '{')
+					return JSON_SCAN_ERROR_INVAL;
+				*i += 1;
+				if ((r = parse_resultset(mp, s, i)))
+					return r;
+				if (mp->dcur->af == 0 || mp->dcur->error == DNST_ERR_NO_RESULT)
 					continue;
 
-				uint8_t *dcur_p = (uint8_t *)dcur;
-				size_t dcur_sz = dnst_sz(dcur);
+				size_t dcur_sz = dnst_sz(mp->dcur);
 
-				assert(dcur_p + dcur_sz + sizeof(dnst)
-				              - resultset < resultset_sz);
-				dcur = (dnst *)(dcur_p + dcur_sz);
+				if ((r = resultset_reserve(mp, dcur_sz + sizeof(dnst))))
+					return r;
+				mp->dcur = (dnst *)((uint8_t *)mp->dcur + dcur_sz);
 			}
+			if (r)
+				return r;
+			break;
 
-		} else switch (t[++i].type) {
-		case JSMN_OBJECT: i += skip_object(&t[i+1], t[i].size);
-		                  break;
-		case JSMN_ARRAY : i += skip_array(&t[i+1], t[i].size);
-		                  break;
-		default         : break;
+		default:
+			if ((r = json_scan_skip(s, i)))
+				return r;
+			break;
 		}
 	}
-	if (prb_id >= 0 && dcur > d1st) {
-		if (!fwrite(d1st,
-		    ((uint8_t *)dcur) - ((uint8_t *)d1st), 1, out_fh)) {
-			fprintf( stderr, "Could not write resultset: %s\n"
-			       , strerror(errno));
-		}
+	if (r)
+		return r;
+
+	if (mp->prb_id >= 0 && mp->dcur > mp->d1st)
+		mp->b->out_len = (uint8_t *)mp->dcur - mp->b->out;
+	return 0;
+}
+
+
+static int batch_add_obj(batch *b, size_t end)
+{
+	if (b->n_objs == b->objs_sz) {
+		size_t new_sz = b->objs_sz ? b->objs_sz * 2 : 1024;
+		size_t *new_objs;
+
+		if (!(new_objs = realloc(b->objs, new_sz * sizeof(size_t))))
+			return JSON_SCAN_ERROR_NOMEM;
+		b->objs = new_objs;
+		b->objs_sz = new_sz;
 	}
+	b->objs[b->n_objs++] = end;
+	return 0;
 }
 
+/* Find the objects in a batch of newline delimited json */
+static int batch_split_lines(batch *b)
+{
+	const char *p = b->json, *e = b->json + b->json_len, *nl;
+	int r = 0;
+
+	for (b->n_objs = 0; !r && p < e; p = nl + 1) {
+		if (!(nl = memchr(p, '\n', e - p)))
+			nl = e - 1;
+		r = batch_add_obj(b, nl + 1 - b->json);
+	}
+	return r;
+}
 
-int parse_json(const char *json, const char *end)
+static int is_blank(const char *p, const char *e)
 {
-	jsmn_parser p;
-	jsmntok_t tok_spc[1024], *tok = tok_spc;
-	size_t tokcount = sizeof(tok_spc);
-	int r = 3;
-	size_t i = 0;
-	const char *next;
+	for (; p < e; p++)
+		if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+			return 0;
+	return 1;
+}
 
-	assert((end - 1) >= (json + 1));
-	json += 1;
-	end -= 1;
-	if (*end != ']')
-		return -666;
-	next = strnstr(json, "},{", (end - json));
-	next = next ? next + 1 : end;
-	while (next > json && next < end) {
-		jsmn_init(&p);
-		r = jsmn_parse(&p, json, next - json, tok, tokcount);
-		if (r == JSMN_ERROR_PART) {
-			next = strnstr(next, "},{", (end - next));
-			next = next ? next + 1 : end;
+/* Convert all objects in a batch.  The whole batch is indexed in one go,
+ * after which the objects are walked one after the other.
+ */
+static void parse_batch(msm_parser *mp, batch *b)
+{
+	json_scan *s = &mp->scan;
+	size_t i = 0, start, pos;
+	int r;
 
-		} else if (r == JSMN_ERROR_NOMEM) {
-			jsmntok_t *new_tok =
-			    malloc(sizeof(*tok) * (tokcount *= 2));
+	mp->b = b;
+	b->out_len = 0;
+	b->msm_id = 0;
+	if (b->lines && (r = batch_split_lines(b)))
+		fprintf(stderr, "Could not split batch in lines\n");
 
-			if (!new_tok)
-				break;
-			if (tok != tok_spc)
-				free(tok);
-			tok = new_tok;
+	else if ((r = json_scan_index(s, b->json, b->json_len))) {
+		if (b->unterminated)
+			r = -666;
+		else
+			fprintf(stderr, "Error %d occured indexing batch\n", r);
 
-		} else if (r < 0) {
+	} else for (start = 0, pos = 0; i < b->n_objs; start = b->objs[i++]) {
+		if (pos >= s->n_idx || s->idx[pos] >= b->objs[i])
+			r = is_blank(b->json + start, b->json + b->objs[i])
+			  ? 0 : JSON_SCAN_ERROR_INVAL;
+
+		else if (s->idx[pos] < start)
+			r = JSON_SCAN_ERROR_INVAL;
+
+		else if ((r = handle_msm(mp, s, &pos)) == 0
+		     &&  s->idx[pos - 1] >= b->objs[i])
+			r = JSON_SCAN_ERROR_INVAL; /* Spans lines */
+
+		if (r < 0 && b->unterminated && i == b->n_objs - 1)
+			r = -666;
+		else if (r < 0)
 			fprintf( stderr
 			       , "Error %d occured parsing '%.*s'\n"
-			       , r, (int)(next - json), json);
+			       , r, (int)(b->objs[i] - start), b->json + start);
+		if (r < 0)
 			break;
-		} else if (next >= end) {
-			json = next + 1;
-			break;
-		} else {
-			handle_msm(json, tok, r);
-			json = next + 1;
-			next = strnstr(json, "},{", end - json);
-			next = next ? next + 1 : end;
+	}
+	b->r = r < 0 ? r : 0;
+}
+
+
+/* The json input is read in chunks.  Only the top-level object that is
+ * currently being scanned, plus whatever has been read ahead, is kept in
+ * memory, so memory use is bounded by the size of the largest object (all
+ * results of a single probe) and not by the size of the input.
+ */
+typedef struct json_in {
+	instream *is;
+	char   *buf;
+	size_t  buf_sz;
+	size_t  len;    /* Bytes read into buf */
+	size_t  start;  /* Start of the top-level object being scanned */
+	size_t  pos;    /* Bytes before pos have been scanned */
+	size_t  blk;    /* Start of the last scanned block */
+	uint64_t bits;  /* Structural characters in that block still to visit */
+	int     eof;
+	int     done;   /* Top-level array was closed */
+	int     stream; /* Input is a pipe, don't wait for it to fill a batch */
+	int     nowait; /* Return JSON_IN_WAIT instead of reading */
+
+	/* Scanner state, which survives refills */
+	int     depth;
+	json_scan_state st;
+} json_in;
+
+#define JSON_IN_CHUNK 1048576
+#define JSON_IN_WAIT  2
+
+static int json_in_fill(json_in *in)
+{
+	ssize_t n;
+
+	if (in->depth < 2)
+		in->start = in->pos; /* Not in an object, nothing to keep */
+	if (in->start > 0) {
+		memmove(in->buf, in->buf + in->start, in->len - in->start);
+		in->len -= in->start;
+		in->pos -= in->start;
+		in->start = 0;
+	}
+	if (in->buf_sz - in->len < JSON_IN_CHUNK) {
+		size_t new_sz = in->buf_sz ? in->buf_sz * 2 : JSON_IN_CHUNK * 4;
+		char *new_buf;
+
+		if (!(new_buf = realloc(in->buf, new_sz))) {
+			fprintf( stderr, "Could not grow input buffer to "
+			                 "%zu bytes\n", new_sz);
+			return -1;
+		}
+		in->buf = new_buf;
+		in->buf_sz = new_sz;
+	}
+	if ((n = instream_read(in->is, in->buf + in->len, in->buf_sz - in->len)) < 0)
+		return -1;
+	if (n == 0)
+		in->eof = 1;
+	in->len += n;
+	return 0;
+}
+
+/* Scan for the end of the next object in the top-level array, without
+ * tokenizing.  Returns 1 when an object is found (valid until the next call),
+ * 0 when the array was closed, -666 when the input ended before that
+ * (incomplete download) and < 0 on other errors.  With nowait, JSON_IN_WAIT
+ * is returned when more input would have to be read first.
+ */
+static int json_in_next(json_in *in, const char **obj, size_t *obj_len)
+{
+	char tail[64];
+
+	if (in->done)
+		return 0;
+	for (;;) {
+		while (in->bits) {
+			size_t off = in->blk + __builtin_ctzll(in->bits);
+			char c = in->buf[off];
+
+			in->bits &= in->bits - 1;
+			switch (c) {
+			case '"': if (in->depth == 0)
+			                  return JSON_SCAN_ERROR_INVAL;
+			          break;
+			case '{':
+			case '[': if (in->depth == 0 && c != '[')
+			                  return JSON_SCAN_ERROR_INVAL;
+			          if (in->depth++ == 1)
+			                  in->start = off;
+			          break;
+			case '}':
+			case ']': if (in->depth == 0)
+			                  return JSON_SCAN_ERROR_INVAL;
+			          if (--in->depth == 0) {
+			                  in->done = 1;
+			                  return 0;
+			          }
+			          if (in->depth == 1) {
+			                  *obj = in->buf + in->start;
+			                  *obj_len = off + 1 - in->start;
+			                  in->start = off + 1;
+			                  return 1;
+			          }
+			          break;
+			default : break;
+			}
+		}
+		if (in->len - in->pos >= sizeof(tail)) {
+			in->blk = in->pos;
+			in->bits = json_scan_block(&in->st, in->buf + in->pos);
+			in->pos += sizeof(tail);
+
+		} else if (in->pos < in->len && (in->eof
+		    || (in->stream && in->buf[in->len - 1] != '\\'))) {
+			/* The end of the input, or of what a pipe delivered
+			 * so far.  Padding with spaces leaves the scanner in
+			 * the state after the last byte, unless that is an
+			 * (escaping) backslash.
+			 */
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, in->buf + in->pos, in->len - in->pos);
+			in->blk = in->pos;
+			in->bits = json_scan_block(&in->st, tail);
+			in->pos = in->len;
+
+		} else if (in->eof)
+			return -666;
+
+		else if (in->nowait)
+			return JSON_IN_WAIT;
+
+		else if (json_in_fill(in))
+			return -1;
+	}
+}
+
+/* Append objects to b until it is full, or, when reading from a pipe, until
+ * no more objects are available without waiting.  Returns 1 if objects were
+ * added, otherwise the result of json_in_next.
+ */
+static int batch_fill(batch *b, json_in *in)
+{
+	const char *obj;
+	size_t obj_len;
+	int r;
+
+	b->json_len = 0;
+	b->n_objs = 0;
+	in->nowait = 0;
+	b->lines = 0;
+	b->unterminated = 0;
+	while (b->json_len < BATCH_SIZE
+	    && (r = json_in_next(in, &obj, &obj_len)) == 1) {
+		in->nowait = in->stream;
+		if (b->json_len + obj_len > b->json_sz) {
+			size_t new_sz = b->json_sz ? b->json_sz : BATCH_SIZE * 2;
+			char *new_json;
+
+			while (new_sz < b->json_len + obj_len)
+				new_sz *= 2;
+			if (!(new_json = realloc(b->json, new_sz)))
+				return -1;
+			b->json = new_json;
+			b->json_sz = new_sz;
+		}
+		memcpy(b->json + b->json_len, obj, obj_len);
+		b->json_len += obj_len;
+		if (batch_add_obj(b, b->json_len))
+			return -1;
+	}
+	return b->n_objs ? 1 : r;
+}
+
+/* Fill b with complete lines of newline delimited json.  The lines are split
+ * by the worker converting the batch.  Returns 1 if lines were added, 0 at
+ * the end of the input and < 0 on error.
+ */
+static int batch_fill_lines(batch *b, json_in *in)
+{
+	const char *p, *e;
+	size_t avail, take;
+
+	b->json_len = 0;
+	b->n_objs = 0;
+	b->lines = 1;
+	b->unterminated = 0;
+	for (;;) {
+		p = in->buf + in->pos;
+		avail = in->len - in->pos;
+		take = avail < BATCH_SIZE ? avail : BATCH_SIZE;
+		if (avail >= BATCH_SIZE || in->eof || in->stream) {
+			/* Cut after the last newline, or the first one when
+			 * a line is larger than a batch.
+			 */
+			for (e = p + take; e > p && e[-1] != '\n'; e--)
+				; /* pass */
+			if (e == p && avail > take
+			&&  (e = memchr(p + take, '\n', avail - take)))
+				e += 1;
+			if (e && e > p)
+				take = e - p;
+			else if (in->eof)
+				b->unterminated = (take = avail) > 0;
+			else
+				take = 0;
+			if (take > 0 || in->eof)
+				break;
 		}
+		if (json_in_fill(in))
+			return -1;
+	}
+	if (take == 0)
+		return 0;
+
+	if (take > b->json_sz) {
+		size_t new_sz = b->json_sz ? b->json_sz : BATCH_SIZE * 2;
+		char *new_json;
+
+		while (new_sz < take)
+			new_sz *= 2;
+		if (!(new_json = realloc(b->json, new_sz)))
+			return -1;
+		b->json = new_json;
+		b->json_sz = new_sz;
 	}
-	if (tok != tok_spc)
-		free(tok);
-	return next >= end ? 0 : r;
+	memcpy(b->json, p, take);
+	b->json_len = take;
+	in->pos += take;
+	return 1;
 }
 
+/* Newline delimited json starts with an object instead of an array */
+static int json_in_is_lines(json_in *in)
+{
+	for (;;) {
+		for (; in->pos < in->len; in->pos++)
+			if (!is_blank(in->buf + in->pos, in->buf + in->pos + 1))
+				return in->buf[in->pos] == '{';
+		if (in->eof || json_in_fill(in))
+			return 0;
+	}
+}
 
-int main(int argc, const char **argv)
+
+/* Converted records are either written straight to fh, or, when sorted,
+ * collected in buf to be written in time order once all input is read.
+ * The version 2 header is written with the first records, so the msm_id
+ * from the json can go in it.
+ */
+typedef struct output {
+	FILE       *fh;
+	int         sorted;
+	int         compress;   /* Write LZ4 compressed blocks */
+	uint32_t    msm_id;
+	int         started;
+	dnst_writer w;
+	int         indexed;    /* Collect a sidecar index in idx */
+	dnst_idx    idx;
+	uint8_t    *buf;
+	size_t      len;
+	size_t      sz;
+} output;
+
+static int output_start(output *out, uint8_t flags)
 {
-	char out_fn[1024];
-	int r = 1;
-#ifndef WITHOUT_MMAP
+	if (out->started)
+		return 0;
+	out->started = 1;
+	flags |= DNST_FILE_DICT;
+	if (out->compress)
+		flags |= DNST_FILE_LZ4;
+	if (!dnst_writer_start( &out->w, out->fh, out->msm_id, flags
+	                      , out->indexed ? &out->idx : NULL))
+		return 0;
+	fprintf(stderr, "Could not write header: %s\n", strerror(errno));
+	return -1;
+}
+
+/* Write the footer */
+static int output_finish(output *out)
+{
+	if (output_start(out, 0))
+		return -1;
+	if (!dnst_writer_finish(&out->w))
+		return 0;
+	fprintf(stderr, "Could not write footer: %s\n", strerror(errno));
+	return -1;
+}
+
+static int output_append(output *out, const void *data, size_t len)
+{
+	if (!out->sorted) {
+		/* Flushed, so whoever reads the output sees each batch */
+		if (output_start(out, 0))
+			return -1;
+		if (!dnst_writer_write(&out->w, data, len) && !fflush(out->fh))
+			return 0;
+		fprintf( stderr, "Could not write resultset: %s\n"
+		       , strerror(errno));
+		return -1;
+	}
+	if (out->len + len > out->sz) {
+		size_t new_sz = out->sz ? out->sz * 2 : BATCH_SIZE;
+		uint8_t *new_buf;
+
+		while (new_sz < out->len + len)
+			new_sz *= 2;
+		if (!(new_buf = realloc(out->buf, new_sz))) {
+			fprintf(stderr, "Could not allocate sort buffer\n");
+			return -1;
+		}
+		out->buf = new_buf;
+		out->sz = new_sz;
+	}
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+	return 0;
+}
+
+/* Sort the collected records by time and write them in one go.  Unless
+ * ignore_day, records not spanning a single day are an error.
+ */
+static int output_sorted(output *out, int ignore_day)
+{
+	dnst **refs;
+	uint8_t *wr_buf;
+	size_t n, wr_sz;
+	uint32_t min_time, max_time;
+	int sorted, r = 0;
+
+	n = dnst_scan(out->buf, out->len, &min_time, &max_time, &sorted);
+	if (dnst_check_day(min_time, max_time) && !ignore_day)
+		return 1;
+
+	if (sorted) {
+		wr_buf = out->buf;
+		wr_sz = out->len;
+		refs = NULL;
+
+	} else if (!(refs = dnst_sort(out->buf, n))
+	     ||  !(wr_buf = malloc(out->len ? out->len : 1))) {
+		fprintf(stderr, "Could not allocate sort buffer\n");
+		free(refs);
+		return -1;
+	} else
+		wr_sz = dnst_gather(wr_buf, refs, n);
+
+	if (output_start(out, DNST_FILE_SORTED))
+		r = -1;
+
+	else if (dnst_writer_write(&out->w, wr_buf, wr_sz)) {
+		fprintf( stderr, "Could not write sorted records: %s\n"
+		       , strerror(errno));
+		r = -1;
+	} else
+		r = output_finish(out);
+	if (refs) {
+		free(wr_buf);
+		free(refs);
+	}
+	return r;
+}
+
+typedef struct pipeline {
+	size_t          n_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t  queued;
+	pthread_cond_t  done;
+	batch         **queue;
+	size_t          q_head;
+	size_t          q_len;
+	size_t          q_sz;
+	int             quit;
+	msm_parser      mp;     /* For when there are no worker threads */
+
+	batch          *batches;
+	size_t          n_batches;
+	size_t          n_written; /* Sequence number of next batch to write */
+	output         *out;
+	int             w;         /* Error converting or writing */
+} pipeline;
+
+/* Write the converted batches that are next in input order, so output is
+ * written as soon as possible.  Called with the lock held.
+ */
+static void pipeline_write(pipeline *pl)
+{
+	batch *b;
+
+	while (!pl->w
+	    && (b = &pl->batches[pl->n_written % pl->n_batches])->state
+	    == BATCH_DONE) {
+		if (!pl->out->msm_id)
+			pl->out->msm_id = b->msm_id;
+		if (b->r)
+			pl->w = b->r;
+
+		else if (b->out_len)
+			pl->w = output_append(pl->out, b->out, b->out_len);
+
+		b->state = BATCH_FREE;
+		pl->n_written += 1;
+	}
+	if (pl->n_threads)
+		pthread_cond_broadcast(&pl->done);
+}
+
+static void *worker(void *arg)
+{
+	pipeline *pl = arg;
+	msm_parser mp;
+	batch *b;
+
+	memset(&mp, 0, sizeof(mp));
+	pthread_mutex_lock(&pl->lock);
+	for (;;) {
+		while (!pl->q_len && !pl->quit)
+			pthread_cond_wait(&pl->queued, &pl->lock);
+		if (!pl->q_len)
+			break;
+		b = pl->queue[pl->q_head];
+		pl->q_head = (pl->q_head + 1) % pl->q_sz;
+		pl->q_len -= 1;
+		pthread_mutex_unlock(&pl->lock);
+
+		parse_batch(&mp, b);
+
+		pthread_mutex_lock(&pl->lock);
+		b->state = BATCH_DONE;
+		pipeline_write(pl);
+	}
+	pthread_mutex_unlock(&pl->lock);
+	json_scan_free(&mp.scan);
+	return NULL;
+}
+
+static void batch_submit(pipeline *pl, batch *b)
+{
+	if (!pl->n_threads) {
+		parse_batch(&pl->mp, b);
+		b->state = BATCH_DONE;
+		pipeline_write(pl);
+		return;
+	}
+	pthread_mutex_lock(&pl->lock);
+	b->state = BATCH_QUEUED;
+	pl->queue[(pl->q_head + pl->q_len) % pl->q_sz] = b;
+	pl->q_len += 1;
+	pthread_cond_signal(&pl->queued);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+/* Wait for b to be converted and written */
+static int batch_wait(pipeline *pl, batch *b)
+{
+	int w;
+
+	if (!pl->n_threads)
+		return pl->w;
+	pthread_mutex_lock(&pl->lock);
+	while (b->state != BATCH_FREE && !pl->w)
+		pthread_cond_wait(&pl->done, &pl->lock);
+	w = pl->w;
+	pthread_mutex_unlock(&pl->lock);
+	return w;
+}
+
+/* Read batches from is and convert them with n_threads workers.  Batches are
+ * used round-robin from a fixed set, and are written out in input order as
+ * soon as they are converted.  A batch is refilled once it is written.
+ */
+int parse_json(instream *is, int stream, output *out, size_t n_threads)
+{
+	json_in in;
+	pipeline pl;
+	pthread_t *threads = NULL;
+	batch *batches;
+	size_t n_batches = n_threads > 1 ? n_threads * 2 : 1;
+	size_t i, j, n_started = 0;
+	int r = 0, w = 0, lines;
+
+	memset(&in, 0, sizeof(in));
+	in.is = is;
+	in.stream = stream;
+	memset(&pl, 0, sizeof(pl));
+	if (!(batches = calloc(n_batches, sizeof(batch)))
+	||  !(pl.queue = calloc((pl.q_sz = n_batches), sizeof(batch *)))) {
+		fprintf(stderr, "Could not allocate batches\n");
+		free(batches);
+		return -1;
+	}
+	pl.batches = batches;
+	pl.n_batches = n_batches;
+	pl.out = out;
+	if (n_threads > 1) {
+		pthread_mutex_init(&pl.lock, NULL);
+		pthread_cond_init(&pl.queued, NULL);
+		pthread_cond_init(&pl.done, NULL);
+		if ((threads = calloc(n_threads, sizeof(pthread_t))))
+			for (; n_started < n_threads; n_started++)
+				if (pthread_create( &threads[n_started], NULL
+				                  , worker, &pl))
+					break;
+	}
+	pl.n_threads = n_started;
+
+	lines = json_in_is_lines(&in);
+	for (i = 0; ; i = (i + 1) % n_batches) {
+		if ((w = batch_wait(&pl, &batches[i])))
+			break;
+		if ((r = lines ? batch_fill_lines(&batches[i], &in)
+		               : batch_fill(&batches[i], &in)) != 1)
+			break;
+		batch_submit(&pl, &batches[i]);
+	}
+	/* Wait for the batches still in progress */
+	for (j = 0; !w && j < n_batches; j++)
+		w = batch_wait(&pl, &batches[j]);
+
+	if (n_started) {
+		pthread_mutex_lock(&pl.lock);
+		pl.quit = 1;
+		pthread_cond_broadcast(&pl.queued);
+		pthread_mutex_unlock(&pl.lock);
+		for (j = 0; j < n_started; j++)
+			pthread_join(threads[j], NULL);
+	}
+	if (n_threads > 1) {
+		pthread_cond_destroy(&pl.done);
+		pthread_cond_destroy(&pl.queued);
+		pthread_mutex_destroy(&pl.lock);
+	}
+	for (j = 0; j < n_batches; j++) {
+		free(batches[j].json);
+		free(batches[j].objs);
+		free(batches[j].out);
+	}
+	free(threads);
+	free(batches);
+	free(pl.queue);
+	json_scan_free(&pl.mp.scan);
+	free(in.buf);
+	return w ? w : r;
+}
+
+
+typedef struct convert_opts {
+	size_t n_threads;
+	int sorted;
+	int ignore_day;
+	int remove;     /* Remove input after conversion (batch mode) */
+	int compress;
+} convert_opts;
+
+/* Convert in_fn ("-" for stdin) to out_fh, with a sidecar index in idx_fn
+ * unless it is NULL.  An incomplete in_fn is removed when it is a regular
+ * file.
+ */
+static int convert( const char *in_fn, FILE *out_fh, const char *idx_fn
+                  , const convert_opts *o)
+{
+	output out;
+	instream *is = NULL;
+	struct stat st;
 	int f = -1;
-	struct stat statbuf;
-#else
-	FILE *f = NULL;
-	long f_sz;
+	int r = 1;
+
+	memset(&out, 0, sizeof(out));
+	memset(&st, 0, sizeof(st));
+	out.fh = out_fh;
+	out.sorted = o->sorted;
+	out.compress = o->compress;
+	out.indexed = idx_fn != NULL;
+	if ((f = strcmp(in_fn, "-") ? open(in_fn, O_RDONLY) : STDIN_FILENO) < 0)
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , in_fn, strerror(errno));
+
+	else if (fstat(f, &st))
+		fprintf(stderr, "Could not stat \"%s\": %s\n"
+		              , in_fn, strerror(errno));
+
+	else if (!(is = instream_open(f)))
+		fprintf(stderr, "Could not read \"%s\"\n", in_fn);
+	else {
+#ifdef POSIX_FADV_SEQUENTIAL
+		if (S_ISREG(st.st_mode))
+			(void) posix_fadvise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
-	char *json = NULL;
+		r = parse_json(is, !S_ISREG(st.st_mode), &out, o->n_threads);
+		if (!r)
+			r = out.sorted ? output_sorted(&out, o->ignore_day)
+			               : output_finish(&out);
+		if (!r && idx_fn && dnst_idx_save(&out.idx, idx_fn, out.w.off)) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , idx_fn, strerror(errno));
+			r = -1;
+		}
+	}
+	instream_close(is);
+	if (f > STDIN_FILENO)
+		close(f);
+	free(out.buf);
+	dnst_writer_free(&out.w);
+	dnst_idx_free(&out.idx);
+	if (r == -666 && S_ISREG(st.st_mode) && f != STDIN_FILENO) {
+		unlink(in_fn);
+		fprintf(stderr, "Removing incomplete \"%s\"\n", in_fn);
+	}
+	return r;
+}
+
+/* Start of the day that fn (a YYYY-MM-DD file, possibly compressed) holds
+ * results for, or -1 when fn is not named like that.
+ */
+static time_t day_start(const char *fn)
+{
+	const char *bn = strrchr(fn, '/') ? strrchr(fn, '/') + 1 : fn;
+	struct tm tm;
+	int n = 0;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf( bn, "%4d-%2d-%2d%n"
+	          , &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3
+	||  n != 10 || instream_basename_len(bn) != 10)
+		return -1;
+	tm.tm_year -= 1900;
+	tm.tm_mon  -= 1;
+	return timegm(&tm);
+}
+
+/* Files to convert in batch mode, shared by the converting threads */
+typedef struct job_queue {
+	pthread_mutex_t lock;
+	char          **fns;
+	size_t          n_fns;
+	size_t          fns_sz;
+	size_t          next;
+	size_t          n_failed;
+	convert_opts    o;
+} job_queue;
+
+static int job_add(job_queue *q, const char *fn)
+{
+	if (q->n_fns == q->fns_sz) {
+		size_t new_sz = q->fns_sz ? q->fns_sz * 2 : 1024;
+		char **new_fns;
+
+		if (!(new_fns = realloc(q->fns, new_sz * sizeof(char *))))
+			return -1;
+		q->fns = new_fns;
+		q->fns_sz = new_sz;
+	}
+	if (!(q->fns[q->n_fns] = strdup(fn)))
+		return -1;
+	q->n_fns += 1;
+	return 0;
+}
+
+/* Add all day files below dir */
+static int job_add_dir(job_queue *q, const char *dir)
+{
+	char path[4096];
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	int r = 0;
+
+	if (!(d = opendir(dir))) {
+		fprintf(stderr, "Could not open directory \"%s\": %s\n"
+		              , dir, strerror(errno));
+		return -1;
+	}
+	while (!r && (e = readdir(d))) {
+		if (e->d_name[0] == '.')
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, e->d_name)
+		    >= (int)sizeof(path) || lstat(path, &st))
+			continue;
+		if (S_ISDIR(st.st_mode))
+			r = job_add_dir(q, path);
+		else if (S_ISREG(st.st_mode) && day_start(path) != -1)
+			r = job_add(q, path);
+	}
+	closedir(d);
+	return r;
+}
 
-	if (argc != 2)
-		fprintf(stderr, "usage: %s <atlas msm result json>\n", argv[0]);
+/* Add the files listed one per line in list_fn */
+static int job_add_list(job_queue *q, const char *list_fn)
+{
+	char line[4096];
+	FILE *fh;
+	size_t len;
+	int r = 0;
 
-	else if (strlen(argv[1]) + 6 > sizeof(out_fn))
+	if (!(fh = strcmp(list_fn, "-") ? fopen(list_fn, "r") : stdin)) {
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , list_fn, strerror(errno));
+		return -1;
+	}
+	while (!r && fgets(line, sizeof(line), fh)) {
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len > 0)
+			r = job_add(q, line);
+	}
+	if (fh != stdin)
+		fclose(fh);
+	return r;
+}
+
+/* Convert fn to a temporary file, which is timestamped with the start of the
+ * day and then renamed to the .dnst file, so a .dnst file is always complete.
+ * The sidecar index is renamed into place after it.
+ */
+static int job_convert(const char *fn, const convert_opts *o)
+{
+	char out_fn[1024], tmp_fn[1024], idx_fn[1024], idx_tmp_fn[1024];
+	struct timeval tv[2];
+	time_t day = day_start(fn);
+	FILE *out_fh = NULL;
+	int r = 1;
+
+	if (snprintf( out_fn, sizeof(out_fn), "%.*s.dnst"
+	            , (int)instream_basename_len(fn), fn) >= (int)sizeof(out_fn)
+	||  snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", out_fn)
+	    >= (int)sizeof(tmp_fn)
+	||  snprintf(idx_fn, sizeof(idx_fn), "%s.idx", out_fn)
+	    >= (int)sizeof(idx_fn)
+	||  snprintf(idx_tmp_fn, sizeof(idx_tmp_fn), "%s.tmp", idx_fn)
+	    >= (int)sizeof(idx_tmp_fn)) {
 		fprintf(stderr, "File name too large!\n");
+		*out_fn = *tmp_fn = '\0';
 
-	else if (!(out_fh = fopen(strcat(strcpy(out_fn, argv[1]), ".dnst"), "wb")))
+	} else if (!(out_fh = fopen(tmp_fn, "wb")))
 		fprintf(stderr, "Could not open \"%s\" for writing: %s\n"
-		              , out_fn, strerror(errno));
+		              , tmp_fn, strerror(errno));
 
-#ifndef WITHOUT_MMAP
-	else if ((f = open(argv[1], O_RDONLY)) < 0)
-		fprintf(stderr, "Could not open \"%s\": %s\n"
-		              , argv[1], strerror(errno));
-
-	else if (fstat(f, &statbuf) < 0)
-		fprintf(stderr, "Could not fstat \"%s\": %s\n"
-		              , argv[1], strerror(errno));
-
-	else if ((json = mmap( NULL, statbuf.st_size, PROT_READ
-	                     , MAP_PRIVATE, f, 0)) == MAP_FAILED)
-		fprintf(stderr, "Could not mmap \"%s\": %s\n"
-		              , argv[1], strerror(errno));
-	else
-		r = parse_json(json, json + statbuf.st_size);
-#else
-	else if (!(f = fopen(argv[1], "rb")))
-		fprintf(stderr, "Could not open \"%s\": %s\n"
-		              , argv[1], strerror(errno));
+	else if (!(r = convert(fn, out_fh, idx_tmp_fn, o))) {
+		if (fclose(out_fh)) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = -1;
+		}
+		out_fh = NULL;
+		tv[0].tv_sec = tv[1].tv_sec = day;
+		tv[0].tv_usec = tv[1].tv_usec = 0;
+		if (!r && day != -1 && utimes(tmp_fn, tv))
+			fprintf(stderr, "Could not set time of \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+		if (r)
+			; /* pass */
 
-	else if (fseek(f, 0, SEEK_END) < 0)
-		fprintf(stderr, "Could not seek to EOF: %s\n", strerror(errno));
+		else if (rename(tmp_fn, out_fn) || rename(idx_tmp_fn, idx_fn)) {
+			fprintf(stderr, "Could not rename \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = -1;
 
-	else if (!(f_sz = ftell(f)))
-		fprintf(stderr, "File \"%s\" had no content\n", argv[1]);
+		} else if (o->remove && unlink(fn))
+			fprintf(stderr, "Could not remove \"%s\": %s\n"
+			              , fn, strerror(errno));
+	}
+	if (out_fh)
+		fclose(out_fh);
+	if (r) {
+		/* Like a failed recipe, leave no (stale) .dnst behind */
+		fprintf(stderr, "Conversion of \"%s\" failed\n", fn);
+		if (*out_fn) {
+			unlink(tmp_fn);
+			unlink(out_fn);
+			unlink(idx_tmp_fn);
+			unlink(idx_fn);
+		}
+	}
+	return r;
+}
 
-	else if (fseek(f, 0, SEEK_SET) < 0)
-		fprintf(stderr, "Could not rewind: %s\n", strerror(errno));
+static void *job_worker(void *arg)
+{
+	job_queue *q = arg;
+	const char *fn;
+	int r;
 
-	else if (!(json = malloc(f_sz+1)))
-		fprintf(stderr, "Could allocate %ld bytes of memory\n", f_sz+1);
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		fn = q->next < q->n_fns ? q->fns[q->next++] : NULL;
+		pthread_mutex_unlock(&q->lock);
+		if (!fn)
+			break;
+		if ((r = job_convert(fn, &q->o))) {
+			pthread_mutex_lock(&q->lock);
+			q->n_failed += 1;
+			pthread_mutex_unlock(&q->lock);
+		}
+	}
+	return NULL;
+}
+
+static int cmp_fn(const void *x, const void *y)
+{ return strcmp(*(char **)x, *(char **)y); }
 
-	else if (fread(json, f_sz, 1, f) != 1)
-		fprintf(stderr, "Could not read content of \"%s\"\n", argv[1]);
+/* Convert all day files below a directory, or listed in a file, with
+ * n_threads files converted at the same time.
+ */
+static int convert_batch(const char *dir_or_list, const convert_opts *o)
+{
+	job_queue q;
+	pthread_t *threads = NULL;
+	size_t i, n_started = 0;
+	struct stat st;
+	int r;
+
+	memset(&q, 0, sizeof(q));
+	q.o = *o;
+	q.o.n_threads = 1;
+	q.o.sorted = 1;
+	if (stat(dir_or_list, &st) && strcmp(dir_or_list, "-")) {
+		fprintf(stderr, "Could not stat \"%s\": %s\n"
+		              , dir_or_list, strerror(errno));
+		return 1;
+	}
+	r = strcmp(dir_or_list, "-") && S_ISDIR(st.st_mode)
+	  ? job_add_dir(&q, dir_or_list) : job_add_list(&q, dir_or_list);
+	if (r)
+		fprintf(stderr, "Could not collect files to convert\n");
 	else {
-		json[f_sz] = '\x00';
-		r = parse_json(json, json + f_sz);
+		qsort(q.fns, q.n_fns, sizeof(char *), cmp_fn);
+		pthread_mutex_init(&q.lock, NULL);
+		if ((threads = calloc(o->n_threads, sizeof(pthread_t))))
+			for (; n_started < o->n_threads && n_started < q.n_fns
+			     ; n_started++)
+				if (pthread_create( &threads[n_started], NULL
+				                  , job_worker, &q))
+					break;
+		if (!n_started)
+			job_worker(&q);
+		for (i = 0; i < n_started; i++)
+			pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&q.lock);
+		fprintf( stderr, "Converted %zu of %zu files\n"
+		       , q.n_fns - q.n_failed, q.n_fns);
+		r = q.n_failed ? 1 : 0;
 	}
-#endif
+	for (i = 0; i < q.n_fns; i++)
+		free(q.fns[i]);
+	free(q.fns);
+	free(threads);
+	return r ? 1 : 0;
+}
 
-#ifndef WITHOUT_MMAP
-	if (json && json != MAP_FAILED)
-		munmap(json, statbuf.st_size);
-	if (f >= 0)
-		close(f);
-#else
-	if (json)
-		free(json);
-	if (f)
-		fclose(f);
-#endif
-	if (r == -666) {
-		unlink(argv[1]);
-		fprintf(stderr, "Removing incomplete \"%s\"\n", argv[1]);
+int main(int argc, char * const *argv)
+{
+	static const struct option long_opts[] = {
+		{ "threads"   , required_argument, NULL, 'j' },
+		{ "sorted"    , no_argument      , NULL, 's' },
+		{ "ignore-day", no_argument      , NULL, 'd' },
+		{ "batch"     , required_argument, NULL, 'b' },
+		{ "remove"    , no_argument      , NULL, 'r' },
+		{ "output"    , required_argument, NULL, 'o' },
+		{ "compress"  , no_argument      , NULL, 'z' },
+		{ NULL        , 0                , NULL,  0  }
+	};
+	char out_fn[1024];
+	char idx_fn[1024 + 4];
+	FILE *out_fh;
+	convert_opts o;
+	const char *batch = NULL;
+	const char *out_arg = NULL;
+	int r = 1;
+	int c;
+
+	memset(&o, 0, sizeof(o));
+	o.n_threads = 1;
+	while ((c = getopt_long(argc, argv, "j:sdb:ro:z", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'j': o.n_threads = atoi(optarg) > 0 ? atoi(optarg) : 0;
+		          break;
+		case 's': o.sorted = 1;
+		          break;
+		case 'd': o.ignore_day = 1;
+		          break;
+		case 'b': batch = optarg;
+		          break;
+		case 'r': o.remove = 1;
+		          break;
+		case 'o': out_arg = optarg;
+		          break;
+		case 'z': o.compress = 1;
+		          break;
+		default : argc = 0;
+		          break;
+		}
 	}
+	if (argc - optind != (batch ? 0 : 1) || o.n_threads < 1
+	||  (o.remove && !batch) || (out_arg && batch))
+		fprintf( stderr, "usage: %s [ -j <threads> ] [ --sorted [ -d ] ] "
+		                 "[ -z ] [ -o <output> ]\n"
+		                 "\t\t<atlas msm result json[.gz|.bz2|.zst]>\n"
+		                 "       %s [ -j <threads> ] [ -d ] [ -z ] "
+		                 "[ --remove ] --batch <dir|list>\n"
+		                 "\t-o      : output file (- for stdout), default "
+		                 "the input file with .dnst,\n"
+		                 "\t          or stdout when reading from stdin (-)\n"
+		                 "\t--sorted: write records in time order\n"
+		                 "\t-d      : do not fail when the records do "
+		                 "not span a single day\n"
+		                 "\t-z      : write the records in LZ4 "
+		                 "compressed blocks\n"
+		                 "\t--batch : convert (sorted) all YYYY-MM-DD files "
+		                 "below dir, or listed\n"
+		                 "\t          in a file (- for stdin), "
+		                 "converting <threads> files at once\n"
+		                 "\t--remove: remove converted input files\n"
+		       , argv[0], argv[0]);
 
-	if (out_fh) {
-		fclose(out_fh);
+	else if (batch)
+		r = convert_batch(batch, &o);
+
+	else if ((out_arg && strcmp(out_arg, "-") == 0)
+	     ||  (!out_arg && strcmp(argv[optind], "-") == 0)) {
+		r = convert(argv[optind], stdout, NULL, &o);
+		if (fflush(stdout) && !r) {
+			fprintf(stderr, "Could not write output: %s\n"
+			              , strerror(errno));
+			r = -1;
+		}
+	} else if (out_arg && strlen(out_arg) >= sizeof(out_fn))
+		fprintf(stderr, "File name too large!\n");
+
+	else if (!out_arg
+	     &&  snprintf( out_fn, sizeof(out_fn), "%.*s.dnst"
+	                 , (int)instream_basename_len(argv[optind])
+	                 , argv[optind]) >= (int)sizeof(out_fn))
+		fprintf(stderr, "File name too large!\n");
+
+	else if (!(out_fh = fopen( out_arg ? strcpy(out_fn, out_arg) : out_fn
+	                         , "wb")))
+		fprintf(stderr, "Could not open \"%s\" for writing: %s\n"
+		              , out_fn, strerror(errno));
+
+	else {
+		snprintf(idx_fn, sizeof(idx_fn), "%s.idx", out_fn);
+		r = convert(argv[optind], out_fh, idx_fn, &o);
+		if (fclose(out_fh) && !r) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , out_fn, strerror(errno));
+			r = -1;
+		}
 		if (r) {
 			fprintf(stderr, "Removing \"%s\" because of earlier error\n", out_fn);
 			unlink(out_fn);
+			unlink(idx_fn);
 		}
 	}
 	return r;
@@ -0,0 +1,262 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#include "b64.h"
+#include <assert.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define B64_X86 1
+#include <immintrin.h>
+#endif
+
+int b64_pton(char const *src, size_t srcsize, uint8_t *target, size_t targsize)
+{
+	const uint8_t pad64 = 64; /* is 64th in the b64 array */
+	const char* s = src;
+	uint8_t in[4];
+	size_t o = 0, incount = 0;
+
+	while(s < src + srcsize) {
+		/* skip any character that is not base64 */
+		/* conceptually we do:
+		const char* b64 =      pad'=' is appended to array
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
+		const char* d = strchr(b64, *s++);
+		and use d-b64;
+		*/
+		char d = *s++;
+		if(d <= 'Z' && d >= 'A')
+			d -= 'A';
+		else if(d <= 'z' && d >= 'a')
+			d = d - 'a' + 26;
+		else if(d <= '9' && d >= '0')
+			d = d - '0' + 52;
+		else if(d == '+')
+			d = 62;
+		else if(d == '/')
+			d = 63;
+		else if(d == '=')
+			d = 64;
+		else	continue;
+		in[incount++] = (uint8_t)d;
+		if(incount != 4)
+			continue;
+		/* process whole block of 4 characters into 3 output bytes */
+		incount = 0;
+		if(in[3] == pad64 && in[2] == pad64) { /* A B = = */
+			if(o+1 > targsize)
+				return -1;
+			target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
+			o += 1;
+			break; /* we are done */
+		} else if(in[3] == pad64) { /* A B C = */
+			if(o+2 > targsize)
+				return -1;
+			target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
+			target[o+1]= ((in[1]&0x0f)<<4) | ((in[2]&0x3c)>>2);
+			o += 2;
+			break; /* we are done */
+		} else {
+			if(o+3 > targsize)
+				return -1;
+			/* write xxxxxxyy yyyyzzzz zzwwwwww */
+			target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
+			target[o+1]= ((in[1]&0x0f)<<4) | ((in[2]&0x3c)>>2);
+			target[o+2]= ((in[2]&0x03)<<6) | in[3];
+			o += 3;
+		}
+	}
+	switch (incount) {
+	case 0: break;
+	case 1: /* A single character is not enough for a byte */
+		break;
+	case 2: if(o+1 > targsize)
+			return -1;
+		target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
+		o += 1;
+		break;
+	case 3: if(o+2 > targsize)
+			return -1;
+		target[o] = (in[0]<<2) | ((in[1]&0x30)>>4);
+		target[o+1]= ((in[1]&0x0f)<<4) | ((in[2]&0x3c)>>2);
+		o += 2;
+		break;
+	default:
+		assert(incount < 4);
+		break;
+	}
+	return (int)o;
+}
+
+#ifdef B64_X86
+/* Vectorized decoding after "Faster Base64 Encoding and Decoding using AVX2
+ * Instructions" by Wojciech Mula and Daniel Lemire.  Blocks of 16 (SSE4.1) or
+ * 32 (AVX2) characters are translated and packed into 12 or 24 bytes.  At the
+ * first block that contains anything other than the 64 base64 characters
+ * (padding, whitespace, ...), decoding stops and b64_pton handles the rest,
+ * so the result is always the same as that of b64_pton.
+ *
+ * The functions return the number of characters consumed and advance *dst.
+ */
+__attribute__((target("sse4.1")))
+static size_t b64_blocks_sse41(const char *src, size_t srcsize,
+    uint8_t **dst, uint8_t *dst_end)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+	    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(
+	    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+	    0,  16,  19,   4, -65, -65, -71, -71,
+	    0,   0,   0,   0,   0,   0,   0,   0);
+	const __m128i pack = _mm_setr_epi8(
+	    2,  1,  0,  6,  5,  4, 10,  9,
+	    8, 14, 13, 12, -1, -1, -1, -1);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i slash  = _mm_set1_epi8('/');
+	uint8_t *o = *dst;
+	size_t i;
+
+	for (i = 0; i + 16 <= srcsize && o + 16 <= dst_end; i += 16, o += 12) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+		__m128i lo_nibbles = _mm_and_si128(in, nibble);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		__m128i roll;
+
+		if (!_mm_testz_si128(lo, hi))
+			break; /* Not a clean block */
+
+		roll = _mm_shuffle_epi8(lut_roll,
+		    _mm_add_epi8(_mm_cmpeq_epi8(in, slash), hi_nibbles));
+		in = _mm_add_epi8(in, roll);
+		/* 00aaaaaa 00bbbbbb 00cccccc 00dddddd -> aaaaaabb bbbbcccc ccdddddd */
+		in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+		in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i *)o, _mm_shuffle_epi8(in, pack));
+	}
+	*dst = o;
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t b64_blocks_avx2(const char *src, size_t srcsize,
+    uint8_t **dst, uint8_t *dst_end)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+	    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+	    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+	    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+	    0,  16,  19,   4, -65, -65, -71, -71,
+	    0,   0,   0,   0,   0,   0,   0,   0,
+	    0,  16,  19,   4, -65, -65, -71, -71,
+	    0,   0,   0,   0,   0,   0,   0,   0);
+	const __m256i pack = _mm256_setr_epi8(
+	    2,  1,  0,  6,  5,  4, 10,  9,
+	    8, 14, 13, 12, -1, -1, -1, -1,
+	    2,  1,  0,  6,  5,  4, 10,  9,
+	    8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i slash  = _mm256_set1_epi8('/');
+	uint8_t *o = *dst;
+	size_t i;
+
+	for (i = 0; i + 32 <= srcsize && o + 32 <= dst_end; i += 32, o += 24) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), nibble);
+		__m256i lo_nibbles = _mm256_and_si256(in, nibble);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		__m256i roll;
+
+		if (!_mm256_testz_si256(lo, hi))
+			break; /* Not a clean block */
+
+		roll = _mm256_shuffle_epi8(lut_roll,
+		    _mm256_add_epi8(_mm256_cmpeq_epi8(in, slash), hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+		in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+		in = _mm256_shuffle_epi8(in, pack);
+		_mm256_storeu_si256((__m256i *)o,
+		    _mm256_permutevar8x32_epi32(in, lanes));
+	}
+	*dst = o;
+	return i;
+}
+
+typedef size_t (*b64_blocks_fn)(const char *src, size_t srcsize,
+    uint8_t **dst, uint8_t *dst_end);
+
+static size_t b64_blocks_none(const char *src, size_t srcsize,
+    uint8_t **dst, uint8_t *dst_end)
+{ return 0; }
+
+static b64_blocks_fn b64_blocks = b64_blocks_none;
+
+/* Select once at startup, so b64_decode can be used from several threads */
+__attribute__((constructor))
+static void b64_blocks_select(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		b64_blocks = b64_blocks_avx2;
+	else if (__builtin_cpu_supports("sse4.1"))
+		b64_blocks = b64_blocks_sse41;
+}
+
+int b64_decode(char const *src, size_t srcsize, uint8_t *target, size_t targsize)
+{
+	uint8_t *o = target;
+	size_t done;
+	int r;
+
+	done = b64_blocks(src, srcsize, &o, target + targsize);
+	if ((r = b64_pton( src + done, srcsize - done
+	                 , o, targsize - (o - target))) < 0)
+		return r;
+	return r + (int)(o - target);
+}
+#else
+int b64_decode(char const *src, size_t srcsize, uint8_t *target, size_t targsize)
+{ return b64_pton(src, srcsize, target, targsize); }
+#endif
@@ -0,0 +1,828 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+#include "dnst-file.h"
+
+#ifdef HAVE_LIBLZ4
+/* Check the table of blocks of tbl_sz bytes at tbl */
+static int dnst_file_blks_init(dnst_file *f, uint8_t *tbl, size_t tbl_sz)
+{
+	uint64_t raw_off = f->recs_off;
+	size_t i;
+
+	if (tbl_sz % sizeof(dnst_file_blk) || (uintptr_t)tbl % 8)
+		return -1;
+	f->blks = (void *)tbl;
+	f->n_blks = f->blk = tbl_sz / sizeof(dnst_file_blk);
+	for (i = 0; i < f->n_blks; i++) {
+		if (f->blks[i].raw_off != raw_off || f->blks[i].raw_sz == 0
+		||  f->blks[i].sz > f->blks[i].raw_sz
+		||  f->blks[i].off < f->recs_off
+		||  f->blks[i].off + f->blks[i].sz > (uint64_t)(f->end - f->buf))
+			return -1;
+		raw_off += f->blks[i].raw_sz;
+	}
+	f->end_off = raw_off;
+	return 0;
+}
+#endif
+
+int dnst_file_init(dnst_file *f, uint8_t *buf, size_t sz)
+{
+	dnst_file_dict dict;
+	uint8_t *trl;
+	size_t trl_sz;
+
+	memset(f, 0, sizeof(*f));
+	f->buf = buf;
+	f->recs = buf;
+	f->end = buf + sz;
+	f->end_off = sz;
+	if (sz < sizeof(dnst_file_hdr) || memcmp(buf, DNST_FILE_MAGIC, 4) != 0)
+		return (f->version = 1);
+
+	memcpy(&f->hdr, buf, sizeof(dnst_file_hdr));
+	if (f->hdr.version != DNST_FILE_VERSION
+	||  f->hdr.hdr_sz < sizeof(dnst_file_hdr) || f->hdr.hdr_sz > sz)
+		return -1;
+
+	f->version = f->hdr.version;
+	f->recs = buf + f->hdr.hdr_sz;
+	f->recs_off = f->hdr.hdr_sz;
+	if (f->hdr.flags & DNST_FILE_MERGED) {
+		uint32_t n_msms;
+
+		if (f->hdr.hdr_sz < sizeof(dnst_file_hdr) + sizeof(n_msms))
+			return -1;
+		memcpy(&n_msms, buf + sizeof(dnst_file_hdr), sizeof(n_msms));
+		if (n_msms > (f->hdr.hdr_sz - sizeof(dnst_file_hdr)
+		              - sizeof(n_msms)) / sizeof(uint32_t))
+			return -1;
+		f->msm_ids = (void *)(buf + sizeof(dnst_file_hdr) + sizeof(n_msms));
+		f->n_msms = n_msms;
+		f->pre = sizeof(uint32_t);
+	}
+	if ((size_t)(f->end - f->recs) < sizeof(dnst_file_ftr)
+	||  memcmp(f->end - 4, DNST_FILE_MAGIC, 4) != 0) {
+		/* No footer (yet), so no table of compressed blocks, nor
+		 * dictionary either.
+		 */
+		if (f->hdr.flags & (DNST_FILE_LZ4 | DNST_FILE_DICT))
+			f->end = f->recs;
+		f->end_off = f->end - f->buf;
+		return f->version;
+	}
+	memcpy(&f->ftr, f->end - sizeof(dnst_file_ftr), sizeof(dnst_file_ftr));
+	if (f->ftr.ftr_sz < sizeof(dnst_file_ftr)
+	||  f->ftr.ftr_sz > (size_t)(f->end - f->recs)
+	||  (f->ftr.ftr_sz != sizeof(dnst_file_ftr)
+	     && !(f->ftr.flags & (DNST_FILE_LZ4 | DNST_FILE_DICT)))) {
+		memset(&f->ftr, 0, sizeof(dnst_file_ftr));
+		return -1;
+	}
+	f->has_ftr = 1;
+	/* The table of blocks and the dictionary location */
+	trl = f->end -= f->ftr.ftr_sz;
+	trl_sz = f->ftr.ftr_sz - sizeof(dnst_file_ftr);
+	if (f->ftr.flags & DNST_FILE_DICT) {
+		if (trl_sz < sizeof(dnst_file_dict))
+			return -1;
+		trl_sz -= sizeof(dnst_file_dict);
+		memcpy(&dict, trl + trl_sz, sizeof(dnst_file_dict));
+		if (dict.off < f->recs_off || dict.off > (uint64_t)(trl - buf)
+		||  dict.sz > (uint64_t)(trl - buf) - dict.off)
+			return -1;
+		f->end = f->dict = buf + dict.off;
+		f->dict_sz = dict.sz;
+	}
+	f->end_off = f->end - f->buf;
+	if (!(f->ftr.flags & DNST_FILE_LZ4))
+		return trl_sz ? -1 : f->version;
+#ifdef HAVE_LIBLZ4
+	if (!dnst_file_blks_init(f, trl, trl_sz))
+		return f->version;
+#endif
+	f->blks = NULL;
+	f->n_blks = 0;
+	return -1;
+}
+
+void dnst_file_done(dnst_file *f)
+{
+	free(f->rec_buf);
+	f->rec_buf = NULL;
+	f->rec = NULL;
+	free(f->blk_buf);
+	f->blk_buf = NULL;
+	f->blk_buf_sz = 0;
+	f->blk = f->n_blks;
+	free(f->raw);
+	f->raw = NULL;
+}
+
+/* Decompress block b of the file in buf to dst */
+static int dnst_file_inflate(const dnst_file_blk *b, const uint8_t *buf,
+    uint8_t *dst)
+{
+	if (b->sz == b->raw_sz) {
+		memcpy(dst, buf + b->off, b->sz);
+		return 0;
+	}
+#ifdef HAVE_LIBLZ4
+	if (LZ4_decompress_safe( (const char *)buf + b->off, (char *)dst
+	                       , b->sz, b->raw_sz) == (int)b->raw_sz)
+		return 0;
+#endif
+	return -1;
+}
+
+static inline int dnst_file_in_blk(dnst_file *f, size_t i, uint64_t off)
+{ return i < f->n_blks && off >= f->blks[i].raw_off
+                       && off <  f->blks[i].raw_off + f->blks[i].raw_sz; }
+
+dnst *dnst_file_blk_rec(dnst_file *f, uint64_t off)
+{
+	size_t lo = 0, hi = f->n_blks, mid;
+	dnst_file_blk *b;
+	uint8_t *blk_buf, *end;
+	dnst *d;
+
+	if (off < f->recs_off || off + f->pre + 16 >= f->end_off)
+		return NULL;
+
+	if (dnst_file_in_blk(f, f->blk, off))
+		lo = f->blk;
+
+	else if (dnst_file_in_blk(f, f->blk + 1, off))
+		lo = f->blk + 1;
+	else {
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (f->blks[mid].raw_off <= off)
+				lo = mid;
+			else
+				hi = mid;
+		}
+	}
+	b = &f->blks[lo];
+	if (lo != f->blk) {
+		if (b->raw_sz > f->blk_buf_sz) {
+			if (!(blk_buf = realloc(f->blk_buf, b->raw_sz)))
+				return NULL;
+			f->blk_buf = blk_buf;
+			f->blk_buf_sz = b->raw_sz;
+		}
+		f->blk = f->n_blks;
+		if (dnst_file_inflate(b, f->buf, f->blk_buf))
+			return NULL;
+		f->blk = lo;
+	}
+	d = (dnst *)(f->blk_buf + (off - b->raw_off) + f->pre);
+	end = f->blk_buf + b->raw_sz;
+	return (uint8_t *)d + 16 < end && dnst_fits(d, end) ? d : NULL;
+}
+
+dnst *dnst_file_deref(dnst_file *f, dnst *d)
+{
+	size_t hdr_sz = dnst_msg(d) - (uint8_t *)d;
+	dnst_msg_ref ref;
+	uint16_t len;
+
+	if (d->len != sizeof(dnst_msg_ref) || !f->dict)
+		return NULL;
+	memcpy(&ref, dnst_msg(d), sizeof(ref));
+	if (ref.off > f->dict_sz || f->dict_sz - ref.off < sizeof(len))
+		return NULL;
+	memcpy(&len, f->dict + ref.off, sizeof(len));
+	if (len < sizeof(ref.id) || f->dict_sz - ref.off - sizeof(len) < len)
+		return NULL;
+	if (!f->rec_buf) {
+		/* Room for the msm_id in front of the record */
+		if (!(f->rec_buf = malloc(sizeof(uint32_t) + sizeof(dnst) + 65536)))
+			return NULL;
+		f->rec = (dnst *)(f->rec_buf + sizeof(uint32_t));
+	}
+	memcpy((uint8_t *)f->rec - f->pre, (uint8_t *)d - f->pre, f->pre);
+	memcpy(f->rec, d, hdr_sz);
+	f->rec->error &= ~DNST_MSG_REF;
+	f->rec->len = len;
+	memcpy(dnst_msg(f->rec), f->dict + ref.off + sizeof(len), len);
+	memcpy(dnst_msg(f->rec), ref.id, sizeof(ref.id));
+	memset( dnst_msg(f->rec) + len, 0
+	      , (uint8_t *)f->rec + dnst_sz(f->rec) - dnst_msg(f->rec) - len);
+	f->rec_sz = dnst_sz(d);
+	return f->rec;
+}
+
+int dnst_file_expand(dnst_file *f)
+{
+	uint8_t *raw, *recs;
+	uint64_t off;
+	size_t i, sz;
+	dnst *d;
+
+	if (!f->n_blks && !f->dict)
+		return 0;
+	if (f->n_blks) {
+		if (!(raw = malloc(f->end_off)))
+			return -1;
+		memcpy(raw, f->buf, f->recs_off);
+		for (i = 0; i < f->n_blks; i++) {
+			if (dnst_file_inflate( &f->blks[i], f->buf
+			                     , raw + f->blks[i].raw_off)) {
+				free(raw);
+				return -1;
+			}
+		}
+		free(f->blk_buf);
+		f->blk_buf = NULL;
+		f->blk_buf_sz = 0;
+		free(f->raw);
+		f->buf = f->raw = raw;
+		f->recs = raw + f->recs_off;
+		f->end = raw + f->end_off;
+		if (f->msm_ids)
+			f->msm_ids = (void *)(raw + sizeof(dnst_file_hdr)
+			                          + sizeof(uint32_t));
+		f->blks = NULL;
+		f->n_blks = f->blk = 0;
+	}
+	if (!f->dict)
+		return 0;
+
+	for ( sz = 0, off = f->recs_off; (d = dnst_file_rec(f, off))
+	    ; off = dnst_file_next(f, off, d))
+		sz += f->pre + dnst_sz(d);
+	if (!(raw = malloc(f->recs_off + sz)))
+		return -1;
+	memcpy(raw, f->buf, f->recs_off);
+	for ( recs = raw + f->recs_off, off = f->recs_off
+	    ; (d = dnst_file_rec(f, off)); off = dnst_file_next(f, off, d)) {
+		memcpy(recs, (uint8_t *)d - f->pre, f->pre + dnst_sz(d));
+		recs += f->pre + dnst_sz(d);
+	}
+	free(f->raw);
+	f->buf = f->raw = raw;
+	f->recs = raw + f->recs_off;
+	if (f->msm_ids)
+		f->msm_ids = (void *)(raw + sizeof(dnst_file_hdr)
+		                          + sizeof(uint32_t));
+	f->end = recs;
+	f->end_off = f->end - f->buf;
+	f->dict = NULL;
+	f->dict_sz = 0;
+	memset(f->ftr.hour_off, 0, sizeof(f->ftr.hour_off));
+	return 0;
+}
+
+uint64_t dnst_file_seek(dnst_file *f, uint32_t t)
+{
+	dnst *d;
+	uint64_t off;
+
+	if (f->has_ftr && dnst_file_sorted(f)
+	&&  t >= f->ftr.day && t - f->ftr.day <= 86400
+	&&  (t - f->ftr.day) % 3600 == 0
+	&&  (off = f->ftr.hour_off[(t - f->ftr.day) / 3600]) >= f->recs_off
+	&&  off <= f->end_off)
+		return off;
+
+	for ( off = f->recs_off; (d = dnst_file_rec(f, off))
+	    ; off = dnst_file_next(f, off, d)) {
+		if (d->time >= t)
+			return off;
+	}
+	return f->end_off;
+}
+
+int dnst_idx_add(dnst_idx *idx, uint64_t off, const dnst *d)
+{
+	if (idx->n == idx->sz) {
+		size_t new_sz = idx->sz ? idx->sz * 2 : 4096;
+		uint64_t *new_off;
+		uint32_t *new_time, *new_prb_id;
+		uint8_t *new_af;
+
+		if (!(new_off = realloc(idx->off, new_sz * sizeof(uint64_t))))
+			return -1;
+		idx->off = new_off;
+		if (!(new_time = realloc(idx->time, new_sz * sizeof(uint32_t))))
+			return -1;
+		idx->time = new_time;
+		if (!(new_prb_id = realloc(idx->prb_id, new_sz * sizeof(uint32_t))))
+			return -1;
+		idx->prb_id = new_prb_id;
+		if (!(new_af = realloc(idx->af, new_sz)))
+			return -1;
+		idx->af = new_af;
+		idx->sz = new_sz;
+	}
+	idx->off[idx->n] = off;
+	idx->time[idx->n] = d->time;
+	idx->prb_id[idx->n] = d->prb_id;
+	idx->af[idx->n] = d->af;
+	idx->n += 1;
+	return 0;
+}
+
+int dnst_idx_save(const dnst_idx *idx, const char *fn, uint64_t dnst_sz)
+{
+	dnst_idx_hdr hdr;
+	FILE *fh;
+	int r = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DNST_IDX_MAGIC, 4);
+	hdr.version = DNST_IDX_VERSION;
+	hdr.n_recs = idx->n;
+	hdr.dnst_sz = dnst_sz;
+	if (!(fh = fopen(fn, "wb")))
+		return -1;
+	if (!fwrite(&hdr, sizeof(hdr), 1, fh)
+	||  (idx->n && (fwrite(idx->off, sizeof(uint64_t), idx->n, fh) != idx->n
+	            ||  fwrite(idx->time, sizeof(uint32_t), idx->n, fh) != idx->n
+	            ||  fwrite(idx->prb_id, sizeof(uint32_t), idx->n, fh) != idx->n
+	            ||  fwrite(idx->af, 1, idx->n, fh) != idx->n)))
+		r = -1;
+	if (fclose(fh))
+		r = -1;
+	return r;
+}
+
+int dnst_idx_load(dnst_idx *idx, const char *fn, uint64_t dnst_sz)
+{
+	int fd;
+	struct stat st;
+	dnst_idx_hdr hdr;
+	uint8_t *map;
+
+	memset(idx, 0, sizeof(*idx));
+	if ((fd = open(fn, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr)
+	||  (map = mmap( NULL, st.st_size, PROT_READ
+	               , MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, DNST_IDX_MAGIC, 4) != 0
+	||  hdr.version != DNST_IDX_VERSION || hdr.dnst_sz != dnst_sz
+	||  (uint64_t)st.st_size != sizeof(hdr) + hdr.n_recs *
+	    (sizeof(uint64_t) + 2 * sizeof(uint32_t) + sizeof(uint8_t))) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	idx->map = map;
+	idx->map_sz = st.st_size;
+	idx->n = hdr.n_recs;
+	idx->off = (void *)(map + sizeof(hdr));
+	idx->time = (void *)(idx->off + idx->n);
+	idx->prb_id = idx->time + idx->n;
+	idx->af = (void *)(idx->prb_id + idx->n);
+	return 0;
+}
+
+void dnst_idx_free(dnst_idx *idx)
+{
+	if (idx->map)
+		munmap(idx->map, idx->map_sz);
+	else {
+		free(idx->off);
+		free(idx->time);
+		free(idx->prb_id);
+		free(idx->af);
+	}
+	memset(idx, 0, sizeof(*idx));
+}
+
+size_t dnst_idx_seek(const dnst_idx *idx, size_t pos, uint32_t t)
+{
+	size_t lo = pos, hi = idx->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->time[mid] < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+uint32_t dnst_file_msm_id(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	if (!slash)
+		return 0;
+	while (slash > path && slash[-1] != '/')
+		slash--;
+	return strtoul(slash, NULL, 10);
+}
+
+static void dnst_writer_init(dnst_writer *w, FILE *fh, uint32_t msm_id,
+    uint8_t flags, dnst_idx *idx)
+{
+	memset(w, 0, sizeof(*w));
+	w->fh = fh;
+	w->idx = idx;
+	memcpy(w->hdr.magic, DNST_FILE_MAGIC, 4);
+	w->hdr.version = DNST_FILE_VERSION;
+	w->hdr.flags = flags;
+	w->hdr.hdr_sz = sizeof(dnst_file_hdr);
+	w->hdr.msm_id = msm_id;
+	w->ftr.min_time = 0xFFFFFFFF;
+	/* Sorted until proven otherwise */
+	w->ftr.flags = DNST_FILE_SORTED | (flags & ( DNST_FILE_LZ4
+	                                           | DNST_FILE_DICT
+	                                           | DNST_FILE_MERGED));
+	w->pre = flags & DNST_FILE_MERGED ? sizeof(uint32_t) : 0;
+	w->hdr_pos = ftell(fh);
+}
+
+int dnst_writer_start(dnst_writer *w, FILE *fh, uint32_t msm_id, uint8_t flags,
+    dnst_idx *idx)
+{
+	dnst_writer_init(w, fh, msm_id, flags & ~DNST_FILE_MERGED, idx);
+#ifndef HAVE_LIBLZ4
+	if (flags & DNST_FILE_LZ4) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+	w->off = w->raw_off = sizeof(dnst_file_hdr);
+	return fwrite(&w->hdr, sizeof(dnst_file_hdr), 1, fh) ? 0 : -1;
+}
+
+int dnst_writer_start_merged(dnst_writer *w, FILE *fh, const uint32_t *msm_ids,
+    size_t n_msms, uint8_t flags, dnst_idx *idx)
+{
+	uint32_t n = n_msms;
+	size_t hdr_sz = sizeof(dnst_file_hdr) + (1 + n_msms) * sizeof(uint32_t);
+
+	if (hdr_sz > UINT16_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	dnst_writer_init(w, fh, 0, flags | DNST_FILE_MERGED, idx);
+#ifndef HAVE_LIBLZ4
+	if (flags & DNST_FILE_LZ4) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+	w->hdr.hdr_sz = hdr_sz;
+	w->off = w->raw_off = hdr_sz;
+	return fwrite(&w->hdr, sizeof(dnst_file_hdr), 1, fh)
+	    && fwrite(&n, sizeof(n), 1, fh)
+	    && (!n_msms || fwrite(msm_ids, sizeof(uint32_t), n_msms, fh) == n_msms)
+	    ? 0 : -1;
+}
+
+/* Compress and write the records collected in blk */
+static int dnst_writer_flush(dnst_writer *w)
+{
+	dnst_file_blk *new_blks, *b;
+	uint8_t *data = w->blk;
+	size_t sz = w->blk_len;
+#ifdef HAVE_LIBLZ4
+	size_t bound = LZ4_compressBound(w->blk_len);
+	uint8_t *new_cblk;
+	int csz;
+
+	if (bound > w->cblk_sz) {
+		if (!(new_cblk = realloc(w->cblk, bound)))
+			return -1;
+		w->cblk = new_cblk;
+		w->cblk_sz = bound;
+	}
+	if ((csz = LZ4_compress_default( (const char *)w->blk, (char *)w->cblk
+	                               , w->blk_len, w->cblk_sz)) > 0
+	&&  (size_t)csz < w->blk_len) {
+		data = w->cblk;
+		sz = csz;
+	}
+#endif
+	if (w->n_blks == w->blks_sz) {
+		size_t new_sz = w->blks_sz ? w->blks_sz * 2 : 64;
+
+		if (!(new_blks = realloc(w->blks, new_sz * sizeof(dnst_file_blk))))
+			return -1;
+		w->blks = new_blks;
+		w->blks_sz = new_sz;
+	}
+	b = &w->blks[w->n_blks++];
+	b->off = w->off;
+	b->raw_off = w->blk_raw_off;
+	b->sz = sz;
+	b->raw_sz = w->blk_len;
+	w->off += sz;
+	w->blk_len = 0;
+	return fwrite(data, sz, 1, w->fh) ? 0 : -1;
+}
+
+/* FNV-1a of the reply, without its ID */
+static uint32_t dnst_msg_hash(const uint8_t *msg, uint16_t len)
+{
+	uint32_t h = 2166136261U ^ len;
+	uint16_t i;
+
+	for (i = 2; i < len; i++)
+		h = (h ^ msg[i]) * 16777619U;
+	return h;
+}
+
+static int dnst_writer_grow_slots(dnst_writer *w)
+{
+	size_t n_slots = w->n_slots ? w->n_slots * 2 : 4096;
+	uint32_t *slots, h;
+	uint16_t len;
+	size_t i, off;
+
+	if (!(slots = calloc(n_slots, sizeof(uint32_t))))
+		return -1;
+	for (i = 0; i < w->n_slots; i++) {
+		if (!(off = w->slots[i]))
+			continue;
+		memcpy(&len, w->dict + off - 1, sizeof(len));
+		h = dnst_msg_hash(w->dict + off - 1 + sizeof(len), len);
+		while (slots[h & (n_slots - 1)])
+			h++;
+		slots[h & (n_slots - 1)] = off;
+	}
+	free(w->slots);
+	w->slots = slots;
+	w->n_slots = n_slots;
+	return 0;
+}
+
+/* Returns the record referring to the reply (or observation) of d in the
+ * dictionary, or d itself when it has neither.
+ */
+static dnst *dnst_writer_intern(dnst_writer *w, dnst *d)
+{
+	uint8_t *msg = dnst_msg(d), *entry, *new_dict;
+	size_t entry_sz = (sizeof(uint16_t) + d->len + 3) & ~(size_t)3;
+	dnst *ref = (dnst *)w->ref;
+	dnst_msg_ref msg_ref;
+	uint32_t h, off;
+	uint16_t len;
+
+	if ((d->error != DNST_OK && d->error != DNST_OBS) || d->len < 12
+	||  w->dict_len + entry_sz >= UINT32_MAX)
+		return d;
+	if (w->n_entries * 2 >= w->n_slots && dnst_writer_grow_slots(w))
+		return NULL;
+
+	for ( h = dnst_msg_hash(msg, d->len)
+	    ; (off = w->slots[h & (w->n_slots - 1)]); h++) {
+		entry = w->dict + off - 1;
+		memcpy(&len, entry, sizeof(len));
+		if (len == d->len
+		&&  memcmp(entry + sizeof(len) + 2, msg + 2, len - 2) == 0)
+			break;
+	}
+	if (!off) {
+		if (w->dict_len + entry_sz > w->dict_sz) {
+			size_t new_sz = w->dict_sz ? w->dict_sz * 2 : 65536;
+
+			while (new_sz < w->dict_len + entry_sz)
+				new_sz *= 2;
+			if (!(new_dict = realloc(w->dict, new_sz)))
+				return NULL;
+			w->dict = new_dict;
+			w->dict_sz = new_sz;
+		}
+		entry = w->dict + w->dict_len;
+		memset(entry, 0, entry_sz);
+		memcpy(entry, &d->len, sizeof(d->len));
+		memcpy(entry + sizeof(d->len) + 2, msg + 2, d->len - 2);
+		off = w->dict_len + 1;
+		w->slots[h & (w->n_slots - 1)] = off;
+		w->dict_len += entry_sz;
+		w->n_entries += 1;
+	}
+	memcpy(ref, d, msg - (uint8_t *)d);
+	ref->error |= DNST_MSG_REF;
+	ref->len = sizeof(dnst_msg_ref);
+	memset(&msg_ref, 0, sizeof(msg_ref));
+	msg_ref.off = off - 1;
+	memcpy(msg_ref.id, msg, sizeof(msg_ref.id));
+	memcpy(dnst_msg(ref), &msg_ref, sizeof(msg_ref));
+	return ref;
+}
+
+/* Append record d, after its msm_id at pre when merged, to blk, flushing blk
+ * first when d does not fit.
+ */
+static int dnst_writer_add(dnst_writer *w, const uint8_t *pre, dnst *d)
+{
+	size_t sz = w->pre + dnst_sz(d);
+	uint8_t *new_blk;
+
+	if (w->blk_len && w->blk_len + sz > DNST_FILE_BLK_SZ
+	&&  dnst_writer_flush(w))
+		return -1;
+	if (!w->blk) {
+		if (!(w->blk = malloc(DNST_FILE_BLK_SZ)))
+			return -1;
+	}
+	if (sz > DNST_FILE_BLK_SZ && !w->blk_len) {
+		/* A single record larger than a block */
+		if (!(new_blk = realloc(w->blk, sz)))
+			return -1;
+		w->blk = new_blk;
+	}
+	if (!w->blk_len)
+		w->blk_raw_off = w->raw_off;
+	memcpy(w->blk + w->blk_len, pre, w->pre);
+	memcpy(w->blk + w->blk_len + w->pre, d, sz - w->pre);
+	w->blk_len += sz;
+	w->raw_off += sz;
+	if (sz > DNST_FILE_BLK_SZ)
+		return dnst_writer_flush(w);
+	return 0;
+}
+
+/* Write record d (after its msm_id at pre), or add it to blk when
+ * compressing
+ */
+static int dnst_writer_put(dnst_writer *w, const uint8_t *pre, dnst *d)
+{
+	size_t sz = w->pre + dnst_sz(d);
+
+	if (w->hdr.flags & DNST_FILE_LZ4)
+		return dnst_writer_add(w, pre, d);
+	if ((w->pre && !fwrite(pre, w->pre, 1, w->fh))
+	||  !fwrite(d, dnst_sz(d), 1, w->fh))
+		return -1;
+	w->off += sz;
+	w->raw_off += sz;
+	return 0;
+}
+
+int dnst_writer_write(dnst_writer *w, const uint8_t *recs, size_t sz)
+{
+	const uint8_t *eor = recs + sz, *p;
+	int per_rec = (w->hdr.flags & (DNST_FILE_LZ4 | DNST_FILE_DICT)) != 0;
+	uint64_t off;
+	dnst *d, *rec;
+
+	for ( p = recs; p < eor
+	    ; p = (const uint8_t *)dnst_next((dnst *)(p + w->pre))) {
+		d = (dnst *)(p + w->pre);
+		off = per_rec ? w->raw_off : w->raw_off + (p - recs);
+		if (w->ftr.n_recs++ == 0)
+			w->ftr.day = d->time - d->time % 86400;
+		if (d->time < w->prev_time)
+			w->ftr.flags &= ~DNST_FILE_SORTED;
+		if (d->time < w->ftr.min_time)
+			w->ftr.min_time = d->time;
+		if (d->time > w->ftr.max_time)
+			w->ftr.max_time = d->time;
+		w->prev_time = d->time;
+		if (w->idx && dnst_idx_add(w->idx, off, d))
+			return -1;
+
+		while ((w->ftr.flags & DNST_FILE_SORTED) && w->n_hours < 25
+		    && d->time >= (uint64_t)w->ftr.day + w->n_hours * 3600)
+			w->ftr.hour_off[w->n_hours++] = off;
+
+		if (!per_rec)
+			continue;
+		if (!(rec = w->hdr.flags & DNST_FILE_DICT
+		          ? dnst_writer_intern(w, d) : d)
+		||  dnst_writer_put(w, p, rec))
+			return -1;
+	}
+	if (per_rec)
+		return 0;
+	w->off += sz;
+	w->raw_off += sz;
+	return sz && !fwrite(recs, sz, 1, w->fh) ? -1 : 0;
+}
+
+int dnst_writer_finish(dnst_writer *w)
+{
+	static const uint8_t zeros[8] = { 0 };
+	dnst_file_dict dict;
+	size_t pad;
+	long pos;
+	int r = 0;
+
+	if ((w->hdr.flags & DNST_FILE_LZ4) && w->blk_len
+	&&  dnst_writer_flush(w))
+		r = -1;
+
+	else if ((w->hdr.flags & DNST_FILE_DICT)
+	     &&  w->dict_len && !fwrite(w->dict, w->dict_len, 1, w->fh))
+		r = -1;
+	else {
+		dict.off = w->off;
+		dict.sz = w->dict_len;
+		w->off += w->dict_len;
+		/* Align the table of blocks */
+		pad = (8 - w->off % 8) % 8;
+		if (!(w->hdr.flags & (DNST_FILE_LZ4 | DNST_FILE_DICT)))
+			; /* pass */
+
+		else if ((pad && !fwrite(zeros, pad, 1, w->fh))
+		     ||  (w->n_blks && fwrite( w->blks, sizeof(dnst_file_blk)
+		                             , w->n_blks, w->fh) != w->n_blks)
+		     ||  ((w->hdr.flags & DNST_FILE_DICT)
+		          && !fwrite(&dict, sizeof(dict), 1, w->fh)))
+			r = -1;
+		else
+			w->off += pad + w->n_blks * sizeof(dnst_file_blk)
+			        + (w->hdr.flags & DNST_FILE_DICT ? sizeof(dict) : 0);
+	}
+	w->ftr.ftr_sz = sizeof(dnst_file_ftr) + w->n_blks * sizeof(dnst_file_blk)
+	              + (w->hdr.flags & DNST_FILE_DICT ? sizeof(dict) : 0);
+	dnst_writer_free(w);
+	if (r)
+		return -1;
+
+	if (w->ftr.n_recs == 0)
+		w->ftr.min_time = 0;
+	if (!(w->ftr.flags & DNST_FILE_SORTED))
+		memset(w->ftr.hour_off, 0, sizeof(w->ftr.hour_off));
+	else while (w->n_hours < 25)
+		w->ftr.hour_off[w->n_hours++] = w->raw_off;
+	memcpy(w->ftr.magic, DNST_FILE_MAGIC, 4);
+	if (!fwrite(&w->ftr, sizeof(dnst_file_ftr), 1, w->fh))
+		return -1;
+	w->off += sizeof(dnst_file_ftr);
+
+	if (w->hdr.flags == w->ftr.flags || w->hdr_pos < 0)
+		return 0;
+
+	/* Not seekable (a pipe) is fine; readers prefer the footer flags */
+	w->hdr.flags = w->ftr.flags;
+	if ((pos = ftell(w->fh)) < 0 || fseek(w->fh, w->hdr_pos, SEEK_SET))
+		return 0;
+	if (!fwrite(&w->hdr, sizeof(dnst_file_hdr), 1, w->fh))
+		return -1;
+	return fseek(w->fh, pos, SEEK_SET) ? -1 : 0;
+}
+
+void dnst_writer_free(dnst_writer *w)
+{
+	free(w->blk);
+	w->blk = NULL;
+	w->blk_len = 0;
+	free(w->cblk);
+	w->cblk = NULL;
+	w->cblk_sz = 0;
+	free(w->blks);
+	w->blks = NULL;
+	w->blks_sz = 0;
+	free(w->dict);
+	w->dict = NULL;
+	w->dict_len = w->dict_sz = 0;
+	free(w->slots);
+	w->slots = NULL;
+	w->n_slots = w->n_entries = 0;
+}
@@ -0,0 +1,356 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __DNST_FILE_H_
+#define __DNST_FILE_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "dnst.h"
+
+/* A version 2 .dnst file is a header, the records and a footer.  Version 1
+ * files are just the records; they start with the time of the first record,
+ * which can never be the magic.
+ */
+#define DNST_FILE_MAGIC   "DNS\xFF"
+#define DNST_FILE_VERSION 2
+
+#define DNST_FILE_SORTED  1 /* Records are in time order */
+#define DNST_FILE_LZ4     2 /* Records are in LZ4 compressed blocks */
+#define DNST_FILE_DICT    4 /* Payloads are in a dictionary */
+#define DNST_FILE_MERGED  8 /* Records of several measurements */
+
+#define DNST_FILE_BLK_SZ  65536 /* Uncompressed size of a block */
+
+typedef struct dnst_file_hdr {
+	uint8_t  magic[4];
+	uint8_t  version;
+	uint8_t  flags;    /* As known when the file was started */
+	uint16_t hdr_sz;   /* Records start at this offset */
+	uint32_t msm_id;   /* 0 when unknown */
+} dnst_file_hdr;
+
+/* A DNST_FILE_MERGED file has the records of a day of several measurements
+ * in time order, each record preceded by its uint32_t msm_id.  msm_id in the
+ * header is 0, and the header is followed by an uint32_t with the number of
+ * measurements and their msm_id's (in the order they were merged).  Record
+ * offsets are of the msm_id's.
+ */
+
+typedef struct dnst_file_ftr {
+	uint64_t hour_off[25]; /* With DNST_FILE_SORTED, file offset of the
+	                        * first record at or after each hour from day.
+	                        * hour_off[24] is the start of the next day.
+	                        */
+	uint64_t n_recs;
+	uint32_t day;      /* Start of the (UTC) day of the first record */
+	uint32_t min_time;
+	uint32_t max_time;
+	uint32_t flags;    /* Final flags; these take precedence */
+	uint32_t ftr_sz;   /* Records end ftr_sz bytes before the end */
+	uint8_t  magic[4];
+} dnst_file_ftr;
+
+/* With DNST_FILE_LZ4 the records are in blocks of whole records, each
+ * compressed on its own, and the footer is preceded by a table of the
+ * blocks (counted in ftr_sz).  Record offsets, in hour_off and in the
+ * sidecar index, are the offsets the records would have in the
+ * uncompressed file.  A block that does not compress is stored as is
+ * (sz == raw_sz).
+ */
+typedef struct dnst_file_blk {
+	uint64_t off;      /* File offset of the block */
+	uint64_t raw_off;  /* Uncompressed offset of its first record */
+	uint32_t sz;
+	uint32_t raw_sz;
+} dnst_file_blk;
+
+/* With DNST_FILE_DICT, DNS replies are stored once in a dictionary after
+ * the records, with the message ID zeroed.  A record with DNST_MSG_REF in
+ * its error has a dnst_msg_ref as msg, with the offset of the reply in the
+ * dictionary and the ID to put back.  The dictionary is an uint16_t length
+ * followed by the reply, padded to 4 bytes, for each entry.  Its location
+ * is right in front of the footer (counted in ftr_sz, after any table of
+ * blocks).  Readers only get to see the records with their reply.
+ */
+#define DNST_MSG_REF 0x80
+
+typedef struct dnst_msg_ref {
+	uint32_t off;     /* Of the entry in the dictionary */
+	uint8_t  id[2];
+	uint16_t reserved;
+} dnst_msg_ref;
+
+typedef struct dnst_file_dict {
+	uint64_t off;     /* File offset of the dictionary */
+	uint64_t sz;
+} dnst_file_dict;
+
+/* A .dnst file (of any version) in memory */
+typedef struct dnst_file {
+	int            version;
+	int            has_ftr;
+	dnst_file_hdr  hdr;    /* Zeroed for version 1 files */
+	dnst_file_ftr  ftr;    /* Zeroed when there is no footer */
+	uint8_t       *buf;    /* Start of the file */
+	uint8_t       *recs;   /* Start of the records */
+	uint8_t       *end;    /* End of the records */
+	uint64_t       recs_off; /* Uncompressed offsets of the start */
+	uint64_t       end_off;  /* and the end of the records */
+	dnst_file_blk *blks;   /* With DNST_FILE_LZ4, until expanded */
+	size_t         n_blks;
+	size_t         blk;    /* The block in blk_buf, or n_blks */
+	uint8_t       *blk_buf;
+	size_t         blk_buf_sz;
+	uint8_t       *raw;    /* Allocated by dnst_file_expand */
+	uint8_t       *dict;   /* With DNST_FILE_DICT, until expanded */
+	uint64_t       dict_sz;
+	uint8_t       *rec_buf; /* rec, with room for an msm_id before it */
+	dnst          *rec;    /* A record with its reply from dict */
+	size_t         rec_sz; /* The stored size of that record */
+	size_t         pre;    /* Size of the msm_id before each record */
+	uint32_t      *msm_ids; /* With DNST_FILE_MERGED, from the header */
+	size_t         n_msms;
+} dnst_file;
+
+/* Determine the version and find the records of the sz bytes .dnst file in
+ * buf.  Returns the version, or -1 when the file is of an unknown version
+ * (or compressed without LZ4 support).  A version 2 file without a footer
+ * (i.e. still being written) has its records running until the end, or has
+ * no records when compressed.
+ */
+int dnst_file_init(dnst_file *f, uint8_t *buf, size_t sz);
+
+/* Free the decompression buffers */
+void dnst_file_done(dnst_file *f);
+
+/* The final flags, as far as known */
+static inline uint32_t dnst_file_flags(dnst_file *f)
+{ return f->has_ftr ? f->ftr.flags : f->hdr.flags; }
+
+static inline int dnst_file_sorted(dnst_file *f)
+{ return (dnst_file_flags(f) & DNST_FILE_SORTED) != 0; }
+
+static inline int dnst_file_compressed(dnst_file *f)
+{ return (dnst_file_flags(f) & DNST_FILE_LZ4) != 0; }
+
+dnst *dnst_file_blk_rec(dnst_file *f, uint64_t off);
+dnst *dnst_file_deref(dnst_file *f, dnst *d);
+
+/* The record at (uncompressed) offset off, or NULL when there is no
+ * complete record there.  In a compressed file the block holding the
+ * record is decompressed, and the record is valid until a record from
+ * another block is requested.  A record referring to the dictionary is
+ * returned with its reply, and is valid until the next record is
+ * requested.
+ */
+static inline dnst *dnst_file_rec(dnst_file *f, uint64_t off)
+{
+	dnst *d;
+
+	if (f->n_blks)
+		d = dnst_file_blk_rec(f, off);
+
+	else if (off < f->recs_off || off + f->pre + 16 >= f->end_off
+	     || !dnst_fits((d = (dnst *)(f->buf + off + f->pre)), f->end))
+		return NULL;
+
+	return d && (d->error & DNST_MSG_REF) ? dnst_file_deref(f, d) : d;
+}
+
+/* The offset of the record following d, which is at offset off */
+static inline uint64_t dnst_file_next(dnst_file *f, uint64_t off, dnst *d)
+{ return off + f->pre + (d == f->rec ? f->rec_sz : dnst_sz(d)); }
+
+/* The msm_id of record d, from the header when the file is not merged */
+static inline uint32_t dnst_file_rec_msm_id(dnst_file *f, dnst *d)
+{
+	uint32_t msm_id;
+
+	if (!f->pre)
+		return f->hdr.msm_id;
+	memcpy(&msm_id, (uint8_t *)d - f->pre, sizeof(msm_id));
+	return msm_id;
+}
+
+/* Decompress all blocks of a compressed file into a single buffer, and
+ * put the replies from the dictionary in the records.  The result takes
+ * the place of the file in buf, recs and end.  When the file had a
+ * dictionary, record offsets (of the hours and in a sidecar index) no
+ * longer apply, and the hourly offsets are cleared.
+ */
+int dnst_file_expand(dnst_file *f);
+
+/* Returns the offset of the first record at or after t in a sorted file.
+ * The hourly offsets are used when t is on the hour within the day of a
+ * version 2 file, otherwise the records are scanned up to t.
+ */
+uint64_t dnst_file_seek(dnst_file *f, uint32_t t);
+
+/* A sidecar index (<file>.dnst.idx) has the time, prb_id and af of each
+ * record in dense arrays, together with the offset of the record in the
+ * .dnst file, so records can be selected without touching their payload.
+ * The size of the .dnst file is in the header to detect a stale index.
+ */
+#define DNST_IDX_MAGIC   "DNI\xFF"
+#define DNST_IDX_VERSION 1
+
+typedef struct dnst_idx_hdr {
+	uint8_t  magic[4];
+	uint32_t version;
+	uint64_t n_recs;
+	uint64_t dnst_sz;  /* Size of the indexed .dnst file */
+} dnst_idx_hdr;            /* followed by off[n], time[n], prb_id[n], af[n] */
+
+typedef struct dnst_idx {
+	size_t    n;
+	size_t    sz;      /* Allocated entries, when not mapped */
+	uint64_t *off;     /* File offset of each record */
+	uint32_t *time;
+	uint32_t *prb_id;
+	uint8_t  *af;
+	uint8_t  *map;     /* When loaded from a sidecar */
+	size_t    map_sz;
+} dnst_idx;
+
+int dnst_idx_add(dnst_idx *idx, uint64_t off, const dnst *d);
+
+/* Write idx for a .dnst file of dnst_sz bytes to fn.  Returns 0 on success
+ * and -1 on error (with errno set).
+ */
+int dnst_idx_save(const dnst_idx *idx, const char *fn, uint64_t dnst_sz);
+
+/* Map the sidecar index fn for a .dnst file of dnst_sz bytes.  Returns 0 on
+ * success, and -1 when there is no (up to date) sidecar.
+ */
+int dnst_idx_load(dnst_idx *idx, const char *fn, uint64_t dnst_sz);
+
+void dnst_idx_free(dnst_idx *idx);
+
+/* The first entry at or after t from pos, in the index of a sorted file */
+size_t dnst_idx_seek(const dnst_idx *idx, size_t pos, uint32_t t);
+
+/* The measurement ID from the name of the directory path is in, or 0 */
+uint32_t dnst_file_msm_id(const char *path);
+
+/* Writes a version 2 file while gathering the statistics for the footer.
+ * Records are written with dnst_writer_write in any number of pieces,
+ * holding complete records only, each preceded by its msm_id when merged.
+ * When idx is not NULL, the records are added to it for a sidecar index.
+ * With DNST_FILE_LZ4, records are collected in blk and written a
+ * compressed block at a time.  With
+ * DNST_FILE_DICT, replies are interned in dict, found by their hash in
+ * slots (the entry offsets + 1), and records are written with a reference.
+ */
+typedef struct dnst_writer {
+	FILE          *fh;
+	dnst_idx      *idx;
+	dnst_file_hdr  hdr;
+	dnst_file_ftr  ftr;
+	long           hdr_pos;   /* Position of the header in fh, or -1 */
+	uint64_t       off;       /* File offset of the next write, or the
+	                           * file size once finished */
+	uint64_t       raw_off;   /* Uncompressed offset of the next record */
+	uint32_t       prev_time;
+	int            n_hours;   /* Number of hour_off's set */
+	uint8_t       *blk;
+	size_t         blk_len;
+	uint64_t       blk_raw_off;
+	uint8_t       *cblk;
+	size_t         cblk_sz;
+	dnst_file_blk *blks;
+	size_t         n_blks;
+	size_t         blks_sz;
+	uint8_t       *dict;
+	size_t         dict_len;
+	size_t         dict_sz;
+	uint32_t      *slots;
+	size_t         n_slots;
+	size_t         n_entries;
+	uint32_t       ref[(sizeof(dnst) + sizeof(dnst_msg_ref)) / 4];
+	size_t         pre;       /* Size of the msm_id's before records */
+} dnst_writer;
+
+/* Write the header.  flags are the DNST_FILE_* flags as far as known now,
+ * DNST_FILE_LZ4 to compress the records and DNST_FILE_DICT to intern the
+ * replies.
+ */
+int dnst_writer_start(dnst_writer *w, FILE *fh, uint32_t msm_id, uint8_t flags,
+    dnst_idx *idx);
+
+/* Write the header of a DNST_FILE_MERGED file of n_msms measurements */
+int dnst_writer_start_merged(dnst_writer *w, FILE *fh, const uint32_t *msm_ids,
+    size_t n_msms, uint8_t flags, dnst_idx *idx);
+
+int dnst_writer_write(dnst_writer *w, const uint8_t *recs, size_t sz);
+
+/* Write the footer, and update the header flags when fh is seekable */
+int dnst_writer_finish(dnst_writer *w);
+
+/* Free the buffers of an unfinished writer (finish frees them too) */
+void dnst_writer_free(dnst_writer *w);
+
+/* A measurement of a merged file, in a table by msm_id */
+typedef struct dnst_msm_slot {
+	uint32_t               msm_id; /* 0 when the slot is free */
+	const struct dnst_msm *msm;
+} dnst_msm_slot;
+
+/* Iterates over the .dnst files of a measurement directory, a day at a
+ * time.  With a sidecar index, the time of cur comes from the index, and
+ * cur is only dereferenced by whoever processes it.
+ */
+typedef struct dnst_iter {
+	struct tm    start;
+	struct tm    stop;
+	char         msm_dir[4096];
+	unsigned int msm_id;
+	int          fd;
+	uint8_t     *buf;
+	size_t       buf_sz;
+	dnst_file    f;
+	uint64_t     off;         /* Offset of cur in f */
+	uint64_t     end_off;     /* End of the records to iterate */
+	dnst        *cur;
+	uint32_t     cur_time;
+	dnst_idx     idx;         /* idx.map is NULL without sidecar */
+	size_t       idx_pos;     /* Position of cur in idx */
+	size_t       idx_end;
+	int          filter;      /* Check each record against the range */
+	uint32_t     t_start;     /* that is, from t_start */
+	uint32_t     t_stop;      /* up to t_stop, on unsorted files */
+	const struct dnst_msm *msm; /* Of msm_id, or of the last record */
+	dnst_msm_slot *msm_slots;   /* Of f.msm_ids, looked up once */
+	size_t       msm_mask;
+	struct iter_shard *shard;   /* Where the records go in iter_dnsts */
+} dnst_iter;
+
+#endif
@@ -0,0 +1,511 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dnst-obs.h"
+#include "rr-iter.h"
+
+/* The measurements known without a measurements file, by msm_id */
+static dnst_msm dnst_msms_builtin[] = {
+	{  8310237, DNST_MSM_WHOAMI_G    ,  0 },
+	{  8310245, DNST_MSM_WHOAMI_A    ,  0 },
+	{  8310250, DNST_MSM_QNAMEMIN    ,  0 },
+	{  8310360, DNST_MSM_TCP4        ,  0 },
+	{  8310364, DNST_MSM_TCP6        ,  0 },
+	{  8310366, DNST_MSM_WHOAMI_6    ,  0 },
+	{  8311777, DNST_MSM_NXDOMAIN    ,  0 },
+	{  8926853, DNST_MSM_SECURE      ,  0 }, /*  secure.d2a1n1.rootcanary.net A */
+	{  8926854, DNST_MSM_BOGUS       ,  0 }, /*   bogus.d2a1n1.rootcanary.net A */
+	{  8926855, DNST_MSM_SECURE      ,  1 }, /*  secure.d2a3n1.rootcanary.net A */
+	{  8926856, DNST_MSM_BOGUS       ,  1 }, /*   bogus.d2a3n1.rootcanary.net A */
+	{  8926857, DNST_MSM_SECURE      ,  2 }, /*  secure.d2a5n1.rootcanary.net A */
+	{  8926858, DNST_MSM_BOGUS       ,  2 }, /*   bogus.d2a5n1.rootcanary.net A */
+	{  8926859, DNST_MSM_SECURE      ,  3 }, /*  secure.d2a6n1.rootcanary.net A */
+	{  8926860, DNST_MSM_BOGUS       ,  3 }, /*   bogus.d2a6n1.rootcanary.net A */
+	{  8926861, DNST_MSM_SECURE      ,  4 }, /*  secure.d2a7n1.rootcanary.net A */
+	{  8926862, DNST_MSM_BOGUS       ,  4 }, /*   bogus.d2a7n1.rootcanary.net A */
+	{  8926863, DNST_MSM_SECURE      ,  5 }, /*  secure.d2a8n3.rootcanary.net A */
+	{  8926864, DNST_MSM_BOGUS       ,  5 }, /*   bogus.d2a8n3.rootcanary.net A */
+	{  8926865, DNST_MSM_SECURE      ,  6 }, /* secure.d2a10n3.rootcanary.net A */
+	{  8926866, DNST_MSM_BOGUS       ,  6 }, /*  bogus.d2a10n3.rootcanary.net A */
+	{  8926867, DNST_MSM_SECURE      ,  7 }, /* secure.d2a12n3.rootcanary.net A */
+	{  8926868, DNST_MSM_BOGUS       ,  7 }, /*  bogus.d2a12n3.rootcanary.net A */
+	{  8926869, DNST_MSM_SECURE      ,  8 }, /* secure.d2a13n3.rootcanary.net A */
+	{  8926870, DNST_MSM_BOGUS       ,  8 }, /*  bogus.d2a13n3.rootcanary.net A */
+	{  8926871, DNST_MSM_SECURE      ,  9 }, /* secure.d2a14n3.rootcanary.net A */
+	{  8926872, DNST_MSM_BOGUS       ,  9 }, /*  bogus.d2a14n3.rootcanary.net A */
+	{  8926873, DNST_MSM_SECURE      , 10 }, /* secure.d2a15n3.rootcanary.net A */
+	{  8926874, DNST_MSM_BOGUS       , 10 }, /*  bogus.d2a15n3.rootcanary.net A */
+	{  8926875, DNST_MSM_SECURE      , 11 }, /* secure.d2a16n3.rootcanary.net A */
+	{  8926876, DNST_MSM_BOGUS       , 11 }, /*  bogus.d2a16n3.rootcanary.net A */
+	{  8926887, DNST_MSM_DS_SECURE   ,  0 }, /*  secure.d3a8n3.rootcanary.net A */
+	{  8926888, DNST_MSM_DS_BOGUS    ,  0 }, /*   bogus.d3a8n3.rootcanary.net A */
+	{  8926911, DNST_MSM_DS_SECURE   ,  1 }, /*  secure.d4a8n3.rootcanary.net A */
+	{  8926912, DNST_MSM_DS_BOGUS    ,  1 }, /*   bogus.d4a8n3.rootcanary.net A */
+	{ 15283670, DNST_MSM_NOT_TA_19036,  0 },
+	{ 15283671, DNST_MSM_NOT_TA_20326,  0 },
+	{ 16430285, DNST_MSM_IS_TA_20326 ,  0 },
+	{ 19185448, DNST_MSM_FLAGDAY     ,  0 }, /* <random>.<prb_id>.<time>.flagday.rootcanary.net A */
+	{ 19256455, DNST_MSM_FLAGDAY     ,  0 }
+};
+
+static dnst_msm *dnst_msms = dnst_msms_builtin;
+static size_t  n_dnst_msms = sizeof(dnst_msms_builtin) / sizeof(dnst_msm);
+
+/* The names of the DNST_MSM_* kinds in a measurements file, and the number
+ * of indices of each.
+ */
+static const struct {
+	const char  *name;
+	unsigned int n;
+} dnst_msm_kinds[] = {
+	{ "unknown"     ,  1 }, { "whoami_g"    ,  1 }, { "whoami_a"    ,  1 },
+	{ "whoami_6"    ,  1 }, { "secure"      , 12 }, { "bogus"       , 12 },
+	{ "ds_secure"   ,  2 }, { "ds_bogus"    ,  2 }, { "qnamemin"    ,  1 },
+	{ "tcp4"        ,  1 }, { "tcp6"        ,  1 }, { "nxdomain"    ,  1 },
+	{ "not_ta_19036",  1 }, { "not_ta_20326",  1 }, { "is_ta_20326" ,  1 },
+	{ "flagday"     ,  1 }
+};
+
+static int dnst_msm_cmp(const void *x, const void *y)
+{ return ((const dnst_msm *)x)->msm_id != ((const dnst_msm *)y)->msm_id
+       ? (((const dnst_msm *)x)->msm_id > ((const dnst_msm *)y)->msm_id ? 1 : -1)
+       : 0; }
+
+const dnst_msm *dnst_msm_get(uint32_t msm_id)
+{
+	dnst_msm key;
+
+	key.msm_id = msm_id;
+	return bsearch( &key, dnst_msms, n_dnst_msms
+	              , sizeof(dnst_msm), dnst_msm_cmp);
+}
+
+int dnst_msms_load(const char *fn)
+{
+	char line[1024], name[64];
+	dnst_msm *msms, *msm, m;
+	size_t n = n_dnst_msms, sz = n_dnst_msms + 64, lineno = 0;
+	unsigned long msm_id;
+	FILE *fh;
+	int r = 0, n_scanned;
+
+	if (!(fh = fopen(fn, "r"))) {
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , fn, strerror(errno));
+		return -1;
+	}
+	if (!(msms = malloc(sz * sizeof(dnst_msm)))) {
+		fclose(fh);
+		return -1;
+	}
+	memcpy(msms, dnst_msms, n * sizeof(dnst_msm));
+	while (!r && fgets(line, sizeof(line), fh)) {
+		lineno += 1;
+		m.i = 0;
+		if ((n_scanned = sscanf( line, "%lu %63s %u"
+		                       , &msm_id, name, &m.i)) <= 0
+		||  line[strspn(line, " \t\r\n")] == '#')
+			continue;
+
+		for (m.kind = 0; m.kind < (int)(sizeof(dnst_msm_kinds)
+		                               / sizeof(dnst_msm_kinds[0])); m.kind++)
+			if (!strcmp(name, dnst_msm_kinds[m.kind].name))
+				break;
+		m.msm_id = msm_id;
+		if (n_scanned < 2 || msm_id != m.msm_id
+		||  m.kind == (int)(sizeof(dnst_msm_kinds) / sizeof(dnst_msm_kinds[0]))
+		||  m.i >= dnst_msm_kinds[m.kind].n) {
+			fprintf(stderr, "%s:%zu: Expected "
+			                "\"<msm_id> <kind> [ <index> ]\"\n"
+			              , fn, lineno);
+			r = -1;
+			break;
+		}
+		/* Measurements from the file replace the built-in ones */
+		for (msm = msms; msm < msms + n; msm++)
+			if (msm->msm_id == m.msm_id)
+				break;
+		if (msm == msms + n) {
+			if (n == sz) {
+				if (!(msm = realloc(msms, sz * 2 * sizeof(dnst_msm)))) {
+					r = -1;
+					break;
+				}
+				msms = msm;
+				sz *= 2;
+			}
+			msm = msms + n++;
+		}
+		*msm = m;
+	}
+	fclose(fh);
+	if (r) {
+		free(msms);
+		return r;
+	}
+	qsort(msms, n, sizeof(dnst_msm), dnst_msm_cmp);
+	if (dnst_msms != dnst_msms_builtin)
+		free(dnst_msms);
+	dnst_msms = msms;
+	n_dnst_msms = n;
+	return 0;
+}
+
+/* Whether the answer is the A record of the rootcanary web server */
+static int observe_canary(uint8_t *msg, size_t msg_len)
+{
+	rrset_spc   rrset_spc;
+	rrset      *rrset;
+	rrtype_iter rr_spc, *rr;
+
+	return RCODE_WIRE(msg) == RCODE_NOERROR
+	   && (rrset = rrset_answer(&rrset_spc, msg, msg_len))
+	   &&  rrset->rr_type == RRTYPE_A
+	   && (rr = rrtype_iter_init(&rr_spc, rrset))
+	   && (rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end)
+	   &&  rr->rr_i.rr_type[10] == 145 &&  rr->rr_i.rr_type[11] ==  97
+	   &&  rr->rr_i.rr_type[12] ==  20 &&  rr->rr_i.rr_type[13] ==  17;
+}
+
+/* The first address of the answer, when it is of rr_type */
+static int observe_addr(uint8_t *msg, size_t msg_len, uint16_t rr_type,
+    uint8_t *addr)
+{
+	rrset_spc   rrset_spc;
+	rrset      *rrset;
+	rrtype_iter rr_spc, *rr;
+	uint16_t    addr_len = rr_type == RRTYPE_AAAA ? 16 : 4;
+
+	if (RCODE_WIRE(msg) == RCODE_NOERROR
+	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
+	&&  rrset->rr_type == rr_type
+	&& (rr = rrtype_iter_init(&rr_spc, rrset))
+	&&  rr->rr_i.rr_type + 10 + addr_len <= rr->rr_i.pkt_end
+	&&  READ_U16(rr->rr_i.rr_type + 8) == addr_len) {
+		memcpy(addr, rr->rr_i.rr_type + 10, addr_len);
+		return 1;
+	}
+	return 0;
+}
+
+static void observe_nxdomain(uint8_t *msg, size_t msg_len, dnst_obs *obs)
+{
+	rrset_spc   rrset_spc;
+	rrset      *rrset = NULL;
+	rrtype_iter rr_spc, *rr = NULL;
+
+	if ((  RCODE_WIRE(msg) == RCODE_NXDOMAIN
+	    || RCODE_WIRE(msg) == RCODE_NOERROR)
+	&&  DNS_MSG_ANCOUNT(msg) == 0)
+		obs->verdict = CAP_DOESNT; /* No hijack, good! */
+
+	else if (RCODE_WIRE(msg) != RCODE_NOERROR
+	    || !(rrset = rrset_answer(&rrset_spc, msg, msg_len))
+	    ||   rrset->rr_type != RRTYPE_A
+	    || !(rr = rrtype_iter_init(&rr_spc, rrset)))
+		obs->verdict = CAP_BROKEN;
+	else {
+		obs->verdict = CAP_DOES;
+		for ( obs->n_addr4 = 0
+		    ; rr && obs->n_addr4 < sizeof(obs->addr4) / sizeof(obs->addr4[0])
+		    ; rr = rrtype_iter_next(rr), obs->n_addr4++)
+			memcpy(obs->addr4[obs->n_addr4], rr->rr_i.rr_type + 10, 4);
+		if (rr)
+			obs->flags |= DNST_OBS_MORE;
+	}
+}
+
+static void observe_whoami_g(uint8_t *msg, size_t msg_len, dnst_obs *obs)
+{
+	rrset_spc   rrset_spc;
+	rrset      *rrset;
+	rrtype_iter rr_spc, *rr;
+	int mask = 0;
+
+	if (RCODE_WIRE(msg) != RCODE_NOERROR
+	|| !(rrset = rrset_answer(&rrset_spc, msg, msg_len))
+	||   rrset->rr_type != RRTYPE_TXT)
+		; /* pass */
+	else for ( rr = rrtype_iter_init(&rr_spc, rrset)
+	         ; rr ; rr = rrtype_iter_next(rr)) {
+
+		uint16_t rd_len = READ_U16(rr->rr_i.rr_type + 8);
+		const uint8_t *rdata = rr->rr_i.rr_type + 10;
+		const uint8_t *eord  = rdata + rd_len;
+		uint8_t  txt_len;
+
+		if (eord > rr->rr_i.pkt_end)
+			break;
+		for (; rdata < eord; rdata += txt_len) {
+			char strbuf[80];
+
+			txt_len = *rdata;
+			rdata += 1;
+			if (txt_len > 20 &&
+			    memcmp(rdata, "edns0-client-subnet ", 20) == 0) {
+				const uint8_t *slash = rdata + txt_len - 1;
+				uint8_t numlen;
+
+				while (slash > rdata && *slash != '/')
+					slash--;
+				if (*slash == '/')
+					slash++;
+				numlen = txt_len - (slash - rdata);
+				if (numlen > sizeof(strbuf) - 1)
+					continue;
+				memcpy(strbuf, slash, numlen);
+				strbuf[numlen] = '\0';
+				mask = atoi(strbuf);
+				continue;
+			}
+			if (txt_len > sizeof(strbuf) - 1)
+				continue;
+			memcpy(strbuf, rdata, txt_len);
+			strbuf[txt_len] = '\0';
+			if (!strchr(strbuf, ':')) {
+				if (inet_pton(AF_INET, strbuf, obs->addr4[0]) == 1)
+					obs->flags |= DNST_OBS_ADDR4;
+
+			} else if (inet_pton(AF_INET6, strbuf, obs->addr6) == 1)
+				obs->flags |= DNST_OBS_ADDR6;
+		}
+	}
+	obs->ecs_mask6 = mask >  32 ? mask : 0;
+	obs->ecs_mask  = mask <= 32 ? mask : 0;
+}
+
+static void observe_qnamemin(uint8_t *msg, size_t msg_len, dnst_obs *obs)
+{
+	rrset_spc   rrset_spc;
+	rrset      *rrset;
+	rrtype_iter rr_spc, *rr;
+
+	if (RCODE_WIRE(msg) != RCODE_NOERROR
+	|| !(rrset = rrset_answer(&rrset_spc, msg, msg_len))
+	||   rrset->rr_type != RRTYPE_TXT)
+		; /* pass */
+	else for ( rr = rrtype_iter_init(&rr_spc, rrset)
+	         ; rr ; rr = rrtype_iter_next(rr)) {
+
+		uint16_t rd_len = READ_U16(rr->rr_i.rr_type + 8);
+		const uint8_t *rdata = rr->rr_i.rr_type + 10;
+		const uint8_t *eord  = rdata + rd_len;
+		uint8_t  txt_len;
+
+		if (eord > rr->rr_i.pkt_end)
+			break;
+		for (; rdata < eord; rdata += txt_len) {
+			txt_len = *rdata;
+			rdata += 1;
+
+			if (txt_len >= 7 && memcmp(rdata, "HOORAY ", 7) == 0) {
+				obs->verdict = CAP_DOES;
+				break;
+			}
+			if (txt_len >= 3 && memcmp(rdata, "NO ", 3) == 0) {
+				obs->verdict = CAP_DOESNT;
+				break;
+			}
+		}
+	}
+}
+
+void dnst_observe(int kind, uint8_t *msg, size_t msg_len, dnst_obs *obs)
+{
+	memset(obs, 0, sizeof(*obs));
+	switch (kind) {
+	case DNST_MSM_WHOAMI_G:
+		observe_whoami_g(msg, msg_len, obs);
+		break;
+	case DNST_MSM_WHOAMI_A:
+	case DNST_MSM_TCP4:
+		if (observe_addr(msg, msg_len, RRTYPE_A, obs->addr4[0])) {
+			obs->verdict = CAP_CAN;
+			obs->flags |= DNST_OBS_ADDR4;
+		} else	obs->verdict = CAP_CANNOT;
+		break;
+	case DNST_MSM_WHOAMI_6:
+	case DNST_MSM_TCP6:
+		if (observe_addr(msg, msg_len, RRTYPE_AAAA, obs->addr6)) {
+			obs->verdict = CAP_CAN;
+			obs->flags |= DNST_OBS_ADDR6;
+		} else	obs->verdict = CAP_CANNOT;
+		break;
+	case DNST_MSM_QNAMEMIN:
+		observe_qnamemin(msg, msg_len, obs);
+		break;
+	case DNST_MSM_NXDOMAIN:
+		observe_nxdomain(msg, msg_len, obs);
+		break;
+	case DNST_MSM_SECURE:
+	case DNST_MSM_BOGUS:
+	case DNST_MSM_DS_SECURE:
+	case DNST_MSM_DS_BOGUS:
+	case DNST_MSM_NOT_TA_19036:
+	case DNST_MSM_NOT_TA_20326:
+	case DNST_MSM_IS_TA_20326:
+	case DNST_MSM_FLAGDAY:
+		/* Whether the rootcanary web server address was answered */
+		obs->verdict = observe_canary(msg, msg_len)
+		             ? CAP_DOES : CAP_DOESNT;
+		break;
+	default:
+		break;
+	}
+}
+
+static void apply_secure(uint8_t verdict,
+    uint8_t *secure, uint8_t *bogus, uint8_t *result)
+{
+	if (verdict == CAP_DOES) {
+		*secure = CAP_DOES;
+		if (*bogus == CAP_DOESNT)
+			*result  = CAP_DOES;
+		else if (*bogus == CAP_DOES)
+			*result  = CAP_DOESNT;
+	} else {
+		*secure = CAP_DOESNT;
+		if (*bogus != CAP_UNKNOWN)
+			*result = CAP_BROKEN;
+	}
+}
+
+static void apply_bogus(uint8_t verdict,
+    uint8_t *bogus, uint8_t *secure, uint8_t *result)
+{
+	if (verdict == CAP_DOES) {
+		*bogus = CAP_DOES;
+		if (*secure == CAP_DOES)
+			*result = CAP_DOESNT;
+	} else {
+		*bogus = CAP_DOESNT;
+		if (*secure == CAP_DOES)
+			*result = CAP_DOES;
+	}
+}
+
+void dnst_obs_apply(dnst_rec *rec, int kind, unsigned int i,
+    const dnst_obs *obs)
+{
+	switch (kind) {
+	case DNST_MSM_WHOAMI_G:
+		if (obs->flags & DNST_OBS_ADDR4)
+			memcpy(rec->whoami_g, obs->addr4[0], 4);
+		if (obs->flags & DNST_OBS_ADDR6)
+			memcpy(rec->whoami_6, obs->addr6, 16);
+		rec->ecs_mask6 = obs->ecs_mask6;
+		rec->ecs_mask  = obs->ecs_mask;
+		break;
+	case DNST_MSM_WHOAMI_A:
+		if (obs->flags & DNST_OBS_ADDR4)
+			memcpy(rec->whoami_a, obs->addr4[0], 4);
+		break;
+	case DNST_MSM_WHOAMI_6:
+		if (obs->flags & DNST_OBS_ADDR6)
+			memcpy(rec->whoami_6, obs->addr6, 16);
+		break;
+	case DNST_MSM_SECURE:
+		apply_secure( obs->verdict, &rec->secure_reply[i]
+		            , &rec->bogus_reply[i], &rec->dnskey_alg[i]);
+		break;
+	case DNST_MSM_BOGUS:
+		apply_bogus( obs->verdict, &rec->bogus_reply[i]
+		           , &rec->secure_reply[i], &rec->dnskey_alg[i]);
+		break;
+	case DNST_MSM_DS_SECURE:
+		apply_secure( obs->verdict, &rec->ds_secure_reply[i]
+		            , &rec->ds_bogus_reply[i], &rec->ds_alg[i]);
+		break;
+	case DNST_MSM_DS_BOGUS:
+		apply_bogus( obs->verdict, &rec->ds_bogus_reply[i]
+		           , &rec->ds_secure_reply[i], &rec->ds_alg[i]);
+		break;
+	case DNST_MSM_QNAMEMIN:
+		if (obs->verdict != CAP_UNKNOWN)
+			rec->qnamemin = obs->verdict;
+		break;
+	case DNST_MSM_TCP4:
+		rec->tcp_ipv4 = obs->verdict;
+		if (obs->flags & DNST_OBS_ADDR4)
+			memcpy(rec->whoami_a, obs->addr4[0], 4);
+		break;
+	case DNST_MSM_TCP6:
+		rec->tcp_ipv6 = obs->verdict;
+		if (obs->flags & DNST_OBS_ADDR6)
+			memcpy(rec->whoami_6, obs->addr6, 16);
+		break;
+	case DNST_MSM_NXDOMAIN:
+		rec->nxdomain = obs->verdict;
+		if (obs->verdict == CAP_DOESNT)
+			memset(rec->hijacked, 0, sizeof(rec->hijacked));
+		else if (obs->verdict == CAP_DOES)
+			memcpy(rec->hijacked, obs->addr4, obs->n_addr4 * 4);
+		if (obs->flags & DNST_OBS_MORE)
+			fprintf(stderr, "More than %u addresses in NX hijack\n"
+			              , (unsigned)obs->n_addr4);
+		break;
+	case DNST_MSM_NOT_TA_19036:
+		if (obs->verdict == CAP_DOES) {
+			rec->not_ta_19036 = CAP_DOES;
+			rec->has_ta_19036 = rec->has_ta_20326 == CAP_DOES
+			                  ? CAP_DOESNT : CAP_UNKNOWN;
+		} else {
+			rec->not_ta_19036 = CAP_DOESNT;
+			rec->has_ta_19036 = rec->has_ta_20326 == CAP_DOES
+			                  ? CAP_DOES : CAP_UNKNOWN;
+		}
+		break;
+	case DNST_MSM_NOT_TA_20326:
+		if (obs->verdict == CAP_DOES) {
+			rec->not_ta_20326 = CAP_DOES;
+			rec->has_ta_20326 = CAP_UNKNOWN;
+		} else {
+			rec->not_ta_20326 = CAP_DOESNT;
+			rec->has_ta_20326 = rec->dnskey_alg[5] == CAP_DOES
+			                  ? CAP_DOES : CAP_UNKNOWN;
+		}
+		break;
+	case DNST_MSM_IS_TA_20326:
+		break; /* Temporarily disabled */
+	case DNST_MSM_FLAGDAY:
+		rec->does_flagday = obs->verdict == CAP_DOES
+		                  ? CAP_DOESNT : CAP_DOES;
+		break;
+	default:
+		break;
+	}
+}
@@ -0,0 +1,124 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __DNST_OBS_H_
+#define __DNST_OBS_H_
+#include <stddef.h>
+#include <stdint.h>
+#include "dnst.h"
+
+/* What a measurement is about */
+#define DNST_MSM_UNKNOWN       0
+#define DNST_MSM_WHOAMI_G      1 /* o-o.myaddr.l.google.com TXT */
+#define DNST_MSM_WHOAMI_A      2 /* whoami.akamai.net A */
+#define DNST_MSM_WHOAMI_6      3 /* ipv6 capability AAAA */
+#define DNST_MSM_SECURE        4 /* secure.*.rootcanary.net A per algorithm */
+#define DNST_MSM_BOGUS         5 /* bogus.*.rootcanary.net A per algorithm */
+#define DNST_MSM_DS_SECURE     6 /* secure.*.rootcanary.net A per DS digest */
+#define DNST_MSM_DS_BOGUS      7 /* bogus.*.rootcanary.net A per DS digest */
+#define DNST_MSM_QNAMEMIN      8 /* qnamemintest.internet.nl TXT */
+#define DNST_MSM_TCP4          9 /* tcp4 capability A */
+#define DNST_MSM_TCP6         10 /* tcp6 capability AAAA */
+#define DNST_MSM_NXDOMAIN     11 /* nxdomain.ripe-hackathon2.nlnetlabs.nl A */
+#define DNST_MSM_NOT_TA_19036 12 /* root-key-sentinel-not-ta-19036 A */
+#define DNST_MSM_NOT_TA_20326 13 /* root-key-sentinel-not-ta-20326 A */
+#define DNST_MSM_IS_TA_20326  14 /* root-key-sentinel-is-ta-20326 A */
+#define DNST_MSM_FLAGDAY      15 /* flagday.rootcanary.net A */
+
+/* A measurement in the registry: its kind, and for the rootcanary
+ * measurements the index of the algorithm or DS digest.
+ */
+typedef struct dnst_msm {
+	uint32_t     msm_id;
+	int          kind;   /* DNST_MSM_* */
+	unsigned int i;
+} dnst_msm;
+
+/* The measurement msm_id, or NULL when it is unknown */
+const dnst_msm *dnst_msm_get(uint32_t msm_id);
+
+/* Add measurements from fn to the registry, replacing the built-in ones
+ * with the same msm_id.  Each line is "<msm_id> <kind> [ <index> ]", with
+ * kind the DNST_MSM_* name in lower case (e.g. "flagday" or "secure").
+ * Empty lines and lines starting with # are skipped.
+ */
+int dnst_msms_load(const char *fn);
+
+#define DNST_OBS_ADDR4   1 /* addr4[0] is set */
+#define DNST_OBS_ADDR6   2 /* addr6 is set */
+#define DNST_OBS_MORE    4 /* More than 4 addresses in a NX hijack */
+
+/* What was observed in a DNS reply for a measurement.  It replaces the reply
+ * of a record with the DNST_OBS error code, so the reply does not have to
+ * be parsed again for each run over the record.  The kind and index of the
+ * measurement it was observed for are kept with it, so it is not applied
+ * once the registry says otherwise.
+ */
+typedef struct dnst_obs {
+	uint8_t verdict;     /* CAP_UNKNOWN when there is none */
+	uint8_t flags;       /* DNST_OBS_* */
+	uint8_t n_addr4;     /* Of NX hijack addresses */
+	uint8_t ecs_mask;
+	uint8_t ecs_mask6;
+	uint8_t kind;        /* DNST_MSM_* */
+	uint8_t i;           /* Index of the algorithm or DS digest */
+	uint8_t reserved;
+	uint8_t addr4[4][4];
+	uint8_t addr6[16];
+} dnst_obs;
+
+/* Run the classifier of a kind of measurement over reply msg */
+void dnst_observe(int kind, uint8_t *msg, size_t msg_len, dnst_obs *obs);
+
+/* Update rec with what was observed for measurement kind, index i */
+void dnst_obs_apply(dnst_rec *rec, int kind, unsigned int i,
+    const dnst_obs *obs);
+
+/* Get the observation of record d for measurement msm, with either DNST_OK
+ * or DNST_OBS as error.  Returns -1 when the observation is damaged, or
+ * was observed for another kind or index than that of msm.
+ */
+static inline int dnst_obs_get(dnst *d, const dnst_msm *msm, dnst_obs *obs)
+{
+	if (d->error != DNST_OBS)
+		dnst_observe(msm->kind, dnst_msg(d), d->len, obs);
+
+	else if (d->len != sizeof(dnst_obs))
+		return -1;
+	else {
+		memcpy(obs, dnst_msg(d), sizeof(dnst_obs));
+		if (obs->kind != msm->kind || obs->i != msm->i)
+			return -1;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,422 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dnst-sort.h"
+#include "loser-tree.h"
+
+size_t dnst_scan(uint8_t *buf, size_t sz,
+    uint32_t *min_time, uint32_t *max_time, int *sorted)
+{
+	uint8_t *eob = buf + sz;
+	dnst *d;
+	size_t i;
+	uint32_t prev_time;
+
+	*min_time = 0xFFFFFFFF;
+	*max_time = 0;
+	*sorted = 1;
+	for ( d = (void *)buf, i = 0, prev_time = 0
+	    ; ((uint8_t *)d) + 16 < eob
+	    ; d = dnst_next(d), i++) {
+
+		if (d->time < prev_time)
+			*sorted = 0;
+		if (d->time < *min_time)
+			*min_time = d->time;
+		if (d->time > *max_time)
+			*max_time = d->time;
+		prev_time = d->time;
+
+		if (!dnst_fits(d, eob))
+			break;
+	}
+	return i;
+}
+
+void dnst_idx_scan(const dnst_idx *idx,
+    uint32_t *min_time, uint32_t *max_time, int *sorted)
+{
+	size_t i;
+
+	*min_time = 0xFFFFFFFF;
+	*max_time = 0;
+	*sorted = 1;
+	for (i = 0; i < idx->n; i++) {
+		if (i && idx->time[i] < idx->time[i - 1])
+			*sorted = 0;
+		if (idx->time[i] < *min_time)
+			*min_time = idx->time[i];
+		if (idx->time[i] > *max_time)
+			*max_time = idx->time[i];
+	}
+}
+
+int dnst_check_day(uint32_t min_time, uint32_t max_time)
+{
+	char min_timestr[40], max_timestr[40];
+	struct tm min_tm, max_tm;
+	time_t min_t, max_t;
+
+	fprintf(stderr, "%" PRIu32 " ... %" PRIu32 "\n", min_time, max_time);
+	min_t = min_time;
+	gmtime_r(&min_t, &min_tm);
+	strftime(min_timestr, sizeof(min_timestr), "%Y-%m-%dT%H:%M:%SZ", &min_tm);
+	max_t = max_time;
+	gmtime_r(&max_t, &max_tm);
+	strftime(max_timestr, sizeof(max_timestr), "%Y-%m-%dT%H:%M:%SZ", &max_tm);
+	fprintf(stderr, "%s ... %s\n", min_timestr, max_timestr);
+	min_tm.tm_mday += 1;
+	min_tm.tm_hour = 0;
+	min_tm.tm_min  = 0;
+	min_tm.tm_sec  = 0;
+	min_t = timegm(&min_tm);
+
+	if ((min_t > max_t && min_t - max_t > 300)
+	||  (max_t > min_t && max_t - min_t > 300)) {
+		strftime(min_timestr, sizeof(min_timestr), "%Y-%m-%dT%H:%M:%SZ", &min_tm);
+		fprintf(stderr, "end to far from %s\n", min_timestr);
+		return 1;
+	}
+	return 0;
+}
+
+/* On the same time, records keep their order in the buffer */
+static int dnst_time_cmp(const void *x, const void *y)
+{ return (*(dnst **)x)->time != (*(dnst **)y)->time
+       ? ((*(dnst **)x)->time > (*(dnst **)y)->time ? 1 : -1)
+       : *(dnst **)x == *(dnst **)y ? 0
+       : *(dnst **)x >  *(dnst **)y ? 1 : -1; }
+
+void dnst_qsort(dnst **refs, size_t n)
+{ qsort(refs, n, sizeof(dnst *), dnst_time_cmp); }
+
+/* Counting sort of the n references in refs, into sorted */
+static int dnst_count_sort(dnst **refs, size_t n, dnst **sorted,
+    uint32_t min_time, uint32_t max_time)
+{
+	size_t *counts, i, sum, c;
+
+	if (!(counts = calloc((size_t)(max_time - min_time) + 1, sizeof(size_t))))
+		return -1;
+	for (i = 0; i < n; i++)
+		counts[refs[i]->time - min_time] += 1;
+	for (i = 0, sum = 0; i <= (size_t)(max_time - min_time); i++) {
+		c = counts[i];
+		counts[i] = sum;
+		sum += c;
+	}
+	for (i = 0; i < n; i++)
+		sorted[counts[refs[i]->time - min_time]++] = refs[i];
+	free(counts);
+	return 0;
+}
+
+/* Sort the n references in refs by time.  With a time range of a few days,
+ * with a counting sort, otherwise with qsort.
+ */
+static dnst **dnst_sort_refs(dnst **refs, size_t n)
+{
+	uint32_t min_time = 0xFFFFFFFF, max_time = 0;
+	dnst **sorted;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (refs[i]->time < min_time)
+			min_time = refs[i]->time;
+		if (refs[i]->time > max_time)
+			max_time = refs[i]->time;
+	}
+	if (n < 2 || max_time - min_time > DNST_SORT_MAX_RANGE
+	||  !(sorted = malloc(n * sizeof(dnst *)))) {
+		dnst_qsort(refs, n);
+		return refs;
+	}
+	if (dnst_count_sort(refs, n, sorted, min_time, max_time)) {
+		free(sorted);
+		dnst_qsort(refs, n);
+		return refs;
+	}
+	free(refs);
+	return sorted;
+}
+
+dnst **dnst_sort(uint8_t *buf, size_t n)
+{
+	dnst *d, **refs;
+	size_t i;
+
+	if (!(refs = malloc((n ? n : 1) * sizeof(dnst *))))
+		return NULL;
+	for (d = (void *)buf, i = 0; i < n; d = dnst_next(d), i++)
+		refs[i] = d;
+	return dnst_sort_refs(refs, n);
+}
+
+dnst **dnst_sort_idx(uint8_t *buf, const dnst_idx *idx)
+{
+	dnst **refs;
+	size_t i;
+
+	if (!(refs = malloc((idx->n ? idx->n : 1) * sizeof(dnst *))))
+		return NULL;
+	for (i = 0; i < idx->n; i++)
+		refs[i] = (dnst *)(buf + idx->off[i]);
+	return dnst_sort_refs(refs, idx->n);
+}
+
+size_t dnst_sort_copy(uint8_t *wr_buf, uint8_t *buf, size_t n,
+    uint32_t min_time, uint32_t max_time)
+{
+	size_t *offs, i, sum, sz;
+	dnst *d;
+
+	if (max_time < min_time || max_time - min_time > DNST_SORT_MAX_RANGE
+	||  !(offs = calloc((size_t)(max_time - min_time) + 1, sizeof(size_t))))
+		return (size_t)-1;
+
+	/* The number of bytes of the records of each second */
+	for (d = (void *)buf, i = 0; i < n; d = dnst_next(d), i++)
+		offs[d->time - min_time] += dnst_sz(d);
+
+	/* Where the records of each second start */
+	for (i = 0, sum = 0; i <= (size_t)(max_time - min_time); i++) {
+		sz = offs[i];
+		offs[i] = sum;
+		sum += sz;
+	}
+	for (d = (void *)buf, i = 0; i < n; d = dnst_next(d), i++) {
+		sz = dnst_sz(d);
+		memcpy(wr_buf + offs[d->time - min_time], d, sz);
+		offs[d->time - min_time] += sz;
+	}
+	free(offs);
+	return sum;
+}
+
+size_t dnst_runs(uint8_t *buf, size_t n)
+{
+	dnst *d;
+	size_t i, k;
+	uint32_t prev_time;
+
+	for ( d = (void *)buf, i = 0, k = n ? 1 : 0, prev_time = 0
+	    ; i < n; d = dnst_next(d), i++) {
+		if (d->time < prev_time)
+			k++;
+		prev_time = d->time;
+	}
+	return k;
+}
+
+/* A part of the records for dnst_sort_copy_mt, with the byte counts, and
+ * later the offsets in wr_buf, of its records per second.
+ */
+typedef struct dnst_sort_part {
+	pthread_t thread;
+	uint8_t  *buf;
+	size_t    n;
+	size_t   *offs;
+	uint8_t  *wr_buf;
+	uint32_t  min_time;
+} dnst_sort_part;
+
+static void *dnst_sort_part_count(void *arg)
+{
+	dnst_sort_part *p = arg;
+	dnst *d;
+	size_t i;
+
+	for (d = (void *)p->buf, i = 0; i < p->n; d = dnst_next(d), i++)
+		p->offs[d->time - p->min_time] += dnst_sz(d);
+	return NULL;
+}
+
+static void *dnst_sort_part_copy(void *arg)
+{
+	dnst_sort_part *p = arg;
+	dnst *d;
+	size_t i, sz;
+
+	for (d = (void *)p->buf, i = 0; i < p->n; d = dnst_next(d), i++) {
+		sz = dnst_sz(d);
+		memcpy(p->wr_buf + p->offs[d->time - p->min_time], d, sz);
+		p->offs[d->time - p->min_time] += sz;
+	}
+	return NULL;
+}
+
+/* Run f on all parts, the first in this thread and the others in threads
+ * of their own (or in this thread too when a thread could not be created).
+ */
+static void dnst_sort_parts(dnst_sort_part *parts, size_t n_parts,
+    void *(*f)(void *))
+{
+	size_t i;
+
+	for (i = 1; i < n_parts; i++) {
+		if (pthread_create(&parts[i].thread, NULL, f, &parts[i])) {
+			parts[i].thread = pthread_self();
+			f(&parts[i]);
+		}
+	}
+	f(&parts[0]);
+	for (i = 1; i < n_parts; i++) {
+		if (!pthread_equal(parts[i].thread, pthread_self()))
+			pthread_join(parts[i].thread, NULL);
+	}
+}
+
+size_t dnst_sort_copy_mt(uint8_t *wr_buf, uint8_t *buf, size_t n,
+    uint32_t min_time, uint32_t max_time, size_t n_threads)
+{
+	dnst_sort_part *parts;
+	size_t *offs, range, i, j, sum, sz;
+	dnst *d;
+
+	if (n_threads > n / DNST_SORT_MIN_PART)
+		n_threads = n / DNST_SORT_MIN_PART;
+	if (n_threads < 2)
+		return dnst_sort_copy(wr_buf, buf, n, min_time, max_time);
+
+	if (max_time < min_time || max_time - min_time > DNST_SORT_MAX_RANGE)
+		return (size_t)-1;
+	range = (size_t)(max_time - min_time) + 1;
+	if (!(parts = calloc(n_threads, sizeof(dnst_sort_part))))
+		return (size_t)-1;
+	if (!(offs = calloc(n_threads * range, sizeof(size_t)))) {
+		free(parts);
+		return (size_t)-1;
+	}
+	/* Split the records in parts of (about) the same number of records */
+	for (d = (void *)buf, i = 0; i < n_threads; i++) {
+		parts[i].buf = (uint8_t *)d;
+		parts[i].n = n / n_threads + (i < n % n_threads);
+		parts[i].offs = offs + i * range;
+		parts[i].wr_buf = wr_buf;
+		parts[i].min_time = min_time;
+		if (i + 1 < n_threads)
+			for (j = 0; j < parts[i].n; j++)
+				d = dnst_next(d);
+	}
+	/* The number of bytes of the records of each second, per part */
+	dnst_sort_parts(parts, n_threads, dnst_sort_part_count);
+
+	/* Where the records of each second start, per part.  Within a
+	 * second, the records of earlier parts go first, so the output is
+	 * the same as that of dnst_sort_copy.
+	 */
+	for (i = 0, sum = 0; i < range; i++) {
+		for (j = 0; j < n_threads; j++) {
+			sz = parts[j].offs[i];
+			parts[j].offs[i] = sum;
+			sum += sz;
+		}
+	}
+	dnst_sort_parts(parts, n_threads, dnst_sort_part_copy);
+	free(offs);
+	free(parts);
+	return sum;
+}
+
+/* A run of records in time order, from cur up to end */
+typedef struct dnst_run {
+	dnst    *cur;
+	uint8_t *end;
+} dnst_run;
+
+size_t dnst_merge_copy(uint8_t *wr_buf, uint8_t *buf, size_t n, size_t k)
+{
+	uint8_t *wr = wr_buf;
+	dnst_run *runs;
+	loser_tree lt;
+	dnst *d, *prev;
+	size_t i, r, sz;
+
+	if (!(runs = malloc((k ? k : 1) * sizeof(dnst_run))))
+		return (size_t)-1;
+
+	/* Find where the runs start and end */
+	for ( d = (void *)buf, prev = NULL, i = 0, r = 0
+	    ; i < n; prev = d, d = dnst_next(d), i++) {
+		if (prev && d->time >= prev->time)
+			continue;
+		if (r == k) {
+			free(runs);
+			return (size_t)-1;
+		}
+		if (r)
+			runs[r - 1].end = (uint8_t *)d;
+		runs[r++].cur = d;
+	}
+	if (r)
+		runs[r - 1].end = (uint8_t *)d;
+	if (loser_tree_init(&lt, r)) {
+		free(runs);
+		return (size_t)-1;
+	}
+	for (i = 0; i < r; i++)
+		lt.key[i] = runs[i].cur->time;
+	loser_tree_play(&lt);
+	for (i = 0; i < n; i++) {
+		r = loser_tree_winner(&lt);
+		d = runs[r].cur;
+		sz = dnst_sz(d);
+		memcpy(wr, d, sz);
+		wr += sz;
+		runs[r].cur = (dnst *)((uint8_t *)d + sz);
+		lt.key[r] = (uint8_t *)runs[r].cur < runs[r].end
+		          ? runs[r].cur->time : LOSER_TREE_DONE;
+		loser_tree_replay(&lt);
+	}
+	loser_tree_free(&lt);
+	free(runs);
+	return wr - wr_buf;
+}
+
+size_t dnst_gather(uint8_t *wr_buf, dnst **refs, size_t n)
+{
+	uint8_t *wr = wr_buf;
+	size_t i, sz;
+
+	for (i = 0; i < n; i++) {
+		sz = dnst_sz(refs[i]);
+		memcpy(wr, refs[i], sz);
+		wr += sz;
+	}
+	return wr - wr_buf;
+}
@@ -0,0 +1,113 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __DNST_SORT_H_
+#define __DNST_SORT_H_
+#include <stddef.h>
+#include <stdint.h>
+#include "dnst.h"
+#include "dnst-file.h"
+
+/* Scan the records in buf.  Returns the number of complete records, their
+ * time range, and whether they are already in time order.
+ */
+size_t dnst_scan(uint8_t *buf, size_t sz,
+    uint32_t *min_time, uint32_t *max_time, int *sorted);
+
+/* Like dnst_scan, from the dense time array of a sidecar index */
+void dnst_idx_scan(const dnst_idx *idx,
+    uint32_t *min_time, uint32_t *max_time, int *sorted);
+
+/* Returns 0 when max_time is within 5 minutes from the midnight following
+ * min_time, i.e. the records span a single (complete) day.
+ */
+int dnst_check_day(uint32_t min_time, uint32_t max_time);
+
+/* Time ranges up to this many seconds are sorted with a counting sort */
+#define DNST_SORT_MAX_RANGE (16 * 86400)
+
+/* Returns a newly allocated array of references to the n records in buf,
+ * ordered by time.  Records with the same time stay in the order of buf.
+ */
+dnst **dnst_sort(uint8_t *buf, size_t n);
+
+/* Like dnst_sort, with the records of the file in buf found from idx */
+dnst **dnst_sort_idx(uint8_t *buf, const dnst_idx *idx);
+
+/* Sort refs with qsort, in the same order as dnst_sort */
+void dnst_qsort(dnst **refs, size_t n);
+
+/* Copy the n records in buf, with times from min_time to max_time, to
+ * wr_buf in time order (in the order of buf on the same time), with a
+ * counting sort over the seconds: one pass for the number of bytes per
+ * second, and one pass to copy each record to its place.  Returns the
+ * number of bytes copied, or (size_t)-1 when the time range is larger than
+ * DNST_SORT_MAX_RANGE or on allocation failure.
+ */
+size_t dnst_sort_copy(uint8_t *wr_buf, uint8_t *buf, size_t n,
+    uint32_t min_time, uint32_t max_time);
+
+/* The number of runs of records in time order among the n records in buf.
+ * Atlas results are grouped per probe and in time order per probe, so a
+ * file is mostly a sequence of such runs.
+ */
+size_t dnst_runs(uint8_t *buf, size_t n);
+
+/* Copy the n records in buf to wr_buf in time order (in the order of buf on
+ * the same time), by merging the runs of records that are already in time
+ * order with a loser tree, in O(n log k) with sequential reads and writes.
+ * Returns the number of bytes copied, or (size_t)-1 when there are more
+ * than k runs or on allocation failure.
+ */
+size_t dnst_merge_copy(uint8_t *wr_buf, uint8_t *buf, size_t n, size_t k);
+
+/* Up to this many runs, merging them is faster than a counting sort.  With
+ * more (and shorter) runs, as with the thousands of probes in an Atlas
+ * result, the heads of the runs no longer fit in the cache.
+ */
+#define DNST_SORT_MAX_RUNS 64
+
+/* Parts of fewer records are not worth a thread of their own */
+#define DNST_SORT_MIN_PART 65536
+
+/* Like dnst_sort_copy, with the records split in n_threads parts, which are
+ * counted and copied by a thread each.  The output is the same as that of
+ * dnst_sort_copy.
+ */
+size_t dnst_sort_copy_mt(uint8_t *wr_buf, uint8_t *buf, size_t n,
+    uint32_t min_time, uint32_t max_time, size_t n_threads);
+
+/* Copy the n records referenced by refs to wr_buf.  Returns the number of
+ * bytes copied.
+ */
+size_t dnst_gather(uint8_t *wr_buf, dnst **refs, size_t n);
+
+#endif
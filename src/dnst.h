@@ -32,6 +32,7 @@
 #ifndef __DNST_H_
 #define __DNST_H_
 #include <stdint.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <time.h>
 #include "rbtree.h"
@@ -41,7 +42,7 @@ typedef struct dnst {
 	float    rt;
 	uint32_t prb_id;
 	uint8_t  af;    /* AF_INET || AF_INET6 */
-	uint8_t  error; /* 0 == packet, 1 == error message */
+	uint8_t  error; /* DNST_OK == packet, otherwise one of DNST_ERR_* */
 	uint16_t len;
 	union {
 		struct {
@@ -55,6 +56,34 @@ typedef struct dnst {
 	} afu;
 } dnst;
 
+#define DNST_OK              0 /* msg is the DNS reply */
+#define DNST_ERR_JSON        1 /* msg is the json error object (old files) */
+#define DNST_ERR_NO_RESULT   2 /* Only used during conversion */
+#define DNST_ERR_TIMEOUT     3 /* Error records from here on have len 0 */
+#define DNST_ERR_GETADDRINFO 4
+#define DNST_ERR_SOCKET      5
+#define DNST_ERR_SENDERROR   6
+#define DNST_ERR_TCP         7 /* TUCONNECT, TUREAD, TUSEND, TCPREAD */
+#define DNST_ERR_OTHER       8
+#define DNST_N_ERR           9
+#define DNST_OBS          0x40 /* msg is a dnst_obs (see dnst-obs.h) */
+
+/* Classify an atlas error by the (first) key of its json error object */
+static inline uint8_t dnst_error_code(const char *key, size_t len)
+{ return len ==  7 && memcmp(key, "timeout"    ,  7) == 0 ? DNST_ERR_TIMEOUT
+       : len == 11 && memcmp(key, "getaddrinfo", 11) == 0 ? DNST_ERR_GETADDRINFO
+       : len ==  6 && memcmp(key, "socket"     ,  6) == 0 ? DNST_ERR_SOCKET
+       : len ==  9 && memcmp(key, "senderror"  ,  9) == 0 ? DNST_ERR_SENDERROR
+       : len >=  2 && memcmp(key, "TU"         ,  2) == 0 ? DNST_ERR_TCP
+       : len >=  3 && memcmp(key, "TCP"        ,  3) == 0 ? DNST_ERR_TCP
+       : DNST_ERR_OTHER; }
+
+static inline const char *dnst_error_str(uint8_t error)
+{ static const char *strs[DNST_N_ERR] = { "ok", "json", "no_result", "timeout"
+                                        , "getaddrinfo", "socket", "senderror"
+                                        , "tcp", "other" };
+  return error < DNST_N_ERR ? strs[error] : strs[DNST_ERR_OTHER]; }
+
 static inline size_t dnst_sz(dnst *d)
 { if (d->af == AF_INET6) return sizeof(dnst) + (((d->len + 3) >> 2) << 2)
 ; else return sizeof(dnst) + (((d->len + 3) >> 2) << 2) - 12; }
@@ -71,17 +100,6 @@ static inline dnst *dnst_next(dnst *d)
 static inline int dnst_fits(dnst *d, uint8_t *pos)
 { return &((uint8_t *)d)[dnst_sz(d)] <= pos; }
 
-typedef struct dnst_iter {
-	struct tm    start;
-	struct tm    stop;
-	char         msm_dir[4096];
-	unsigned int msm_id;
-	int          fd;
-	uint8_t     *buf;
-	uint8_t     *end_of_buf;
-	dnst        *cur;
-} dnst_iter;
-
 #define CAP_UNKNOWN 0
 #define CAP_CAN     1
 #define CAP_CANNOT  2
@@ -148,7 +166,7 @@ typedef struct dnst_rec {
 } dnst_rec;
 
 typedef struct dnst_rec_node {
-	struct rbnode_type node;
+	size_t   errors[DNST_N_ERR]; /* Not saved in the .res file */
 	dnst_rec rec;
 } dnst_rec_node;
 
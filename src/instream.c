@@ -0,0 +1,318 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#include "instream.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBBZ2
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#define INSTREAM_BUF_SZ 131072
+
+typedef enum instream_type {
+	INSTREAM_PLAIN = 0,
+	INSTREAM_GZIP,
+	INSTREAM_BZIP2,
+	INSTREAM_ZSTD
+} instream_type;
+
+struct instream {
+	int            fd;
+	instream_type  type;
+	int            eof;     /* of fd */
+	int            end;     /* of the (last) compressed stream */
+	uint8_t       *buf;     /* Compressed (or peeked) input */
+	size_t         pos;
+	size_t         len;
+#ifdef HAVE_LIBZ
+	z_stream       zs;
+#endif
+#ifdef HAVE_LIBBZ2
+	bz_stream      bs;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_DStream  *zds;
+#endif
+};
+
+static const struct {
+	const char    *suffix;
+	const char    *name;
+	const uint8_t *magic;
+	size_t         magic_len;
+} formats[] = {
+	{ ""    , "plain", NULL                                    , 0 },
+	{ ".gz" , "gzip" , (const uint8_t *)"\x1f\x8b"             , 2 },
+	{ ".bz2", "bzip2", (const uint8_t *)"BZh"                  , 3 },
+	{ ".zst", "zstd" , (const uint8_t *)"\x28\xb5\x2f\xfd"     , 4 }
+};
+static const size_t n_formats = sizeof(formats) / sizeof(formats[0]);
+
+/* Read more compressed input into in->buf, keeping what is unconsumed */
+static int instream_fill(instream *in)
+{
+	ssize_t n;
+
+	if (in->pos > 0) {
+		memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+		in->len -= in->pos;
+		in->pos = 0;
+	}
+	while ((n = read(in->fd, in->buf + in->len,
+	    INSTREAM_BUF_SZ - in->len)) < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, "Read error: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	if (n == 0)
+		in->eof = 1;
+	in->len += n;
+	return 0;
+}
+
+static int instream_init_decompressor(instream *in)
+{
+	switch (in->type) {
+	case INSTREAM_PLAIN:
+		return 0;
+#ifdef HAVE_LIBZ
+	case INSTREAM_GZIP:
+		memset(&in->zs, 0, sizeof(in->zs));
+		return inflateInit2(&in->zs, 15 + 16) == Z_OK ? 0 : -1;
+#endif
+#ifdef HAVE_LIBBZ2
+	case INSTREAM_BZIP2:
+		memset(&in->bs, 0, sizeof(in->bs));
+		return BZ2_bzDecompressInit(&in->bs, 0, 0) == BZ_OK ? 0 : -1;
+#endif
+#ifdef HAVE_LIBZSTD
+	case INSTREAM_ZSTD:
+		if (!(in->zds = ZSTD_createDStream()))
+			return -1;
+		return ZSTD_isError(ZSTD_initDStream(in->zds)) ? -1 : 0;
+#endif
+	default:
+		fprintf( stderr, "No support for %s compressed input\n"
+		       , formats[in->type].name);
+		return -1;
+	}
+}
+
+instream *instream_open(int fd)
+{
+	instream *in;
+	size_t i;
+
+	if (!(in = calloc(1, sizeof(instream)))
+	||  !(in->buf = malloc(INSTREAM_BUF_SZ))) {
+		fprintf(stderr, "Could not allocate input stream\n");
+		free(in);
+		return NULL;
+	}
+	in->fd = fd;
+	while (in->len < 4 && !in->eof)
+		if (instream_fill(in)) {
+			instream_close(in);
+			return NULL;
+		}
+	for (i = 1; i < n_formats; i++)
+		if (in->len >= formats[i].magic_len
+		&&  memcmp(in->buf, formats[i].magic, formats[i].magic_len) == 0)
+			in->type = i;
+
+	if (instream_init_decompressor(in)) {
+		fprintf( stderr, "Could not initialize %s decompression\n"
+		       , formats[in->type].name);
+		in->type = INSTREAM_PLAIN; /* Nothing to clean up */
+		instream_close(in);
+		return NULL;
+	}
+	return in;
+}
+
+/* Decompress from in->buf into buf.  Returns the number of bytes produced,
+ * 0 at the end of the compressed stream, or -1 on error.
+ */
+static ssize_t instream_decompress(instream *in, void *buf, size_t sz)
+{
+	switch (in->type) {
+#ifdef HAVE_LIBZ
+	case INSTREAM_GZIP: {
+		int r;
+
+		in->zs.next_in   = in->buf + in->pos;
+		in->zs.avail_in  = in->len - in->pos;
+		in->zs.next_out  = buf;
+		in->zs.avail_out = sz;
+		r = inflate(&in->zs, Z_NO_FLUSH);
+		in->pos = in->len - in->zs.avail_in;
+		if (r == Z_STREAM_END) {
+			/* Concatenated gzip members (as from pigz) */
+			in->end = 1;
+			if (inflateReset(&in->zs) != Z_OK)
+				return -1;
+		} else if (r != Z_OK && r != Z_BUF_ERROR) {
+			fprintf( stderr, "gzip error: %s\n"
+			       , in->zs.msg ? in->zs.msg : "unknown");
+			return -1;
+		}
+		return sz - in->zs.avail_out;
+	}
+#endif
+#ifdef HAVE_LIBBZ2
+	case INSTREAM_BZIP2: {
+		int r;
+
+		in->bs.next_in   = (char *)in->buf + in->pos;
+		in->bs.avail_in  = in->len - in->pos;
+		in->bs.next_out  = buf;
+		in->bs.avail_out = sz;
+		r = BZ2_bzDecompress(&in->bs);
+		in->pos = in->len - in->bs.avail_in;
+		if (r == BZ_STREAM_END) {
+			/* Concatenated streams (as from pbzip2) */
+			in->end = 1;
+			BZ2_bzDecompressEnd(&in->bs);
+			memset(&in->bs, 0, sizeof(in->bs));
+			if (BZ2_bzDecompressInit(&in->bs, 0, 0) != BZ_OK)
+				return -1;
+		} else if (r != BZ_OK) {
+			fprintf(stderr, "bzip2 error: %d\n", r);
+			return -1;
+		}
+		return sz - in->bs.avail_out;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	case INSTREAM_ZSTD: {
+		ZSTD_inBuffer  zin  = { in->buf + in->pos, in->len - in->pos, 0 };
+		ZSTD_outBuffer zout = { buf, sz, 0 };
+		size_t r;
+
+		r = ZSTD_decompressStream(in->zds, &zout, &zin);
+		in->pos += zin.pos;
+		if (ZSTD_isError(r)) {
+			fprintf(stderr, "zstd error: %s\n", ZSTD_getErrorName(r));
+			return -1;
+		}
+		in->end = r == 0; /* Frame complete */
+		return zout.pos;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+ssize_t instream_read(instream *in, void *buf, size_t sz)
+{
+	ssize_t n;
+
+	if (in->type == INSTREAM_PLAIN) {
+		if (in->pos < in->len) { /* Peeked bytes first */
+			n = in->len - in->pos < sz ? in->len - in->pos : sz;
+			memcpy(buf, in->buf + in->pos, n);
+			in->pos += n;
+			return n;
+		}
+		while ((n = read(in->fd, buf, sz)) < 0 && errno == EINTR)
+			; /* pass */
+		if (n < 0)
+			fprintf(stderr, "Read error: %s\n", strerror(errno));
+		return n;
+	}
+	for (;;) {
+		if (in->pos == in->len) {
+			if (in->eof) {
+				if (in->end)
+					return 0;
+				fprintf( stderr, "Truncated %s input\n"
+				       , formats[in->type].name);
+				return 0;
+			}
+			if (instream_fill(in))
+				return -1;
+			continue;
+		}
+		in->end = 0;
+		if ((n = instream_decompress(in, buf, sz)) != 0)
+			return n;
+	}
+}
+
+void instream_close(instream *in)
+{
+	if (!in)
+		return;
+	switch (in->type) {
+#ifdef HAVE_LIBZ
+	case INSTREAM_GZIP : inflateEnd(&in->zs);
+	                     break;
+#endif
+#ifdef HAVE_LIBBZ2
+	case INSTREAM_BZIP2: BZ2_bzDecompressEnd(&in->bs);
+	                     break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case INSTREAM_ZSTD : ZSTD_freeDStream(in->zds);
+	                     break;
+#endif
+	default            : break;
+	}
+	free(in->buf);
+	free(in);
+}
+
+size_t instream_basename_len(const char *fn)
+{
+	size_t len = strlen(fn), i;
+
+	for (i = 1; i < n_formats; i++) {
+		size_t sl = strlen(formats[i].suffix);
+
+		if (len > sl && strcmp(fn + len - sl, formats[i].suffix) == 0)
+			return len - sl;
+	}
+	return len;
+}
@@ -34,12 +34,16 @@
 #include <time.h>
 #include "config.h"
 #include "dnst.h"
-#include "rr-iter.h"
+#include "dnst-file.h"
+#include "dnst-obs.h"
+#include "loser-tree.h"
+#include "rec-hash.h"
 #include <arpa/inet.h>
 #include <assert.h>
 #include <fcntl.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,6 +53,63 @@
 #include <unistd.h>
 
 static int quiet = 0;
+static uint32_t only_prb_id = 0;
+
+/* Error counts per measurement, in the order of the <msm_dir> arguments, or
+ * of the measurements in merged files.
+ */
+typedef struct msm_errors {
+	uint32_t msm_id;
+	size_t   errors[DNST_N_ERR];
+} msm_errors;
+
+/* The state of the records of a shard of the probes, those with
+ * prb_id % n_shards == shard.  Each shard merges all records, so the
+ * measurements are registered in the same order in all shards, and each
+ * record has the same sequence number in all shards.  Without -j there is
+ * a single shard.
+ */
+typedef struct iter_shard {
+	pthread_t    thread;
+	size_t       shard;
+	size_t       n_shards;
+	struct tm    start;
+	struct tm    stop;
+	const char **dirs;
+	size_t       n_dirs;
+
+	msm_errors  *msms;
+	size_t       n_msms;
+	size_t       sz_msms;
+	rec_hash     recs;
+	FILE        *out;       /* For the CSV lines */
+	uint64_t     seq;       /* Of the record being processed */
+	uint64_t    *line_seqs; /* Of each CSV line, with more than one shard */
+	size_t       n_lines;
+	size_t       sz_lines;
+	int          r;
+} iter_shard;
+
+static size_t *msm_errors_get(iter_shard *s, uint32_t msm_id)
+{
+	msm_errors *new_msms;
+	size_t i;
+
+	for (i = 0; i < s->n_msms; i++)
+		if (s->msms[i].msm_id == msm_id)
+			return s->msms[i].errors;
+	if (s->n_msms == s->sz_msms) {
+		size_t new_sz = s->sz_msms ? s->sz_msms * 2 : 64;
+
+		if (!(new_msms = realloc(s->msms, new_sz * sizeof(msm_errors))))
+			return NULL;
+		s->msms = new_msms;
+		s->sz_msms = new_sz;
+	}
+	memset(&s->msms[s->n_msms], 0, sizeof(msm_errors));
+	s->msms[s->n_msms].msm_id = msm_id;
+	return s->msms[s->n_msms++].errors;
+}
 
 static uint8_t const * const zeros =
     (uint8_t const * const) "\x00\x00\x00\x00\x00\x00\x00\x00"
@@ -57,19 +118,91 @@ static uint8_t const * const zeros =
 void dnst_iter_done(dnst_iter *i)
 {
 	if (i->buf)
-		munmap(i->buf, i->end_of_buf - i->buf);
+		munmap(i->buf, i->buf_sz);
 	i->buf = NULL;
 	if (i->fd >= 0)
 		close(i->fd);
 	i->fd = -1;
 	i->cur = NULL;
+	dnst_file_done(&i->f);
+	dnst_idx_free(&i->idx);
+	free(i->msm_slots);
+	i->msm_slots = NULL;
 }
 
+static inline size_t dnst_msm_slot_hash(uint32_t msm_id)
+{ return msm_id * 2654435761U; }
+
+/* Look up the measurements of a merged file in the registry, once for the
+ * file instead of for each record.
+ */
+static int dnst_iter_msms_init(dnst_iter *i)
+{
+	size_t j, h, n_slots = 16;
+
+	while (n_slots < i->f.n_msms * 2)
+		n_slots *= 2;
+	if (!(i->msm_slots = calloc(n_slots, sizeof(dnst_msm_slot))))
+		return -1;
+	i->msm_mask = n_slots - 1;
+	for (j = 0; j < i->f.n_msms; j++) {
+		for ( h = dnst_msm_slot_hash(i->f.msm_ids[j]) & i->msm_mask
+		    ; i->msm_slots[h].msm_id
+		   && i->msm_slots[h].msm_id != i->f.msm_ids[j]
+		    ; h = (h + 1) & i->msm_mask)
+			; /* pass */
+		i->msm_slots[h].msm_id = i->f.msm_ids[j];
+		i->msm_slots[h].msm = dnst_msm_get(i->f.msm_ids[j]);
+	}
+	return 0;
+}
+
+/* Point cur at the record at idx_pos of the sidecar index */
+static dnst *dnst_iter_idx_cur(dnst_iter *i)
+{
+	while (i->filter && i->idx_pos < i->idx_end
+	&&  (  i->idx.time[i->idx_pos] <  i->t_start
+	    || i->idx.time[i->idx_pos] >= i->t_stop))
+		i->idx_pos += 1;
+	if (i->idx_pos >= i->idx_end
+	||  !(i->cur = dnst_file_rec(&i->f, i->idx.off[i->idx_pos])))
+		return NULL;
+	i->cur_time = i->idx.time[i->idx_pos];
+	return i->cur;
+}
+
+/* The record at i->off, or on unsorted files the first one from there that
+ * is in range.
+ */
+static dnst *dnst_iter_file_cur(dnst_iter *i)
+{
+	while (i->off < i->end_off && (i->cur = dnst_file_rec(&i->f, i->off))) {
+		i->cur_time = i->cur->time;
+		if (!i->filter || (  i->cur_time >= i->t_start
+		                  && i->cur_time <  i->t_stop))
+			return i->cur;
+		i->off = dnst_file_next(&i->f, i->off, i->cur);
+	}
+	return (i->cur = NULL);
+}
+
+/* Open the file for the day of i->start.  Starting or stopping at an hour
+ * only skips the records outside that range on the first and last day.
+ * Sorted files are seeked to the range, unsorted files are iterated from
+ * start to end with the records outside the range skipped.
+ * With a sidecar index the records are selected from the index.  Blocks
+ * of compressed files are decompressed as the records are visited.
+ * Merged files (from merge_dnst) have the msm_id with each record.
+ */
 dnst *dnst_iter_open(dnst_iter *i)
 {
 	char fn[4096 + 32 ];
-	int r;
+	char idx_fn[4096 + 36];
+	int r, sorted;
+	size_t j;
 	struct stat st;
+	struct tm day_tm = i->start;
+	time_t day, stop;
 
 	r = snprintf( fn, sizeof(fn), "%s/%.4d-%.2d-%.2d.dnst"
 	            , i->msm_dir
@@ -90,47 +223,99 @@ dnst *dnst_iter_open(dnst_iter *i)
 		fprintf(stderr, "\"%s\" too small\n", fn);
 	
 	else if ((i->buf = mmap( NULL, st.st_size
-	                       , PROT_READ, MAP_PRIVATE, i->fd, 0)) == MAP_FAILED)
+	                       , PROT_READ, MAP_PRIVATE, i->fd, 0)) == MAP_FAILED) {
 		fprintf(stderr, "Could not mmap \"%s\"\n", fn);
-	else if (st.st_size >= 16
-	     &&  dnst_fits( (i->cur = (void *)i->buf)
-	                  , (i->end_of_buf = i->buf + st.st_size)))
-		return i->cur;
-	else
-		i->cur = NULL;
+		i->buf = NULL;
+
+	} else if ((i->buf_sz = st.st_size)
+	       &&  dnst_file_init(&i->f, i->buf, st.st_size) < 0)
+		fprintf(stderr, "\"%s\" is of an unknown version\n", fn);
+	else {
+		for (j = 0; j < i->f.n_msms; j++)
+			(void) msm_errors_get(i->shard, i->f.msm_ids[j]);
+		if (i->f.n_msms && dnst_iter_msms_init(i))
+			fprintf(stderr, "Could not allocate measurements\n");
+		day_tm.tm_hour = 0;
+		day = timegm(&day_tm);
+		stop = timegm(&i->stop);
+		/* Seeking to the first record at or after a time only finds
+		 * the range in sorted files.
+		 */
+		sorted = dnst_file_sorted(&i->f);
+		i->filter = !sorted && (i->start.tm_hour || stop < day + 86400);
+		i->t_start = i->start.tm_hour ? day + i->start.tm_hour * 3600 : 0;
+		i->t_stop = stop < day + 86400 ? (uint32_t)stop : UINT32_MAX;
+		snprintf(idx_fn, sizeof(idx_fn), "%s.idx", fn);
+		if (!dnst_idx_load(&i->idx, idx_fn, st.st_size)) {
+			i->idx_pos = !i->start.tm_hour || !sorted ? 0
+			           : dnst_idx_seek(&i->idx, 0, i->t_start);
+			i->idx_end = stop >= day + 86400 || !sorted ? i->idx.n
+			           : dnst_idx_seek(&i->idx, i->idx_pos, stop);
+			if (dnst_iter_idx_cur(i))
+				return i->cur;
+			dnst_idx_free(&i->idx);
+		} else {
+			i->off = i->start.tm_hour && sorted
+			       ? dnst_file_seek(&i->f, i->t_start)
+			       : i->f.recs_off;
+			i->end_off = stop < day + 86400 && sorted
+			           ? dnst_file_seek(&i->f, stop) : i->f.end_off;
+			if (dnst_iter_file_cur(i))
+				return i->cur;
+		}
+	}
+	dnst_file_done(&i->f);
+	free(i->msm_slots);
+	i->msm_slots = NULL;
 	if (i->buf)
-		munmap(i->buf, i->end_of_buf - i->buf);
+		munmap(i->buf, i->buf_sz);
+	i->buf = NULL;
 	if (i->fd >= 0)
 		close(i->fd);
+	i->fd = -1;
 
 	i->start.tm_mday += 1;
+	i->start.tm_hour = 0;
 	return (i->cur = NULL);
 }
 
 void dnst_iter_next(dnst_iter *i)
 {
-	i->cur = dnst_next(i->cur);
-	if ((uint8_t *)i->cur + 16 < i->end_of_buf
-	&&  dnst_fits(i->cur, i->end_of_buf))
-		return;
+	if (i->idx.map) {
+		i->idx_pos += 1;
+		if (dnst_iter_idx_cur(i))
+			return;
+
+	} else {
+		i->off = dnst_file_next(&i->f, i->off, i->cur);
+		if (dnst_iter_file_cur(i))
+			return;
+	}
 	dnst_iter_done(i);
 	i->start.tm_mday += 1;
+	i->start.tm_hour = 0;
 	while (!i->cur && timegm(&i->start) < timegm(&i->stop))
 		dnst_iter_open(i);
 }
 
-void dnst_iter_init(dnst_iter *i, struct tm *start, struct tm *stop, const char *path)
+void dnst_iter_init(dnst_iter *i, iter_shard *shard,
+    struct tm *start, struct tm *stop, const char *path)
 {
 	const char *slash;
 	if (timegm(start) >= timegm(stop))
 		return;
 
+	i->shard = shard;
 	i->fd = -1;
 	i->start = *start;
 	i->stop  = *stop;
 	if (!(slash = strrchr(path, '/')))
 		i->msm_id = atoi(path);
 	else	i->msm_id = atoi(slash + 1);
+	if (i->msm_id) {
+		(void) msm_errors_get(shard, i->msm_id);
+		i->msm = dnst_msm_get(i->msm_id);
+	}
 	(void)strlcpy(i->msm_dir, path, sizeof(i->msm_dir));
 	while (!i->cur && timegm(&i->start) < timegm(stop))
 		dnst_iter_open(i);
@@ -162,18 +347,35 @@ void rec_debug(FILE *f, const char *msg, unsigned int msm_id, uint32_t time, dns
 	fprintf( f, "%s %5" PRIu32 "_%s\n"
 	       , timestr, rec->key.prb_id, addrstr);
 }
-static FILE *out = NULL;
-void log_rec(dnst_rec *rec)
+void log_rec(iter_shard *s, dnst_rec *rec)
 {
+	FILE *out = s->out;
+	uint64_t *new_seqs;
 	size_t i;
 	char addrstr[80];
 	char timestr[80];
 	struct tm tm;
 	time_t t;
 
-	if (!out)
+	if (!out || s->r)
 		return;
 
+	if (s->n_shards > 1) {
+		if (s->n_lines == s->sz_lines) {
+			size_t new_sz = s->sz_lines ? s->sz_lines * 2 : 4096;
+
+			if (!(new_seqs = realloc( s->line_seqs
+			                        , new_sz * sizeof(uint64_t)))) {
+				/* Lines would no longer merge in order */
+				fprintf(stderr, "Could not allocate line sequence\n");
+				s->r = -1;
+				return;
+			}
+			s->line_seqs = new_seqs;
+			s->sz_lines = new_sz;
+		}
+		s->line_seqs[s->n_lines++] = s->seq;
+	}
 	t = rec->updated;
 	gmtime_r(&t, &tm);
 	strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%SZ", &tm);
@@ -272,564 +474,449 @@ void log_hdr(FILE *out)
 	fprintf(out, "\n");
 }
 
-void process_secure(uint8_t *msg, size_t msg_len,
-    uint8_t *secure, uint8_t *bogus, uint8_t *result)
+/* Error counts per measurement and per resolver, for the errors from
+ * DNST_ERR_TIMEOUT on (DNST_ERR_JSON records are classified on reading).
+ */
+void log_errors(const char *date, iter_shard *shards, size_t n_shards,
+    dnst_rec_node **nodes, size_t n_nodes)
 {
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_A
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&& (rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end)
-	&&  rr->rr_i.rr_type[10] == 145 &&  rr->rr_i.rr_type[11] ==  97
-	&&  rr->rr_i.rr_type[12] ==  20 &&  rr->rr_i.rr_type[13] ==  17) {
-
-		*secure = CAP_DOES;
-		if (*bogus == CAP_DOESNT)
-			*result  = CAP_DOES;
-		else if (*bogus == CAP_DOES)
-			*result  = CAP_DOESNT;
-	} else {
-		*secure = CAP_DOESNT;
-		if (*bogus != CAP_UNKNOWN)
-			*result = CAP_BROKEN;
+	char fn[40];
+	char addrstr[80];
+	FILE *f;
+	size_t i, j, n;
+	uint8_t e;
+	dnst_rec_node *rec_node;
+
+	snprintf(fn, sizeof(fn), "%s_msm_errors.csv", date);
+	if (!(f = fopen(fn, "w")))
+		fprintf(stderr, "Could not open '%s'\n", fn);
+	else {
+		fprintf(f, "\"msm_id\"");
+		for (e = DNST_ERR_TIMEOUT; e < DNST_N_ERR; e++)
+			fprintf(f, ",\"%s\"", dnst_error_str(e));
+		fprintf(f, "\n");
+		for (i = 0; i < shards[0].n_msms; i++) {
+			fprintf(f, "%" PRIu32, shards[0].msms[i].msm_id);
+			for (e = DNST_ERR_TIMEOUT; e < DNST_N_ERR; e++) {
+				for (j = 0, n = 0; j < n_shards; j++)
+					if (i < shards[j].n_msms)
+						n += shards[j].msms[i].errors[e];
+				fprintf(f, ",%zu", n);
+			}
+			fprintf(f, "\n");
+		}
+		fclose(f);
+	}
+	snprintf(fn, sizeof(fn), "%s_res_errors.csv", date);
+	if (!(f = fopen(fn, "w"))) {
+		fprintf(stderr, "Could not open '%s'\n", fn);
+		return;
+	}
+	fprintf(f, "\"probe ID\",\"probe resolver\"");
+	for (e = DNST_ERR_TIMEOUT; e < DNST_N_ERR; e++)
+		fprintf(f, ",\"%s\"", dnst_error_str(e));
+	fprintf(f, "\n");
+	for (i = 0; i < n_nodes; i++) {
+		rec_node = nodes[i];
+		for (e = DNST_ERR_TIMEOUT; e < DNST_N_ERR; e++)
+			if (rec_node->errors[e])
+				break;
+		if (e == DNST_N_ERR)
+			continue;
+
+		if (memcmp(rec_node->rec.key.addr, ipv4_mapped_ipv6_prefix, 12) == 0)
+			inet_ntop( AF_INET, &rec_node->rec.key.addr[12]
+			         , addrstr, sizeof(addrstr));
+		else
+			inet_ntop( AF_INET6, rec_node->rec.key.addr
+			         , addrstr, sizeof(addrstr));
+		fprintf(f, "%" PRIu32 ",%s", rec_node->rec.key.prb_id, addrstr);
+		for (e = DNST_ERR_TIMEOUT; e < DNST_N_ERR; e++)
+			fprintf(f, ",%zu", rec_node->errors[e]);
+		fprintf(f, "\n");
 	}
+	fclose(f);
 }
 
-void process_bogus(uint8_t *msg, size_t msg_len,
-    uint8_t *bogus, uint8_t *secure, uint8_t *result)
+/* The error class of d.  The json error objects in older files are
+ * classified by their first key.
+ */
+static uint8_t dnst_error_class(dnst *d)
 {
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_A
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&& (rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end)
-	&&  rr->rr_i.rr_type[10] == 145 &&  rr->rr_i.rr_type[11] ==  97
-	&&  rr->rr_i.rr_type[12] ==  20 &&  rr->rr_i.rr_type[13] ==  17) {
-
-		*bogus = CAP_DOES;
-		if (*secure == CAP_DOES)
-			*result = CAP_DOESNT;
-	} else {
-		*bogus = CAP_DOESNT;
-		if (*secure == CAP_DOES)
-			*result = CAP_DOES;
-	}
-}
+	const uint8_t *key, *end;
 
-#define PROCESS_DNSKEY_ALG_SECURE(ALG) \
-	process_secure( dnst_msg(d), d->len \
-	              , &rec->secure_reply[(ALG)] \
-	              , &rec->bogus_reply[(ALG)] \
-	              , &rec->dnskey_alg[(ALG)] )
+	if (d->error != DNST_ERR_JSON)
+		return d->error < DNST_N_ERR ? d->error : DNST_ERR_OTHER;
 
-#define PROCESS_DNSKEY_ALG_BOGUS(ALG) \
-	process_bogus( dnst_msg(d), d->len \
-	             , &rec->bogus_reply[(ALG)] \
-	             , &rec->secure_reply[(ALG)] \
-	             , &rec->dnskey_alg[(ALG)] )
+	else if (!(key = memchr(dnst_msg(d), '"', d->len)))
+		return DNST_ERR_OTHER;
 
-void process_nxdomain(dnst_rec *rec, uint8_t *msg, size_t msg_len)
-{
-	rrset_spc   rrset_spc;
-	rrset      *rrset = NULL;
-	rrtype_iter rr_spc, *rr = NULL;
-
-	if ((  RCODE_WIRE(msg) == RCODE_NXDOMAIN
-	    || RCODE_WIRE(msg) == RCODE_NOERROR)
-	&&  DNS_MSG_ANCOUNT(msg) == 0) {
-		rec->nxdomain = CAP_DOESNT; /* No hijack, good! */
-		memset(rec->hijacked, 0, sizeof(rec->hijacked));
-
-	} else if (RCODE_WIRE(msg) != RCODE_NOERROR
-	    || !(rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	    ||   rrset->rr_type != RRTYPE_A
-	    || !(rr = rrtype_iter_init(&rr_spc, rrset))) {
-		rec->nxdomain = CAP_BROKEN;
-	} else {
-		size_t i;
+	else if (!(end = memchr(key + 1, '"', dnst_msg(d) + d->len - key - 1)))
+		return DNST_ERR_OTHER;
 
-		rec->nxdomain = CAP_DOES;
-		for ( i = 0
-		    ; rr && i < sizeof(rec->hijacked) / sizeof(rec->hijacked[0])
-		    ; rr = rrtype_iter_next(rr), i++)
-			memcpy(rec->hijacked[i], rr->rr_i.rr_type + 10, 4);
-		if (rr)
-			fprintf(stderr, "More than %zu addresses in NX hijack\n"
-			              , i);
-	}
+	return dnst_error_code((const char *)key + 1, end - key - 1);
 }
 
-void process_whoami_g(dnst_rec *rec, uint8_t *msg, size_t msg_len)
-{
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-	int af = -1;
-	int mask = 0;
-
-	if (RCODE_WIRE(msg) != RCODE_NOERROR
-	|| !(rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	||   rrset->rr_type != RRTYPE_TXT)
-		; /* pass */
-	else for ( rr = rrtype_iter_init(&rr_spc, rrset)
-	         ; rr ; rr = rrtype_iter_next(rr)) {
-
-		uint16_t rd_len = READ_U16(rr->rr_i.rr_type + 8);
-		const uint8_t *rdata = rr->rr_i.rr_type + 10;
-		const uint8_t *eord  = rdata + rd_len;
-		uint8_t  txt_len;
+/* Resolvers are written to the .res file this many at a time */
+#define RES_BATCH 1024
+static dnst_rec res_batch[RES_BATCH];
 
-		if (eord > rr->rr_i.pkt_end)
-			break;
-		for (; rdata < eord; rdata += txt_len) {
-			char strbuf[80];
-
-			txt_len = *rdata;
-			rdata += 1;
-			if (txt_len > 20 &&
-			    memcmp(rdata, "edns0-client-subnet ", 20) == 0) {
-				const uint8_t *slash = rdata + txt_len - 1;
-				uint8_t numlen;
-
-				while (slash > rdata && *slash != '/')
-					slash--;
-				if (*slash == '/')
-					slash++;
-				numlen = txt_len - (slash - rdata);
-				if (numlen > sizeof(strbuf) - 1)
-					continue;
-				memcpy(strbuf, slash, numlen);
-				strbuf[numlen] = '\0';
-				mask = atoi(strbuf);
-				continue;
-			}
-			if (txt_len > sizeof(strbuf) - 1)
-				continue;
-			memcpy(strbuf, rdata, txt_len);
-			strbuf[txt_len] = '\0';
-			if (strchr(strbuf, ':'))
-				inet_pton((af = AF_INET6), strbuf, rec->whoami_6);
-			else
-				inet_pton((af = AF_INET ), strbuf, rec->whoami_g);
-		}
+/* The measurement of the records of i.  msm_id only changes with merged
+ * files, whose measurements are looked up in the table of the file.
+ */
+static inline const dnst_msm *dnst_iter_msm(dnst_iter *i, uint32_t msm_id)
+{
+	size_t h;
+
+	if (i->msm && i->msm->msm_id == msm_id)
+		return i->msm;
+
+	/* Records of merged files from the table of the file */
+	if (i->msm_slots) {
+		for ( h = dnst_msm_slot_hash(msm_id) & i->msm_mask
+		    ; i->msm_slots[h].msm_id
+		    ; h = (h + 1) & i->msm_mask)
+			if (i->msm_slots[h].msm_id == msm_id)
+				return (i->msm = i->msm_slots[h].msm);
 	}
-#if 1
-	rec->ecs_mask6 = mask >  32 ? mask : 0;
-	rec->ecs_mask  = mask <= 32 ? mask : 0;
-#else
-	switch (af) {
-	case AF_INET : rec->ecs_mask  = mask;
-		       rec->ecs_mask6 = 0;
-		       break;
-	case AF_INET6: rec->ecs_mask  = 0;
-		       rec->ecs_mask6 = mask;
-		       break;
-	default      : rec->ecs_mask  = 0;
-		       rec->ecs_mask6 = 0;
-		       break;
-	}
-#endif
+	return (i->msm = dnst_msm_get(msm_id));
 }
 
-void process_whoami_a(dnst_rec *rec, uint8_t *msg, size_t msg_len)
+void process_dnst(iter_shard *s, dnst *d, unsigned int msm_id,
+    const dnst_msm *msm)
 {
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-	const uint8_t *rdata;
-	uint16_t rdlen;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_A
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&&  rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end
-	&&  READ_U16(rr->rr_i.rr_type + 8) == 4)
-		memcpy(rec->whoami_a, rr->rr_i.rr_type + 10, 4);
-}
+	dnst_rec_key k;
+	dnst_rec_node *rec_node;
+	dnst_rec *rec;
+	dnst_obs obs;
 
-void process_whoami_6(dnst_rec *rec, uint8_t *msg, size_t msg_len)
-{
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-	const uint8_t *rdata;
-	uint16_t rdlen;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_AAAA
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&&  rr->rr_i.rr_type + 26 <= rr->rr_i.pkt_end
-	&&  READ_U16(rr->rr_i.rr_type + 8) == 16)
-		memcpy(rec->whoami_6, rr->rr_i.rr_type + 10, 16);
-}
+	k.prb_id = d->prb_id;
+	if (d->af == AF_INET6)
+		memcpy(k.addr, dnst_addr(d), 16);
+	else if (d->af == AF_INET) {
+		memcpy( k.addr    , ipv4_mapped_ipv6_prefix, 12);
+		memcpy(&k.addr[12], dnst_addr(d), 4);
+	} else
+		return;
 
-void process_qnamemin(dnst_rec *rec, uint8_t *msg, size_t msg_len)
-{
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
+	if (!(rec_node = rec_hash_find(&s->recs, &k))
+	&&  !(rec_node = rec_hash_new(&s->recs, &k))) {
+		fprintf(stderr, "Could not allocate resolver\n");
+		return;
+	}
+	rec = &rec_node->rec;
+	if (d->error && d->error != DNST_OBS)
+		rec_node->errors[dnst_error_class(d)] += 1;
 
-	if (RCODE_WIRE(msg) != RCODE_NOERROR
-	|| !(rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	||   rrset->rr_type != RRTYPE_TXT)
-		; /* pass */
-	else for ( rr = rrtype_iter_init(&rr_spc, rrset)
-	         ; rr ; rr = rrtype_iter_next(rr)) {
+	else if (!msm || msm->kind == DNST_MSM_UNKNOWN) {
+		fprintf(stderr, "Unknown msm_id: %u\n", msm_id);
+		return;
 
-		uint16_t rd_len = READ_U16(rr->rr_i.rr_type + 8);
-		const uint8_t *rdata = rr->rr_i.rr_type + 10;
-		const uint8_t *eord  = rdata + rd_len;
-		uint8_t  txt_len;
+	} else if (dnst_obs_get(d, msm, &obs)) {
+		fprintf(stderr, "Bad observation for msm_id: %u\n", msm_id);
+		return;
+	} else
+		dnst_obs_apply(rec, msm->kind, msm->i, &obs);
 
-		if (eord > rr->rr_i.pkt_end)
-			break;
-		for (; rdata < eord; rdata += txt_len) {
-			txt_len = *rdata;
-			rdata += 1;
+	if (rec->updated == 0) {
+		rec->updated = d->time;
+		rec->logged = d->time;
 
-			if (txt_len >= 7 && memcmp(rdata, "HOORAY ", 7) == 0) {
-				rec->qnamemin = CAP_DOES;
-				break;
-			}
-			if (txt_len >= 3 && memcmp(rdata, "NO ", 3) == 0) {
-				rec->qnamemin = CAP_DOESNT;
-				break;
-			}
-		}
+	} else if (d->time < rec->updated && rec->updated - d->time > 3600) {
+		rec_debug( stderr, "Discard > 1 hour back leap", msm_id, d->time, rec);
+		return;
+
+	} else if (d->time > rec->updated)
+		rec->updated = d->time;
+
+	if (rec->updated - rec->logged > 3600) {
+		log_rec(s, rec);
+		rec->logged = d->time;
 	}
 }
 
-void process_tcp4(dnst_rec *rec, uint8_t *msg, size_t msg_len)
+/* YYYY-MM-DD, or YYYY-MM-DDTHH to start or stop at an hour */
+static const char *parse_date(const char *str, struct tm *tm)
 {
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-	const uint8_t *rdata;
-	uint16_t rdlen;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_A
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&&  rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end
-	&&  READ_U16(rr->rr_i.rr_type + 8) == 4) {
-		rec->tcp_ipv4 = CAP_CAN;
-		/* if (memcmp(rec->whoami_a, zeros, 4) == 0) */
-			memcpy(rec->whoami_a, rr->rr_i.rr_type + 10, 4);
-	} else	rec->tcp_ipv4 = CAP_CANNOT;
-}
+	const char *endptr;
 
-void process_tcp6(dnst_rec *rec, uint8_t *msg, size_t msg_len)
-{
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-	const uint8_t *rdata;
-	uint16_t rdlen;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_AAAA
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&&  rr->rr_i.rr_type + 26 <= rr->rr_i.pkt_end
-	&&  READ_U16(rr->rr_i.rr_type + 8) == 16) {
-		rec->tcp_ipv6 = CAP_CAN;
-		/* if (memcmp(rec->whoami_6, zeros, 16) == 0) */
-			memcpy(rec->whoami_6, rr->rr_i.rr_type + 10, 16);
-	} else	rec->tcp_ipv6 = CAP_CANNOT;
+	if ((endptr = strptime(str, "%Y-%m-%dT%H", tm)) && !*endptr)
+		return endptr;
+	memset(tm, 0, sizeof(struct tm));
+	return strptime(str, "%Y-%m-%d", tm);
 }
 
-
-void process_not_ta_19036(dnst_rec *rec, uint8_t *msg, size_t msg_len)
+/* Merge the records of all measurement directories in time order, and
+ * process those of the probes of shard s.
+ */
+static void *iter_shard_run(void *arg)
 {
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_A
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&& (rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end)
-	&&  rr->rr_i.rr_type[10] == 145 &&  rr->rr_i.rr_type[11] ==  97
-	&&  rr->rr_i.rr_type[12] ==  20 &&  rr->rr_i.rr_type[13] ==  17) {
-
-		rec->not_ta_19036 = CAP_DOES;
-		rec->has_ta_19036 = rec->has_ta_20326 == CAP_DOES
-		                  ? CAP_DOESNT : CAP_UNKNOWN;
-#if 0
-		rec->has_ta_19036 =
-		    (  rec->has_ta_20326 == CAP_DOES     /* support */
-		    && rec->is_ta_19036  != CAP_DOESNT ) /* no contradiction */
-		    ?  CAP_DOESNT : CAP_UNKNOWN;
-#endif
-	} else {
-		rec->not_ta_19036 = CAP_DOESNT;
-		rec->has_ta_19036 = rec->has_ta_20326 == CAP_DOES
-		                  ? CAP_DOES : CAP_UNKNOWN;
-#if 0
-		rec->has_ta_19036 =
-		    (  rec->has_ta_20326 == CAP_DOES     /* support */
-		    && rec->is_ta_19036  != CAP_DOES )   /* no contradiction */
-		    ?  CAP_DOES   : CAP_UNKNOWN;
-#endif
+	iter_shard *s = arg;
+	dnst_iter *iters, *first;
+	loser_tree lt;
+	uint32_t msm_id, prb_id;
+	uint64_t seq = 0;
+	size_t i, *errors;
+	int in_shard;
+
+	if (!(iters = calloc(s->n_dirs, sizeof(dnst_iter)))) {
+		fprintf(stderr, "Could not allocate dnst_iterators\n");
+		s->r = -1;
+		return NULL;
+	}
+	if (loser_tree_init(&lt, s->n_dirs)) {
+		fprintf(stderr, "Could not allocate loser tree\n");
+		free(iters);
+		s->r = -1;
+		return NULL;
 	}
+	for (i = 0; i < s->n_dirs; i++) {
+		dnst_iter_init(&iters[i], s, &s->start, &s->stop, s->dirs[i]);
+		if (iters[i].cur)
+			lt.key[i] = iters[i].cur_time;
+	}
+	/* The iterator with the earliest record goes first, the one
+	 * given first on the same time.
+	 */
+	loser_tree_play(&lt);
+	do {
+		i = loser_tree_winner(&lt);
+		first = iters[i].cur ? &iters[i] : NULL;
+		if (!first)
+			; /* pass */
+
+		else if (only_prb_id && only_prb_id != (prb_id = (first->idx.map
+		    ? first->idx.prb_id[first->idx_pos] : first->cur->prb_id)))
+			dnst_iter_next(first);
+		else {
+			prb_id = first->idx.map ? first->idx.prb_id[first->idx_pos]
+			                        : first->cur->prb_id;
+			in_shard = prb_id % s->n_shards == s->shard;
+			msm_id = first->f.pre
+			       ? dnst_file_rec_msm_id(&first->f, first->cur)
+			       : first->msm_id;
+			/* Looked up for the records of all shards, so they
+			 * register the measurements in the same order.
+			 */
+			if (first->cur->error
+			&&  first->cur->error != DNST_OBS
+			&&  (errors = msm_errors_get(s, msm_id)) && in_shard)
+				errors[dnst_error_class(first->cur)] += 1;
+			if (in_shard) {
+				s->seq = seq;
+				process_dnst( s, first->cur, msm_id
+				            , dnst_iter_msm(first, msm_id));
+			}
+			seq += 1;
+			dnst_iter_next(first);
+		}
+		if (first) {
+			lt.key[i] = first->cur ? first->cur_time
+			                       : LOSER_TREE_DONE;
+			loser_tree_replay(&lt);
+		}
+	} while (first && !s->r);
+
+	loser_tree_free(&lt);
+	for (i = 0; i < s->n_dirs; i++)
+		dnst_iter_done(&iters[i]);
+	free(iters);
+	return NULL;
 }
 
-void process_not_ta_20326(dnst_rec *rec, uint8_t *msg, size_t msg_len)
+/* Write the CSV lines of the shards to out in the order of the records
+ * they were logged for, which is the order without shards.
+ */
+static int iter_shards_merge_lines(FILE *out, iter_shard *shards,
+    size_t n_shards)
 {
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_A
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&& (rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end)
-	&&  rr->rr_i.rr_type[10] == 145 &&  rr->rr_i.rr_type[11] ==  97
-	&&  rr->rr_i.rr_type[12] ==  20 &&  rr->rr_i.rr_type[13] ==  17) {
-
-
-		rec->not_ta_20326 = CAP_DOES;
-		rec->has_ta_20326 = CAP_UNKNOWN;
-	} else {
-		rec->not_ta_20326 = CAP_DOESNT;
-		rec->has_ta_20326 = rec->dnskey_alg[5] == CAP_DOES
-		                  ? CAP_DOES : CAP_UNKNOWN;
+	loser_tree lt;
+	char **lines;
+	size_t *line_szs, *pos, i;
+	int r = 0;
+
+	if (!(lines = calloc(n_shards, sizeof(char *)))
+	||  !(line_szs = calloc(n_shards, sizeof(size_t)))) {
+		fprintf(stderr, "Could not allocate CSV lines\n");
+		free(lines);
+		return -1;
 	}
-
+	if (!(pos = calloc(n_shards, sizeof(size_t)))
+	||  loser_tree_init(&lt, n_shards)) {
+		fprintf(stderr, "Could not allocate loser tree\n");
+		free(pos);
+		free(line_szs);
+		free(lines);
+		return -1;
+	}
+	for (i = 0; i < n_shards; i++) {
+		rewind(shards[i].out);
+		if (shards[i].n_lines)
+			lt.key[i] = shards[i].line_seqs[0];
+	}
+	loser_tree_play(&lt);
+	while (!r && lt.key[(i = loser_tree_winner(&lt))] != LOSER_TREE_DONE) {
+		if (getline(&lines[i], &line_szs[i], shards[i].out) < 0
+		||  fputs(lines[i], out) == EOF) {
+			perror("Could not merge CSV lines");
+			r = -1;
+		}
+		pos[i] += 1;
+		lt.key[i] = pos[i] < shards[i].n_lines ? shards[i].line_seqs[pos[i]]
+		                                       : LOSER_TREE_DONE;
+		loser_tree_replay(&lt);
+	}
+	loser_tree_free(&lt);
+	for (i = 0; i < n_shards; i++)
+		free(lines[i]);
+	free(pos);
+	free(line_szs);
+	free(lines);
+	return r;
 }
 
-void process_is_ta_20326(dnst_rec *rec, uint8_t *msg, size_t msg_len)
+/* A newly allocated array of the resolvers of all shards, in key order */
+static dnst_rec_node **iter_shards_sorted(iter_shard *shards, size_t n_shards,
+    size_t *n)
 {
-	return; /* Temporarily disabled */
-#if 0
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_A
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&& (rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end)
-	&&  rr->rr_i.rr_type[10] == 145 &&  rr->rr_i.rr_type[11] ==  97
-	&&  rr->rr_i.rr_type[12] ==  20 &&  rr->rr_i.rr_type[13] ==  17) {
-
-		rec->is_ta_20326  = CAP_DOES;
-		rec->has_ta_20326 =
-		    (  rec->has_ta_19036 == CAP_DOES     /* support */
-		    && rec->not_ta_20326 != CAP_DOES )   /* no contradiction */
-		    ?  CAP_DOES   : CAP_UNKNOWN;
-	} else {
-		rec->is_ta_20326  = CAP_DOESNT;
-		rec->has_ta_20326 =
-		    (  rec->has_ta_19036 == CAP_DOES     /* support */
-		    && rec->not_ta_20326 != CAP_DOESNT ) /* no contradiction */
-		    ?  CAP_DOESNT : CAP_UNKNOWN;
+	dnst_rec_node ***sorted, **nodes;
+	size_t *pos, i, j, best;
+
+	for (i = 0, *n = 0; i < n_shards; i++)
+		*n += shards[i].recs.count;
+	if (n_shards == 1)
+		return rec_hash_sorted(&shards[0].recs);
+
+	if (!(sorted = calloc(n_shards, sizeof(dnst_rec_node **)))
+	||  !(pos = calloc(n_shards, sizeof(size_t)))
+	||  !(nodes = malloc((*n ? *n : 1) * sizeof(dnst_rec_node *)))) {
+		free(sorted);
+		return NULL;
 	}
-#endif
+	for (i = 0; i < n_shards; i++)
+		if (!(sorted[i] = rec_hash_sorted(&shards[i].recs)))
+			break;
+	if (i < n_shards) {
+		while (i > 0)
+			free(sorted[--i]);
+		free(nodes);
+		nodes = NULL;
+	} else for (j = 0; j < *n; j++) {
+		/* A handful of shards, so just compare their heads */
+		for (i = 0, best = n_shards; i < n_shards; i++) {
+			if (pos[i] == shards[i].recs.count)
+				continue;
+			if (best == n_shards
+			||  memcmp( &sorted[i][pos[i]]->rec.key
+			          , &sorted[best][pos[best]]->rec.key
+			          , sizeof(dnst_rec_key)) < 0)
+				best = i;
+		}
+		nodes[j] = sorted[best][pos[best]++];
+	}
+	for (i = 0; nodes && i < n_shards; i++)
+		free(sorted[i]);
+	free(pos);
+	free(sorted);
+	return nodes;
 }
 
-void process_does_flagday(dnst_rec *rec, uint8_t *msg, size_t msg_len)
+/* Process the shards, each but the first in a thread of its own.
+ * Returns -1 when one of them failed.
+ */
+static int iter_shards_run(iter_shard *shards, size_t n_shards)
 {
-	rrset_spc   rrset_spc;
-	rrset      *rrset;
-	rrtype_iter rr_spc, *rr;
-
-	if (RCODE_WIRE(msg) == RCODE_NOERROR
-	&& (rrset = rrset_answer(&rrset_spc, msg, msg_len))
-	&&  rrset->rr_type == RRTYPE_A
-	&& (rr = rrtype_iter_init(&rr_spc, rrset))
-	&& (rr->rr_i.rr_type + 14 <= rr->rr_i.pkt_end)
-	&&  rr->rr_i.rr_type[10] == 145 &&  rr->rr_i.rr_type[11] ==  97
-	&&  rr->rr_i.rr_type[12] ==  20 &&  rr->rr_i.rr_type[13] ==  17) {
-
-		rec->does_flagday = CAP_DOESNT;
-	} else {
-		rec->does_flagday = CAP_DOES;
+	size_t i;
+	int r = 0;
+
+	for (i = 1; i < n_shards; i++) {
+		if (pthread_create( &shards[i].thread, NULL
+		                  , iter_shard_run, &shards[i])) {
+			shards[i].thread = pthread_self();
+			iter_shard_run(&shards[i]);
+		}
 	}
+	iter_shard_run(&shards[0]);
+	for (i = 1; i < n_shards; i++) {
+		if (!pthread_equal(shards[i].thread, pthread_self()))
+			pthread_join(shards[i].thread, NULL);
+	}
+	for (i = 0; i < n_shards; i++)
+		if (shards[i].r)
+			r = -1;
+	return r;
 }
 
-static int dnst_cmp(const void *x, const void *y)
-{ return memcmp(x, y, sizeof(dnst_rec_key)); }
-static rbtree_type recs = { RBTREE_NULL, 0, dnst_cmp };
-
-void process_dnst(dnst *d, unsigned int msm_id)
+/* Load the resolvers of the .res file fn into the shards, leaving out
+ * those not updated since forget.
+ */
+static void iter_shards_load(iter_shard *shards, size_t n_shards,
+    const char *fn, time_t forget)
 {
-	dnst_rec_key k;
+	int fd;
+	struct stat st;
+	uint8_t *buf;
+	const dnst_rec *rec, *end;
 	dnst_rec_node *rec_node;
-	dnst_rec *rec;
+	size_t *counts, i, n = 0;
 
-	k.prb_id = d->prb_id;
-	if (d->af == AF_INET6)
-		memcpy(k.addr, dnst_addr(d), 16);
-	else if (d->af == AF_INET) {
-		memcpy( k.addr    , ipv4_mapped_ipv6_prefix, 12);
-		memcpy(&k.addr[12], dnst_addr(d), 4);
-	} else
+	if ((fd = open(fn, O_RDONLY)) < 0)
 		return;
 
-	if (!(rec_node = (dnst_rec_node *)rbtree_search(&recs, &k))) {
-		rec_node = calloc(1, sizeof(dnst_rec_node));
-		rec_node->rec.key = k;
-		rec_node->node.key = &rec_node->rec.key;
-		(void)rbtree_insert(&recs, &rec_node->node);
-	}
-	rec = &rec_node->rec;
-	if (d->error) {
-		/* TODO: log error; */
-	} else switch (msm_id) {
-	case  8310237: /* o-o.myaddr.l.google.com TXT */
-		process_whoami_g(rec, dnst_msg(d), d->len);
-		break;
-	case  8310245: /* whoami.akamai.net A */
-		process_whoami_a(rec, dnst_msg(d), d->len);
-		break;
-	case  8310366: /* <prb_id>.<time>.ripe-hackathon6.nlnetlabs.nl AAAA (ipv6 cap) */
-		process_whoami_6(rec, dnst_msg(d), d->len);
-		break;
-	case  8926853: /*  secure.d2a1n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 0); break;
-	case  8926855: /*  secure.d2a3n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 1); break;
-	case  8926857: /*  secure.d2a5n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 2); break;
-	case  8926859: /*  secure.d2a6n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 3); break;
-	case  8926861: /*  secure.d2a7n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 4); break;
-	case  8926863: /*  secure.d2a8n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 5); break;
-	case  8926865: /* secure.d2a10n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 6); break;
-	case  8926867: /* secure.d2a12n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 7); break;
-	case  8926869: /* secure.d2a13n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 8); break;
-	case  8926871: /* secure.d2a14n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE( 9); break;
-	case  8926873: /* secure.d2a15n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE(10); break;
-	case  8926875: /* secure.d2a16n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_SECURE(11); break;
-	case  8926854: /*   bogus.d2a1n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 0); break;
-	case  8926856: /*   bogus.d2a3n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 1); break;
-	case  8926858: /*   bogus.d2a5n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 2); break;
-	case  8926860: /*   bogus.d2a6n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 3); break;
-	case  8926862: /*   bogus.d2a7n1.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 4); break;
-	case  8926864: /*   bogus.d2a8n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 5); break;
-	case  8926866: /*  bogus.d2a10n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 6); break;
-	case  8926868: /*  bogus.d2a12n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 7); break;
-	case  8926870: /*  bogus.d2a13n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 8); break;
-	case  8926872: /*  bogus.d2a14n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS( 9); break;
-	case  8926874: /*  bogus.d2a15n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS(10); break;
-	case  8926876: /*  bogus.d2a16n3.rootcanary.net A */
-		PROCESS_DNSKEY_ALG_BOGUS(11); break;
-	case  8926887: /*  secure.d3a8n3.rootcanary.net A */
-		process_secure( dnst_msg(d), d->len
-		              , &rec->ds_secure_reply[0]
-			      , &rec->ds_bogus_reply[0]
-			      , &rec->ds_alg[0]
-			      );
-		break;
-	case  8926911: /*  secure.d4a8n3.rootcanary.net A */
-		process_secure( dnst_msg(d), d->len
-		              , &rec->ds_secure_reply[1]
-			      , &rec->ds_bogus_reply[1]
-			      , &rec->ds_alg[1]
-			      );
-		break;
-	case  8926888: /*   bogus.d3a8n3.rootcanary.net A */
-		process_bogus( dnst_msg(d), d->len
-			     , &rec->ds_bogus_reply[0]
-		             , &rec->ds_secure_reply[0]
-			     , &rec->ds_alg[0]
-			     );
-		break;
-	case  8926912: /*   bogus.d4a8n3.rootcanary.net A */
-		process_bogus( dnst_msg(d), d->len
-			     , &rec->ds_bogus_reply[1]
-		             , &rec->ds_secure_reply[1]
-			     , &rec->ds_alg[1]
-			     );
-		break;
-	case  8310250: /* qnamemintest.internet.nl TXT */
-		process_qnamemin(rec,  dnst_msg(d), d->len);
-		break;
-	case  8310360: /* <prb_id>.<time>.tc.ripe-hackathon4.nlnetlabs.nl A    (tcp4 cap) */
-		process_tcp4(rec, dnst_msg(d), d->len);
-		break;
-	case  8310364: /* <prb_id>.<time>.tc.ripe-hackathon6.nlnetlabs.nl AAAA (tcp6 cap) */
-		process_tcp6(rec, dnst_msg(d), d->len);
-		break;
-	case  8311777: /* nxdomain.ripe-hackathon2.nlnetlabs.nl A */
-		process_nxdomain(rec, dnst_msg(d), d->len);
-		break;
-	case 15283670: /* root-key-sentinel-not-ta-19036.d2a8n3.rootcanary.net A */
-		process_not_ta_19036(rec, dnst_msg(d), d->len);
-		break;
-	case 15283671: /* root-key-sentinel-not-ta-20326.d2a8n3.rootcanary.net A */
-		process_not_ta_20326(rec, dnst_msg(d), d->len);
-		break;
-	case 16430285: /* root-key-sentinel-is-ta-20326.d2a8n3.rootcanary.net A */
-		process_is_ta_20326(rec, dnst_msg(d), d->len);
-		break;
-	case 19185448: /* <random>.<prb_id>.<time>.flagday.rootcanary.net A */
-	case 19256455:
-		process_does_flagday(rec, dnst_msg(d), d->len);
-		break;
-	default:
-		fprintf(stderr, "Unknown msm_id: %u\n", msm_id);
-		return;
-	}
-	if (rec->updated == 0) {
-		rec->updated = d->time;
-		rec->logged = d->time;
+	else if (fstat(fd, &st) < 0)
+		fprintf(stderr, "Could not fstat \"%s\"\n", fn);
 
-	} else if (d->time < rec->updated && rec->updated - d->time > 3600) {
-		rec_debug( stderr, "Discard > 1 hour back leap", msm_id, d->time, rec);
-		return;
+	else if (st.st_size < (off_t)sizeof(dnst_rec))
+		; /* pass */
 
-	} else if (d->time > rec->updated)
-		rec->updated = d->time;
+	else if ((buf = mmap( NULL, st.st_size, PROT_READ
+	                    , MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		perror("Could not mmap resolvers");
 
-	if (rec->updated - rec->logged > 3600) {
-		log_rec(rec);
-		rec->logged = d->time;
+	else if (!(counts = calloc(n_shards, sizeof(size_t)))) {
+		fprintf(stderr, "Could not allocate space for nodes\n");
+		munmap(buf, st.st_size);
+	} else {
+		end = (const dnst_rec *)buf + st.st_size / sizeof(dnst_rec);
+		for (rec = (const dnst_rec *)buf; rec < end; rec++)
+			if ((time_t)rec->updated >= forget)
+				counts[rec->key.prb_id % n_shards] += 1;
+
+		/* One slab per shard, and tables that need no resize */
+		for (i = 0; i < n_shards; i++)
+			if (rec_hash_reserve(&shards[i].recs, counts[i]))
+				break;
+		if (i < n_shards)
+			fprintf(stderr, "Could not allocate space for nodes\n");
+
+		else for (rec = (const dnst_rec *)buf; rec < end; rec++) {
+			if ((time_t)rec->updated < forget)
+				continue;
+			if (!(rec_node = rec_hash_new(
+			    &shards[rec->key.prb_id % n_shards].recs, &rec->key))) {
+				fprintf(stderr, "Could not add resolver\n");
+				break;
+			}
+			rec_node->rec = *rec;
+			n += 1;
+		}
+		free(counts);
+		munmap(buf, st.st_size);
 	}
+	close(fd);
+	fprintf(stderr, "Starting with %zu resolvers\n", n);
 }
 
 int main(int argc, const char **argv)
 {
 	const char *endptr;
+	const char *msms_fn = NULL;
 	struct tm   start;
 	struct tm   stop;
-	dnst_iter  *iters;
-	size_t    n_iters, i;
-	dnst_rec_node *rec_node = NULL;
+	size_t      n_shards = 1, i, j, n_nodes;
+	iter_shard *shards;
+	int         r = 1;
+	dnst_rec_node *rec_node = NULL, **sorted;
 
 	assert(sizeof(dnst_rec) == sizeof(dnst_rec_node) -
 	    ((uint8_t *)&rec_node->rec - (uint8_t *)rec_node));
@@ -845,61 +932,64 @@ int main(int argc, const char **argv)
 		argc--;
 		argv++;
 	}
-	if (argc < 4)
-		printf("usage: [-q] %s <start-date> <stop-date> <msm_dir> [ ... ]\n", argv[0]);
+	if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+		only_prb_id = strtoul(argv[2], NULL, 10);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+		msms_fn = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+		n_shards = strtoul(argv[2], NULL, 10);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 4 || n_shards < 1)
+		printf("usage: %s [-q] [-p <prb_id>] [-m <msms_file>] "
+		       "[-j <threads>] <start-date>[T<hour>] "
+		       "<stop-date>[T<hour>] <msm_dir|merged_dir> [ ... ]\n"
+		     , argv[0]);
+
+	else if (msms_fn && dnst_msms_load(msms_fn))
+		; /* pass */
 
-	else if (!(endptr = strptime(argv[1], "%Y-%m-%d", &start)) || *endptr)
+	else if (!(endptr = parse_date(argv[1], &start)) || *endptr)
 		fprintf(stderr, "Could not parse <start-date>\n");
 
-	else if (!(endptr = strptime(argv[2], "%Y-%m-%d", &stop)) || *endptr)
+	else if (!(endptr = parse_date(argv[2], &stop)) || *endptr)
 		fprintf(stderr, "Could not parse <stop-date>\n");
 
 	else if (timegm(&start) >= timegm(&stop)) 
 		fprintf(stderr, "<start-date> should be < <stop-date> (%d >= %d)\n"
 		       , (int)timegm(&start), (int)timegm(&stop));
 
-	else if (!(iters = calloc((n_iters = argc - 3), sizeof(dnst_iter))))
-		fprintf(stderr, "Could not allocate dnst_iterators\n");
+	else if (!(shards = calloc(n_shards, sizeof(iter_shard))))
+		fprintf(stderr, "Could not allocate shards\n");
 
 	else {
 		char out_fn_tmp[40];
 		char out_fn[40];
 		char res_fn[40];
-		uint32_t prev_t;
-		int diff_t = 0;
-		dnst_iter *first;
+		FILE *out = NULL;
 		int res_fd = -1;
-		struct stat st;
-		uint8_t *nodes;
-		size_t n_nodes = 0;
 		time_t forget = timegm(&start);
 
 		forget -= 864000; /* Forget resolvers more than 10 days old */
 
+		for (i = 0; i < n_shards; i++) {
+			shards[i].shard = i;
+			shards[i].n_shards = n_shards;
+			shards[i].start = start;
+			shards[i].stop = stop;
+			shards[i].dirs = argv + 3;
+			shards[i].n_dirs = argc - 3;
+		}
 		snprintf(res_fn, sizeof(res_fn), "%s.res", argv[1]);
-		if ((res_fd = open(res_fn, O_RDONLY)) < 0)
-			;
-		else if (fstat(res_fd, &st) < 0)
-			fprintf(stderr, "Could not fstat \"%s\"\n", res_fn);
-
-		else if (!(nodes = malloc((n_nodes = (st.st_size / sizeof(dnst_rec)))
-		                                                 * sizeof(dnst_rec_node))))
-			fprintf(stderr, "Could not allocate space for nodes\n");
+		iter_shards_load(shards, n_shards, res_fn, forget);
 
-		else for (; n_nodes > 0; n_nodes--, nodes += sizeof(dnst_rec_node)) {
-			rec_node = (void *)nodes;
-			if (read(res_fd, &rec_node->rec, sizeof(dnst_rec)) < 0)
-				perror("Error reading resolvers");
-			if ((time_t)rec_node->rec.updated < forget)
-				continue;
-			rec_node->node.key = &rec_node->rec.key;
-			(void)rbtree_insert(&recs, &rec_node->node);
-		}
-		if (res_fd >= 0) {
-			close(res_fd);
-			res_fd = -1;
-			fprintf(stderr, "Starting with %zu resolvers\n", recs.count);
-		}
 		if (!quiet && snprintf(out_fn_tmp, sizeof(out_fn_tmp),
 		    "%s_%s.csv.tmp", argv[1], argv[2]) < sizeof(out_fn_tmp)) {
 			snprintf( out_fn, sizeof(out_fn)
@@ -907,39 +997,69 @@ int main(int argc, const char **argv)
 			out = fopen(out_fn_tmp, "w");
 			log_hdr(out);
 		}
-		for (i = 0; i < n_iters; i++)
-			dnst_iter_init(&iters[i], &start, &stop, argv[i+3]);
-
-		do {
-			first = NULL;
-			for (i = 0; i < n_iters; i++) {
-				if (iters[i].cur
-				&& (!first || iters[i].cur->time < first->cur->time))
-					first = &iters[i];
+		/* With more than one shard, the CSV lines go to a temporary
+		 * file per shard first.
+		 */
+		if (out && n_shards == 1)
+			shards[0].out = out;
+		else for (i = 0; out && i < n_shards; i++) {
+			if (!(shards[i].out = tmpfile()))
+				break;
+		}
+		if (out && i < n_shards)
+			perror("Could not create temporary file");
+
+		else if (iter_shards_run(shards, n_shards))
+			; /* pass */
+
+		else if (out && n_shards > 1
+		     &&  iter_shards_merge_lines(out, shards, n_shards))
+			; /* pass */
+
+		/* The resolvers are written in key order */
+		else if (!(sorted = iter_shards_sorted(shards, n_shards, &n_nodes)))
+			fprintf(stderr, "Could not sort resolvers\n");
+
+		else {
+			if (out) {
+				fclose(out);
+				out = NULL;
+				if (n_shards == 1)
+					shards[0].out = NULL;
+				rename(out_fn_tmp, out_fn);
+				log_errors(argv[2], shards, n_shards, sorted, n_nodes);
 			}
-			if (first) {
-				process_dnst(first->cur, first->msm_id);
-				dnst_iter_next(first);
+			snprintf(res_fn, sizeof(res_fn), "%s.res", argv[2]);
+			if ((res_fd = open(res_fn, O_WRONLY | O_CREAT, 0644)) == -1)
+				fprintf(stderr, "Could not open '%s'\n", res_fn);
+
+			else for (i = 0; i < n_nodes; i += j) {
+				for (j = 0; j < RES_BATCH && i + j < n_nodes; j++)
+					res_batch[j] = sorted[i + j]->rec;
+				if (write(res_fd, res_batch, j * sizeof(dnst_rec)) < 0) {
+					perror("Error writing resolvers");
+					break;
+				}
 			}
-		} while (first);
-
-		for (i = 0; i < n_iters; i++)
-			dnst_iter_done(&iters[i]);
+			if (res_fd != -1)
+				close(res_fd);
+			free(sorted);
+			fprintf(stderr, "%zu resolvers on exit\n", n_nodes);
+			r = 0;
+		}
+		/* out is still open when something failed */
 		if (out) {
 			fclose(out);
-			rename(out_fn_tmp, out_fn);
+			unlink(out_fn_tmp);
 		}
-		snprintf(res_fn, sizeof(res_fn), "%s.res", argv[2]);
-		if ((res_fd = open(res_fn, O_WRONLY | O_CREAT, 0644)) == -1)
-			fprintf(stderr, "Could not open '%s'\n", res_fn);
-
-		else RBTREE_FOR(rec_node, dnst_rec_node *, &recs) {
-			write(res_fd, &rec_node->rec, sizeof(dnst_rec));
+		for (i = 0; i < n_shards; i++) {
+			if (shards[i].out && shards[i].out != out)
+				fclose(shards[i].out);
+			free(shards[i].line_seqs);
+			free(shards[i].msms);
+			rec_hash_free(&shards[i].recs);
 		}
-		if (res_fd != -1)
-			close(res_fd);
-		fprintf(stderr, "%zu resolvers on exit\n", recs.count);
-		return 0;
+		free(shards);
 	}
-	return 1;
+	return r;
 }
@@ -0,0 +1,232 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#include "json-scan.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#define JSON_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/* The index is built 64 bytes at a time, in the manner of simdjson: a bit
+ * mask per character class is made for the block, escaped quotes are
+ * removed, and a prefix xor over the remaining quotes gives the bytes that
+ * are inside strings.  Structural characters outside of strings, and the
+ * quotes themselves, then end up in the index.
+ */
+#ifdef JSON_SCAN_SSE2
+static inline uint64_t json_scan_eq(const __m128i v[4], char c)
+{
+	const __m128i cv = _mm_set1_epi8(c);
+
+	return  (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[0], cv))
+	     | ((uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[1], cv)) << 16)
+	     | ((uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[2], cv)) << 32)
+	     | ((uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[3], cv)) << 48);
+}
+
+static inline void json_scan_classify(const char *blk,
+    uint64_t *quote, uint64_t *bslash, uint64_t *op)
+{
+	__m128i v[4];
+
+	v[0] = _mm_loadu_si128((const __m128i *)(blk     ));
+	v[1] = _mm_loadu_si128((const __m128i *)(blk + 16));
+	v[2] = _mm_loadu_si128((const __m128i *)(blk + 32));
+	v[3] = _mm_loadu_si128((const __m128i *)(blk + 48));
+	*quote  = json_scan_eq(v, '"');
+	*bslash = json_scan_eq(v, '\\');
+	*op     = json_scan_eq(v, '{') | json_scan_eq(v, '}')
+	        | json_scan_eq(v, '[') | json_scan_eq(v, ']')
+	        | json_scan_eq(v, ':') | json_scan_eq(v, ',');
+}
+#else
+static inline void json_scan_classify(const char *blk,
+    uint64_t *quote, uint64_t *bslash, uint64_t *op)
+{
+	uint64_t q = 0, b = 0, o = 0;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		switch (blk[i]) {
+		case '"' : q |= (uint64_t)1 << i;
+		           break;
+		case '\\': b |= (uint64_t)1 << i;
+		           break;
+		case '{' : case '}':
+		case '[' : case ']':
+		case ':' : case ',':
+		           o |= (uint64_t)1 << i;
+		           break;
+		default  : break;
+		}
+	}
+	*quote = q;
+	*bslash = b;
+	*op = o;
+}
+#endif
+
+/* Characters escaped by an odd length run of backslashes */
+static inline uint64_t json_scan_escaped(json_scan_state *st, uint64_t bslash)
+{
+	const uint64_t even_bits = 0x5555555555555555ULL;
+	uint64_t follows_escape, odd_starts, even_seqs;
+
+	bslash &= ~st->escaped;
+	follows_escape = bslash << 1 | st->escaped;
+	odd_starts = bslash & ~even_bits & ~follows_escape;
+	even_seqs = odd_starts + bslash;
+	st->escaped = even_seqs < odd_starts; /* carry */
+	return (even_bits ^ (even_seqs << 1)) & follows_escape;
+}
+
+static inline uint64_t json_scan_prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+uint64_t json_scan_block(json_scan_state *st, const char *blk)
+{
+	uint64_t quote, bslash, op, in_str;
+
+	json_scan_classify(blk, &quote, &bslash, &op);
+	quote &= ~json_scan_escaped(st, bslash);
+	in_str = json_scan_prefix_xor(quote) ^ st->in_str;
+	st->in_str = (uint64_t)((int64_t)in_str >> 63);
+	return (op & ~in_str) | quote;
+}
+
+static int json_scan_reserve(json_scan *s)
+{
+	size_t new_sz;
+	uint32_t *new_idx;
+
+	if (s->idx_sz - s->n_idx >= 64)
+		return 0;
+	new_sz = s->idx_sz ? s->idx_sz * 2 : 65536;
+	if (!(new_idx = realloc(s->idx, new_sz * sizeof(uint32_t))))
+		return JSON_SCAN_ERROR_NOMEM;
+	s->idx = new_idx;
+	s->idx_sz = new_sz;
+	return 0;
+}
+
+static inline void json_scan_add(json_scan *s, uint32_t base, uint64_t bits)
+{
+	uint32_t *idx = s->idx + s->n_idx;
+
+	s->n_idx += __builtin_popcountll(bits);
+	while (bits) {
+		*idx++ = base + __builtin_ctzll(bits);
+		bits &= bits - 1;
+	}
+}
+
+int json_scan_index(json_scan *s, const char *json, size_t len)
+{
+	json_scan_state st = { 0, 0 };
+	char tail[64];
+	size_t pos;
+
+	s->json = json;
+	s->len = len;
+	s->n_idx = 0;
+	if (len >= UINT32_MAX)
+		return JSON_SCAN_ERROR_NOMEM;
+
+	for (pos = 0; pos + 64 <= len; pos += 64) {
+		if (json_scan_reserve(s))
+			return JSON_SCAN_ERROR_NOMEM;
+		json_scan_add(s, pos, json_scan_block(&st, json + pos));
+	}
+	if (pos < len) {
+		memset(tail, ' ', sizeof(tail));
+		memcpy(tail, json + pos, len - pos);
+		if (json_scan_reserve(s))
+			return JSON_SCAN_ERROR_NOMEM;
+		json_scan_add(s, pos, json_scan_block(&st, tail));
+	}
+	return st.in_str ? JSON_SCAN_ERROR_PART : 0;
+}
+
+void json_scan_free(json_scan *s)
+{
+	free(s->idx);
+	s->idx = NULL;
+	s->n_idx = s->idx_sz = 0;
+}
+
+int json_scan_skip(const json_scan *s, size_t *i)
+{
+	size_t j = *i + 1;
+	int depth = 0;
+
+	switch (json_scan_c(s, j)) {
+	case '"': if (json_scan_c(s, j + 1) != '"')
+	                  return JSON_SCAN_ERROR_INVAL;
+	          *i = j + 2;
+	          return 0;
+	case ',':
+	case '}':
+	case ']': *i = j;
+	          return 0;
+	case '{':
+	case '[': break;
+	default : return JSON_SCAN_ERROR_INVAL;
+	}
+	/* Quotes come in pairs and braces in strings are not indexed, so only
+	 * the nesting depth needs tracking.
+	 */
+	for (; j < s->n_idx; j++) {
+		switch (s->json[s->idx[j]]) {
+		case '{':
+		case '[': depth++;
+		          break;
+		case '}':
+		case ']': if (--depth == 0) {
+		                  *i = j + 1;
+		                  return 0;
+		          }
+		          break;
+		default : break;
+		}
+	}
+	return JSON_SCAN_ERROR_PART;
+}
@@ -0,0 +1,170 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __JSON_SCAN_H_
+#define __JSON_SCAN_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_SCAN_ERROR_NOMEM -1
+#define JSON_SCAN_ERROR_INVAL -2
+#define JSON_SCAN_ERROR_PART  -3
+
+/* A structural index of a json text: the positions of all quotes, braces,
+ * brackets, colons and commas that are not inside a string.  Values are
+ * located by walking the index, so the bytes of values that are not needed
+ * are never looked at again.
+ *
+ * The walking functions below take the index position i of the structural
+ * character preceding a value (a ':', ',', '[' or '{') and advance i to the
+ * structural character following it.
+ */
+typedef struct json_scan {
+	const char *json;
+	size_t      len;
+	uint32_t   *idx;
+	size_t      n_idx;
+	size_t      idx_sz;
+} json_scan;
+
+/* State for scanning a json text in blocks of 64 bytes */
+typedef struct json_scan_state {
+	uint64_t in_str;  /* All ones when the previous block ended in a string */
+	uint64_t escaped; /* 1 when the previous block ended with an escape */
+} json_scan_state;
+
+/* Returns a mask of the structural characters in the 64 bytes at blk */
+uint64_t json_scan_block(json_scan_state *st, const char *blk);
+
+/* Index len bytes of json.  The index is valid as long as json is. */
+int json_scan_index(json_scan *s, const char *json, size_t len);
+void json_scan_free(json_scan *s);
+
+/* Skip the value following i */
+int json_scan_skip(const json_scan *s, size_t *i);
+
+static inline char json_scan_c(const json_scan *s, size_t i)
+{ return i < s->n_idx ? s->json[s->idx[i]] : '\0'; }
+
+/* Advance to the next member of the object that is opened or continued at
+ * i.  Returns 1 with i at the ':' after the key, or 0 with i past the
+ * closing brace.
+ */
+static inline int json_scan_member(const json_scan *s, size_t *i,
+    const char **key, size_t *key_len)
+{
+	size_t j = *i;
+	char c = json_scan_c(s, j);
+
+	if (c == '}' || (c == '{' && json_scan_c(s, j + 1) == '}')) {
+		*i = c == '}' ? j + 1 : j + 2;
+		return 0;
+	}
+	if ((c != '{' && c != ',') || json_scan_c(s, j + 1) != '"'
+	||  json_scan_c(s, j + 2) != '"' || json_scan_c(s, j + 3) != ':')
+		return JSON_SCAN_ERROR_INVAL;
+
+	*key = s->json + s->idx[j + 1] + 1;
+	*key_len = s->idx[j + 2] - s->idx[j + 1] - 1;
+	*i = j + 3;
+	return 1;
+}
+
+/* Advance to the next element of the array that is opened or continued at
+ * i.  Returns 1 with i at the character preceding the element, or 0 with i
+ * past the closing bracket.
+ */
+static inline int json_scan_element(const json_scan *s, size_t *i)
+{
+	size_t j = *i;
+	const char *p, *e;
+
+	switch (json_scan_c(s, j)) {
+	case ']': *i = j + 1;
+	          return 0;
+	case '[': if (json_scan_c(s, j + 1) != ']')
+	                  return 1;
+	          for ( p = s->json + s->idx[j] + 1, e = s->json + s->idx[j + 1]
+	              ; p < e; p++)
+	                  if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+	                          return 1;
+	          *i = j + 2;
+	          return 0;
+	case ',': return 1;
+	default : return JSON_SCAN_ERROR_INVAL;
+	}
+}
+
+/* The string value following i, without the quotes.  Escapes are left as is. */
+static inline int json_scan_string(const json_scan *s, size_t *i,
+    const char **str, size_t *len)
+{
+	size_t j = *i;
+
+	if (json_scan_c(s, j + 1) != '"' || json_scan_c(s, j + 2) != '"')
+		return JSON_SCAN_ERROR_INVAL;
+
+	*str = s->json + s->idx[j + 1] + 1;
+	*len = s->idx[j + 2] - s->idx[j + 1] - 1;
+	*i = j + 3;
+	return 0;
+}
+
+/* The number, true, false or null following i, without surrounding white
+ * space.
+ */
+static inline int json_scan_primitive(const json_scan *s, size_t *i,
+    const char **start, size_t *len)
+{
+	size_t j = *i;
+	const char *p, *e;
+
+	switch (json_scan_c(s, j + 1)) {
+	case ',':
+	case '}':
+	case ']': break;
+	default : return JSON_SCAN_ERROR_INVAL;
+	}
+	p = s->json + s->idx[j] + 1;
+	e = s->json + s->idx[j + 1];
+	while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	while (e > p && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r' || e[-1] == '\n'))
+		e--;
+	if (p == e)
+		return JSON_SCAN_ERROR_INVAL;
+	*start = p;
+	*len = e - p;
+	*i = j + 1;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,88 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include "loser-tree.h"
+
+/* Source k stands for one that comes before all others, while playing the
+ * initial tournament.
+ */
+static inline int loser_tree_beats(loser_tree *lt, size_t x, size_t y)
+{ return x == lt->k ? y != lt->k : y == lt->k ? 0
+       : lt->key[x] < lt->key[y] || (lt->key[x] == lt->key[y] && x < y); }
+
+int loser_tree_init(loser_tree *lt, size_t k)
+{
+	size_t i;
+
+	lt->k = k;
+	lt->key = NULL;
+	if (!(lt->node = malloc((k ? k : 1) * sizeof(size_t)))
+	||  !(lt->key = malloc((k ? k : 1) * sizeof(uint64_t)))) {
+		free(lt->node);
+		lt->node = NULL;
+		return -1;
+	}
+	for (i = 0; i < k || i == 0; i++) {
+		lt->node[i] = 0;
+		lt->key[i] = LOSER_TREE_DONE;
+	}
+	return 0;
+}
+
+void loser_tree_play(loser_tree *lt)
+{
+	size_t i, s, t, tmp;
+
+	for (i = 0; i < lt->k; i++)
+		lt->node[i] = lt->k;
+	for (i = lt->k; i > 0; i--) {
+		for (s = i - 1, t = (s + lt->k) / 2; t > 0; t /= 2) {
+			if (loser_tree_beats(lt, lt->node[t], s)) {
+				tmp = lt->node[t];
+				lt->node[t] = s;
+				s = tmp;
+			}
+		}
+		lt->node[0] = s;
+	}
+	if (!lt->k)
+		lt->node[0] = 0;
+}
+
+void loser_tree_free(loser_tree *lt)
+{
+	free(lt->key);
+	free(lt->node);
+	lt->key = NULL;
+	lt->node = NULL;
+	lt->k = 0;
+}
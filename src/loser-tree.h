@@ -0,0 +1,83 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __LOSER_TREE_H_
+#define __LOSER_TREE_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/* The key of an exhausted source, which comes after all others */
+#define LOSER_TREE_DONE UINT64_MAX
+
+/* A tournament tree for merging k sources on the key of their next item,
+ * in key[].  Each internal node holds the source that lost the match there,
+ * and node[0] the overall winner, so after the winner advanced only the
+ * log2(k) matches on its path to the root are replayed, against the
+ * losers.  On equal keys the lower source wins, so merges are stable.
+ */
+typedef struct loser_tree {
+	size_t    k;
+	size_t   *node;
+	uint64_t *key;
+} loser_tree;
+
+/* Allocate a tree for k sources, with all keys at LOSER_TREE_DONE */
+int loser_tree_init(loser_tree *lt, size_t k);
+
+/* Play the initial tournament, once the keys of all sources are set */
+void loser_tree_play(loser_tree *lt);
+
+/* The source with the first item */
+static inline size_t loser_tree_winner(loser_tree *lt)
+{ return lt->node[0]; }
+
+/* Replay the matches of the winner, after its key was set to that of its
+ * next item (or to LOSER_TREE_DONE).
+ */
+static inline void loser_tree_replay(loser_tree *lt)
+{
+	size_t s = lt->node[0], t, l;
+	uint64_t key = lt->key[s];
+
+	for (t = (s + lt->k) / 2; t > 0; t /= 2) {
+		l = lt->node[t];
+		if (lt->key[l] < key || (lt->key[l] == key && l < s)) {
+			lt->node[t] = s;
+			s = l;
+			key = lt->key[s];
+		}
+	}
+	lt->node[0] = s;
+}
+
+void loser_tree_free(loser_tree *lt);
+
+#endif
@@ -0,0 +1,313 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "dnst.h"
+#include "dnst-sort.h"
+#include "dnst-file.h"
+
+#define MERGE_BUF_SZ 1048576
+
+/* The file of a single measurement for the day */
+typedef struct merge_in {
+	int          fd;
+	uint8_t     *buf;
+	size_t       buf_sz;
+	dnst_file    f;
+	uint32_t     msm_id;
+	dnst       **refs;        /* For unsorted files, the records in order */
+	size_t       n, pos;
+	uint64_t     off;         /* Of cur in f for sorted files */
+	dnst        *cur;
+} merge_in;
+
+static void merge_in_done(merge_in *in)
+{
+	free(in->refs);
+	in->refs = NULL;
+	dnst_file_done(&in->f);
+	if (in->buf)
+		munmap(in->buf, in->buf_sz);
+	in->buf = NULL;
+	if (in->fd >= 0)
+		close(in->fd);
+	in->fd = -1;
+	in->cur = NULL;
+}
+
+static dnst *merge_in_next(merge_in *in)
+{
+	if (in->refs)
+		in->cur = ++in->pos < in->n ? in->refs[in->pos] : NULL;
+	else {
+		in->off = dnst_file_next(&in->f, in->off, in->cur);
+		in->cur = dnst_file_rec(&in->f, in->off);
+	}
+	return in->cur;
+}
+
+/* Open the file of msm_dir for date.  Returns 1 when there is no such file,
+ * 0 when the first record is in in->cur, and -1 on errors.  Unsorted files
+ * are sorted in memory.
+ */
+static int merge_in_open(merge_in *in, const char *msm_dir, const char *date)
+{
+	char fn[4096];
+	struct stat st;
+	uint32_t min_time, max_time;
+	int sorted;
+
+	memset(in, 0, sizeof(*in));
+	in->fd = -1;
+	if (snprintf(fn, sizeof(fn), "%s/%s.dnst", msm_dir, date)
+	    >= (int)sizeof(fn)) {
+		fprintf(stderr, "File name too large!\n");
+		return -1;
+
+	} else if ((in->fd = open(fn, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return 1;
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , fn, strerror(errno));
+
+	} else if (fstat(in->fd, &st) < 0)
+		fprintf(stderr, "Could not stat \"%s\": %s\n"
+		              , fn, strerror(errno));
+
+	else if (st.st_size == 0) {
+		merge_in_done(in);
+		return 1;
+
+	} else if ((in->buf = mmap( NULL, st.st_size, PROT_READ
+	                          , MAP_PRIVATE, in->fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Could not mmap \"%s\": %s\n"
+		              , fn, strerror(errno));
+		in->buf = NULL;
+
+	} else if ((in->buf_sz = st.st_size)
+	       &&  dnst_file_init(&in->f, in->buf, st.st_size) < 0)
+		fprintf(stderr, "\"%s\" is of an unknown version\n", fn);
+
+	else if (in->f.pre)
+		fprintf(stderr, "\"%s\" is already merged\n", fn);
+
+	else if (dnst_file_sorted(&in->f)) {
+		in->msm_id = in->f.hdr.msm_id ? in->f.hdr.msm_id
+		                              : dnst_file_msm_id(fn);
+		in->off = in->f.recs_off;
+		if (!(in->cur = dnst_file_rec(&in->f, in->off))) {
+			merge_in_done(in);
+			return 1;
+		}
+		return 0;
+
+	} else if (dnst_file_expand(&in->f))
+		fprintf(stderr, "Could not read the replies of \"%s\"\n", fn);
+
+	else if (!(in->n = dnst_scan( in->f.recs, in->f.end - in->f.recs
+	                            , &min_time, &max_time, &sorted))) {
+		merge_in_done(in);
+		return 1;
+
+	} else if (!(in->refs = dnst_sort(in->f.recs, in->n)))
+		fprintf(stderr, "Could not sort \"%s\"\n", fn);
+	else {
+		in->msm_id = in->f.hdr.msm_id ? in->f.hdr.msm_id
+		                              : dnst_file_msm_id(fn);
+		in->cur = in->refs[0];
+		return 0;
+	}
+	merge_in_done(in);
+	return -1;
+}
+
+/* Inputs with the earliest record first, and on the same time the input
+ * given first.
+ */
+static inline int merge_lt(merge_in *ins, size_t x, size_t y)
+{ return ins[x].cur->time < ins[y].cur->time
+     || (ins[x].cur->time == ins[y].cur->time && x < y); }
+
+static void merge_sift_down(merge_in *ins, size_t *heap, size_t n, size_t i)
+{
+	size_t c, tmp;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && merge_lt(ins, heap[c + 1], heap[c]))
+			c += 1;
+		if (!merge_lt(ins, heap[c], heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
+	}
+}
+
+/* Write the records of ins in time order, each preceded by its msm_id */
+static int merge_dnsts(dnst_writer *w, merge_in *ins, size_t n_ins)
+{
+	uint8_t *wr_buf;
+	size_t wr_len = 0, sz, *heap, n, i;
+	merge_in *in;
+	int r = 0;
+
+	if (!(wr_buf = malloc(MERGE_BUF_SZ)))
+		return -1;
+	if (!(heap = calloc(n_ins ? n_ins : 1, sizeof(size_t)))) {
+		free(wr_buf);
+		return -1;
+	}
+	for (n = 0, i = 0; i < n_ins; i++)
+		if (ins[i].cur)
+			heap[n++] = i;
+	for (i = n / 2; i > 0; i--)
+		merge_sift_down(ins, heap, n, i - 1);
+
+	while (!r && n) {
+		in = &ins[heap[0]];
+		sz = sizeof(uint32_t) + dnst_sz(in->cur);
+		if (wr_len + sz > MERGE_BUF_SZ) {
+			r = dnst_writer_write(w, wr_buf, wr_len);
+			wr_len = 0;
+		}
+		memcpy(wr_buf + wr_len, &in->msm_id, sizeof(uint32_t));
+		memcpy(wr_buf + wr_len + sizeof(uint32_t), in->cur, dnst_sz(in->cur));
+		wr_len += sz;
+		if (!merge_in_next(in))
+			heap[0] = heap[--n];
+		merge_sift_down(ins, heap, n, 0);
+	}
+	if (!r && wr_len)
+		r = dnst_writer_write(w, wr_buf, wr_len);
+	free(heap);
+	free(wr_buf);
+	return r;
+}
+
+int main(int argc, const char **argv)
+{
+	char fn[4096], tmp_fn[4096], idx_fn[4096];
+	merge_in *ins = NULL;
+	uint32_t *msm_ids = NULL;
+	size_t n_ins = 0, i;
+	int compress = 0;
+	dnst_writer w;
+	dnst_idx idx;
+	FILE *fh;
+	int r = 1;
+
+	if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
+		compress = 1;
+		argc--;
+		argv++;
+	}
+	memset(&idx, 0, sizeof(idx));
+	if (argc < 4)
+		printf("usage: %s [ -z ] <date> <merged_dir> <msm_dir> [ ... ]\n"
+		      , argv[0]);
+
+	else if (snprintf(fn, sizeof(fn), "%s/%s.dnst", argv[2], argv[1])
+	    >= (int)sizeof(fn)
+	     ||  snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", fn)
+	    >= (int)sizeof(tmp_fn)
+	     ||  snprintf(idx_fn, sizeof(idx_fn), "%s.idx", fn)
+	    >= (int)sizeof(idx_fn))
+		fprintf(stderr, "File name too large!\n");
+
+	else if (!(ins = calloc(argc - 3, sizeof(merge_in)))
+	     ||  !(msm_ids = calloc(argc - 3, sizeof(uint32_t))))
+		fprintf(stderr, "Could not allocate inputs\n");
+	else {
+		r = 0;
+		for (i = 3; !r && i < (size_t)argc; i++) {
+			switch (merge_in_open(&ins[n_ins], argv[i], argv[1])) {
+			case 0 : msm_ids[n_ins] = ins[n_ins].msm_id;
+			         n_ins++;
+			         break;
+			case 1 : break;
+			default: r = 1;
+			         break;
+			}
+		}
+	}
+	if (r)
+		; /* pass */
+
+	else if (!(fh = fopen(tmp_fn, "wb"))) {
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , tmp_fn, strerror(errno));
+		r = 1;
+	} else {
+		if (dnst_writer_start_merged( &w, fh, msm_ids, n_ins
+		                            , DNST_FILE_SORTED | DNST_FILE_DICT
+		                            | (compress ? DNST_FILE_LZ4 : 0), &idx)
+		||  merge_dnsts(&w, ins, n_ins)
+		||  dnst_writer_finish(&w)) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = 1;
+		}
+		dnst_writer_free(&w);
+		if (fclose(fh) && !r) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = 1;
+		}
+		if (!r && rename(tmp_fn, fn)) {
+			fprintf(stderr, "Could not rename \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = 1;
+		}
+		if (r)
+			unlink(tmp_fn);
+
+		else if (dnst_idx_save(&idx, idx_fn, w.off)) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , idx_fn, strerror(errno));
+			r = 1;
+		}
+	}
+	for (i = 0; i < n_ins; i++)
+		merge_in_done(&ins[i]);
+	dnst_idx_free(&idx);
+	free(msm_ids);
+	free(ins);
+	return r;
+}
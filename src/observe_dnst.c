@@ -0,0 +1,226 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "dnst.h"
+#include "dnst-file.h"
+#include "dnst-obs.h"
+
+#define OBSERVE_BUF_SZ 1048576
+
+/* Write the records of f to w, with the replies of known measurements
+ * replaced by what is observed in them.  Returns -1 on write errors, and
+ * 1 when a record of f could not be read.
+ */
+static int observe_recs(dnst_writer *w, dnst_file *f, uint32_t msm_id)
+{
+	uint8_t *wr_buf, *p;
+	size_t wr_len = 0, hdr_sz = 0, o_sz;
+	uint64_t off;
+	dnst_obs obs;
+	dnst *d, *o;
+	const dnst_msm *msm = dnst_msm_get(msm_id);
+	int r = 0, copy;
+
+	if (!(wr_buf = malloc(OBSERVE_BUF_SZ)))
+		return -1;
+	for ( off = f->recs_off; !r && (d = dnst_file_rec(f, off))
+	    ; off = dnst_file_next(f, off, d)) {
+		if (f->pre && dnst_file_rec_msm_id(f, d) != msm_id) {
+			msm_id = dnst_file_rec_msm_id(f, d);
+			msm = dnst_msm_get(msm_id);
+		}
+		/* An observation may be larger than the reply it replaces */
+		copy = d->error != DNST_OK || !msm || msm->kind == DNST_MSM_UNKNOWN;
+		if (copy)
+			o_sz = f->pre + dnst_sz(d);
+		else {
+			hdr_sz = dnst_msg(d) - (uint8_t *)d;
+			o_sz = f->pre + hdr_sz + (((sizeof(obs) + 3) >> 2) << 2);
+		}
+		if (wr_len + o_sz > OBSERVE_BUF_SZ) {
+			r = dnst_writer_write(w, wr_buf, wr_len);
+			wr_len = 0;
+		}
+		p = wr_buf + wr_len;
+		memcpy(p, (uint8_t *)d - f->pre, f->pre);
+		o = (dnst *)(p + f->pre);
+		if (copy)
+			memcpy(o, d, dnst_sz(d));
+		else {
+			dnst_observe(msm->kind, dnst_msg(d), d->len, &obs);
+			obs.kind = msm->kind;
+			obs.i = msm->i;
+			memcpy(o, d, hdr_sz);
+			o->error = DNST_OBS;
+			o->len = sizeof(obs);
+			memcpy(dnst_msg(o), &obs, sizeof(obs));
+		}
+		wr_len += o_sz;
+	}
+	if (!r && off < f->end_off) {
+		fprintf(stderr, "Could not read record at offset %" PRIu64 "\n"
+		              , off);
+		r = 1;
+	}
+	if (!r && wr_len)
+		r = dnst_writer_write(w, wr_buf, wr_len);
+	free(wr_buf);
+	return r;
+}
+
+/* Write the observations of fn to out_dir, with a sidecar index */
+static int observe_dnst(const char *fn, const char *out_dir, int compress)
+{
+	char out_fn[4096], tmp_fn[4096], idx_fn[4096];
+	const char *base = strrchr(fn, '/');
+	int fd = -1;
+	struct stat st;
+	uint8_t *buf = NULL;
+	dnst_file f;
+	dnst_writer w;
+	dnst_idx idx;
+	uint32_t msm_id;
+	uint8_t flags;
+	FILE *fh;
+	int r = -1;
+
+	memset(&f, 0, sizeof(f));
+	memset(&idx, 0, sizeof(idx));
+	base = base ? base + 1 : fn;
+	if (snprintf(out_fn, sizeof(out_fn), "%s/%s", out_dir, base)
+	    >= (int)sizeof(out_fn)
+	||  snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", out_fn)
+	    >= (int)sizeof(tmp_fn)
+	||  snprintf(idx_fn, sizeof(idx_fn), "%s.idx", out_fn)
+	    >= (int)sizeof(idx_fn))
+		fprintf(stderr, "File name too large!\n");
+
+	else if ((fd = open(fn, O_RDONLY)) < 0)
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , fn, strerror(errno));
+
+	else if (fstat(fd, &st) < 0)
+		fprintf(stderr, "Could not stat \"%s\": %s\n"
+		              , fn, strerror(errno));
+
+	else if (st.st_size > 0 && (buf = mmap( NULL, st.st_size, PROT_READ
+	                                      , MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Could not mmap \"%s\": %s\n"
+		              , fn, strerror(errno));
+		buf = NULL;
+
+	} else if (dnst_file_init(&f, buf, st.st_size) < 0)
+		fprintf(stderr, "\"%s\" is of an unknown version\n", fn);
+
+	else if (!(fh = fopen(tmp_fn, "wb")))
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , tmp_fn, strerror(errno));
+	else {
+		msm_id = f.hdr.msm_id ? f.hdr.msm_id : dnst_file_msm_id(fn);
+		flags = (dnst_file_flags(&f) & DNST_FILE_SORTED) | DNST_FILE_DICT
+		      | (compress || dnst_file_compressed(&f) ? DNST_FILE_LZ4 : 0);
+		if ((f.pre ? dnst_writer_start_merged( &w, fh, f.msm_ids
+		                                     , f.n_msms, flags, &idx)
+		           : dnst_writer_start(&w, fh, msm_id, flags, &idx))
+		||  (r = observe_recs(&w, &f, msm_id)) < 0
+		||  (!r && dnst_writer_finish(&w))) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = -1;
+		} else if (r)
+			fprintf(stderr, "\"%s\" is damaged\n", fn);
+		dnst_writer_free(&w);
+
+		if (fclose(fh) && !r) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = -1;
+		}
+		if (!r && rename(tmp_fn, out_fn)) {
+			fprintf(stderr, "Could not rename \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = -1;
+		}
+		if (r)
+			unlink(tmp_fn);
+
+		else if (dnst_idx_save(&idx, idx_fn, w.off)) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , idx_fn, strerror(errno));
+			r = -1;
+		}
+	}
+	dnst_idx_free(&idx);
+	dnst_file_done(&f);
+	if (buf)
+		munmap(buf, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	return r;
+}
+
+int main(int argc, const char **argv)
+{
+	int i, r = 0;
+	int compress = 0;
+
+	if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
+		compress = 1;
+		argc--;
+		argv++;
+	}
+	if (argc >= 3 && strcmp(argv[1], "-m") == 0) {
+		if (dnst_msms_load(argv[2]))
+			return 1;
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 3) {
+		printf("usage: %s [ -z ] [ -m <msms_file> ] <out_dir> "
+		       "<file.dnst> [ ... ]\n", argv[0]);
+		return 1;
+	}
+	for (i = 2; i < argc; i++) {
+		if (observe_dnst(argv[i], argv[1], compress))
+			r = 1;
+	}
+	return r;
+}
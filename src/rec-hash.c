@@ -0,0 +1,173 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "rec-hash.h"
+
+static void rec_hash_put(rec_hash *h, uint32_t hash, dnst_rec_node *node)
+{
+	rec_slot tmp;
+	size_t i, dist, slot_dist;
+
+	for (i = hash & h->mask, dist = 0; h->slots[i].node
+	    ; i = (i + 1) & h->mask, dist++) {
+		slot_dist = (i - h->slots[i].hash) & h->mask;
+		if (slot_dist < dist) {
+			tmp = h->slots[i];
+			h->slots[i].hash = hash;
+			h->slots[i].node = node;
+			hash = tmp.hash;
+			node = tmp.node;
+			dist = slot_dist;
+		}
+	}
+	h->slots[i].hash = hash;
+	h->slots[i].node = node;
+}
+
+/* Resize the table to sz slots (a power of two), and put all nodes again */
+static int rec_hash_resize(rec_hash *h, size_t sz)
+{
+	rec_slot *old_slots = h->slots;
+	size_t old_sz = h->slots ? h->mask + 1 : 0, i;
+
+	if (!(h->slots = calloc(sz, sizeof(rec_slot)))) {
+		h->slots = old_slots;
+		return -1;
+	}
+	h->mask = sz - 1;
+	for (i = 0; i < old_sz; i++)
+		if (old_slots[i].node)
+			rec_hash_put(h, old_slots[i].hash, old_slots[i].node);
+	free(old_slots);
+	return 0;
+}
+
+static int rec_hash_add_slab(rec_hash *h, size_t n)
+{
+	rec_slab *slab;
+
+	if (!(slab = calloc(1, sizeof(rec_slab) + n * sizeof(dnst_rec_node))))
+		return -1;
+	slab->n = n;
+	slab->next = h->slab;
+	h->slab = slab;
+	return 0;
+}
+
+/* Keep the table at most 3/4 full with n more nodes */
+static int rec_hash_fit(rec_hash *h, size_t n)
+{
+	size_t sz = h->slots ? h->mask + 1 : 4096;
+
+	while ((h->count + n) * 4 > sz * 3)
+		sz *= 2;
+	return (!h->slots || sz > h->mask + 1) ? rec_hash_resize(h, sz) : 0;
+}
+
+int rec_hash_reserve(rec_hash *h, size_t n)
+{
+	if (rec_hash_fit(h, n))
+		return -1;
+	if (n && (!h->slab || h->slab->n - h->slab->used < n)
+	&&  rec_hash_add_slab(h, n))
+		return -1;
+	return 0;
+}
+
+dnst_rec_node *rec_hash_new(rec_hash *h, const dnst_rec_key *k)
+{
+	dnst_rec_node *node;
+
+	if (rec_hash_fit(h, 1))
+		return NULL;
+	if ((!h->slab || h->slab->used == h->slab->n)
+	&&  rec_hash_add_slab(h, REC_SLAB_NODES))
+		return NULL;
+	node = &h->slab->nodes[h->slab->used++];
+	node->rec.key = *k;
+	rec_hash_put(h, rec_hash_key(k), node);
+	h->count += 1;
+	return node;
+}
+
+static int rec_node_cmp(const void *x, const void *y)
+{ return memcmp( &(*(dnst_rec_node **)x)->rec.key
+               , &(*(dnst_rec_node **)y)->rec.key, sizeof(dnst_rec_key)); }
+
+dnst_rec_node **rec_hash_sorted(const rec_hash *h)
+{
+	dnst_rec_node **nodes, **merged;
+	rec_slab *slab;
+	size_t i, j, k, n = h->count;
+
+	if (!(nodes = malloc((n ? n : 1) * sizeof(dnst_rec_node *))))
+		return NULL;
+
+	/* In the order of allocation, oldest slab first */
+	for (slab = h->slab, k = n; slab; slab = slab->next)
+		for (i = slab->used; i > 0; i--)
+			nodes[--k] = &slab->nodes[i - 1];
+
+	/* The nodes loaded from a .res file come first, and are sorted
+	 * already.  Only the nodes after them need sorting, and merging.
+	 */
+	for (k = 1; k < n && rec_node_cmp(&nodes[k - 1], &nodes[k]) < 0; k++)
+		; /* pass */
+	if (k >= n)
+		return nodes;
+	qsort(nodes + k, n - k, sizeof(dnst_rec_node *), rec_node_cmp);
+	if (!(merged = malloc(n * sizeof(dnst_rec_node *)))) {
+		qsort(nodes, n, sizeof(dnst_rec_node *), rec_node_cmp);
+		return nodes;
+	}
+	for (i = 0, j = k, n = 0; i < k || j < h->count; n++)
+		merged[n] = j >= h->count
+		         || (i < k && rec_node_cmp(&nodes[i], &nodes[j]) < 0)
+		          ? nodes[i++] : nodes[j++];
+	free(nodes);
+	return merged;
+}
+
+void rec_hash_free(rec_hash *h)
+{
+	rec_slab *slab;
+
+	while ((slab = h->slab)) {
+		h->slab = slab->next;
+		free(slab);
+	}
+	free(h->slots);
+	h->slots = NULL;
+	h->mask = 0;
+	h->count = 0;
+}
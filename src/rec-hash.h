@@ -0,0 +1,118 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __REC_HASH_H_
+#define __REC_HASH_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "dnst.h"
+
+/* A slot of the table, with the hash of the key of its node, so keys are
+ * only compared on equal hashes.
+ */
+typedef struct rec_slot {
+	uint32_t       hash;
+	dnst_rec_node *node;
+} rec_slot;
+
+/* Nodes are allocated zeroed in slabs of (at least) this many */
+#define REC_SLAB_NODES 4096
+
+typedef struct rec_slab {
+	struct rec_slab *next;
+	size_t           n;
+	size_t           used;
+	dnst_rec_node    nodes[];
+} rec_slab;
+
+/* Open addressing hash table of the resolvers by dnst_rec_key, with linear
+ * probing and Robin Hood insertion: a node takes the slot of one that is
+ * closer to its home slot, which keeps probe sequences short.  The nodes
+ * are allocated from slabs owned by the table.
+ */
+typedef struct rec_hash {
+	rec_slot *slots;
+	size_t    mask;
+	size_t    count;
+	rec_slab *slab;
+} rec_hash;
+
+static inline uint32_t rec_hash_key(const dnst_rec_key *k)
+{
+	uint64_t a, b;
+
+	memcpy(&a, k->addr, 8);
+	memcpy(&b, k->addr + 8, 8);
+	a ^= (b + k->prb_id) * 0x9E3779B97F4A7C15ULL;
+	a ^= a >> 31;
+	a *= 0xBF58476D1CE4E5B9ULL;
+	a ^= a >> 29;
+	a *= 0x94D049BB133111EBULL;
+	return (uint32_t)(a ^ (a >> 32));
+}
+
+/* The node with key k, or NULL */
+static inline dnst_rec_node *rec_hash_find(const rec_hash *h,
+    const dnst_rec_key *k)
+{
+	uint32_t hash = rec_hash_key(k);
+	size_t i, dist;
+
+	if (!h->slots)
+		return NULL;
+	for (i = hash & h->mask, dist = 0; h->slots[i].node
+	    ; i = (i + 1) & h->mask, dist++) {
+		if (h->slots[i].hash == hash
+		&&  !memcmp(&h->slots[i].node->rec.key, k, sizeof(dnst_rec_key)))
+			return h->slots[i].node;
+
+		/* A node with key k would have taken this slot */
+		if (((i - h->slots[i].hash) & h->mask) < dist)
+			return NULL;
+	}
+	return NULL;
+}
+
+/* Make room for n more nodes, in the table and in a single slab */
+int rec_hash_reserve(rec_hash *h, size_t n);
+
+/* A new zeroed node with key k, added to the table.  k should not be in
+ * the table yet.
+ */
+dnst_rec_node *rec_hash_new(rec_hash *h, const dnst_rec_key *k);
+
+/* A newly allocated array of the h->count nodes, ordered by key */
+dnst_rec_node **rec_hash_sorted(const rec_hash *h);
+
+void rec_hash_free(rec_hash *h);
+
+#endif
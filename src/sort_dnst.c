@@ -44,6 +44,9 @@
 #include <time.h>
 #include <unistd.h>
 #include "dnst.h"
+#include "dnst-sort.h"
+#include "dnst-file.h"
+#include "loser-tree.h"
 
 void error_dnst(int msm_id, dnst *d, int prb_id, const char *ip, const char *ts, float rt,
     int len, const char *error)
@@ -57,109 +60,437 @@ void process_dnst(int msm_id, dnst *d, int prb_id, const char *ip, const char *t
 	printf("%s, rt: %7.2fms, %5d_%s\n", ts, rt, prb_id, ip);
 }
 
-int dnst_time_cmp(const void *x, const void *y)
-{ return (*(dnst **)x)->time == (*(dnst **)y)->time ? 0
-       : (*(dnst **)x)->time >  (*(dnst **)y)->time ? 1 : -1; }
+/* Write fn as a version 2 file with a sidecar index, with the records of f
+ * put in time order to the writer by the sort function.
+ */
+static int sort_write(dnst_file *f, const char *in_fn, const char *fn,
+    int (*sort)(dnst_writer *w, void *arg), void *arg)
+{
+	FILE *fh;
+	dnst_writer w;
+	dnst_idx out_idx;
+	char idx_fn[4096];
+	int r = 0;
+
+	memset(&out_idx, 0, sizeof(out_idx));
+	if (!(fh = fopen(fn, "wb"))) {
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , fn, strerror(errno));
+		return -1;
+	}
+	if (dnst_writer_start( &w, fh, f->hdr.msm_id ? f->hdr.msm_id
+	                               : dnst_file_msm_id(in_fn)
+	                     , DNST_FILE_SORTED | (dnst_file_flags(f)
+	                       & (DNST_FILE_LZ4 | DNST_FILE_DICT))
+	                     , &out_idx)
+	||  sort(&w, arg)
+	||  dnst_writer_finish(&w)) {
+		fprintf(stderr, "Could not write \"%s\": %s\n"
+		              , fn, strerror(errno));
+		r = -1;
+	}
+	dnst_writer_free(&w);
+	if (fclose(fh) && !r) {
+		fprintf(stderr, "Could not write \"%s\": %s\n"
+		              , fn, strerror(errno));
+		r = -1;
+	}
+	if (r)
+		; /* pass */
 
-int sort_dnsts(uint8_t *buf, size_t sz, const char *fn, int dodel)
+	else if (snprintf(idx_fn, sizeof(idx_fn), "%s.idx", fn)
+	    >= (int)sizeof(idx_fn))
+		fprintf(stderr, "File name too large!\n");
+
+	else if (dnst_idx_save(&out_idx, idx_fn, w.off))
+		fprintf(stderr, "Could not write \"%s\": %s\n"
+		              , idx_fn, strerror(errno));
+	dnst_idx_free(&out_idx);
+	return r;
+}
+
+typedef struct sort_mem {
+	dnst_file *f;
+	dnst_idx  *idx;
+	size_t     n;
+	uint32_t   min_time;
+	uint32_t   max_time;
+	size_t     n_threads;
+} sort_mem;
+
+/* Sort all records in memory.  Files with few runs of records in time
+ * order are merged.  Otherwise records are copied to their place with a
+ * counting sort over the seconds (by n_threads threads), or for files
+ * spanning more than
+ * DNST_SORT_MAX_RANGE seconds, sorted by reference with qsort and then
+ * copied.
+ */
+static int sort_mem_write(dnst_writer *w, void *arg)
 {
-	uint8_t *eob = buf + sz;
-	dnst *d = (void *)buf, **refs;
-	size_t i, j;
-	uint32_t prev_time, min_time, max_time;
-	int sorted = 1;
-	int fd = -1;
-	char min_timestr[40], max_timestr[40];
-	struct tm min_tm, max_tm;
-	time_t min_t, max_t;
+	sort_mem *m = arg;
+	dnst_file *f = m->f;
+	dnst **refs = NULL;
 	uint8_t *wr_buf;
+	size_t wr_sz;
+	int r;
+
+	if (!(wr_buf = malloc((f->end - f->recs) ? f->end - f->recs : 1)))
+		return -1;
+
+	if ((wr_sz = dnst_merge_copy( wr_buf, f->recs, m->n
+	                            , DNST_SORT_MAX_RUNS)) != (size_t)-1)
+		; /* pass */
+
+	else if ((wr_sz = dnst_sort_copy_mt( wr_buf, f->recs, m->n
+	                                   , m->min_time, m->max_time
+	                                   , m->n_threads)) != (size_t)-1)
+		; /* pass */
+
+	else if (!(refs = m->idx && m->idx->map && m->idx->n == m->n
+	                ? dnst_sort_idx(f->buf, m->idx) : dnst_sort(f->recs, m->n))) {
+		free(wr_buf);
+		return -1;
+	} else
+		wr_sz = dnst_gather(wr_buf, refs, m->n);
+
+	r = dnst_writer_write(w, wr_buf, wr_sz);
+	free(refs);
+	free(wr_buf);
+	return r;
+}
+
+/* A sorted run of records in a temporary file, read back through buf */
+typedef struct sort_run {
+	FILE     *fh;
+	uint8_t  *buf;
+	size_t    buf_sz;
+	size_t    pos;
+	size_t    len;
+	dnst     *cur;
+} sort_run;
 
-	min_time = 0xFFFFFFFF;
-	max_time = 0;
-	for ( d = (void *)buf, i = 0, prev_time = 0
-	    ; ((uint8_t *)d) + 16 < eob
-	    ; d = dnst_next(d), i++) {
-
-		if (d->time < prev_time)
-			sorted = 0;
-		if (d->time < min_time)
-			min_time = d->time;
-		if (d->time > max_time)
-			max_time = d->time;
-		prev_time = d->time;
-
-		if (!dnst_fits(d, eob))
+typedef struct sort_ext {
+	dnst_file *f;
+	const char *fn;
+	size_t     mem_limit;
+	sort_run  *runs;
+	size_t     n_runs;
+} sort_ext;
+
+/* Write the n records in chunk in time order to a new run */
+static int sort_run_write(sort_ext *x, uint8_t *chunk, size_t n)
+{
+	char run_fn[4096];
+	sort_run *runs;
+	dnst **refs;
+	size_t i;
+	int fd;
+
+	if (!(runs = realloc(x->runs, (x->n_runs + 1) * sizeof(sort_run))))
+		return -1;
+	x->runs = runs;
+	memset(&x->runs[x->n_runs], 0, sizeof(sort_run));
+	if (snprintf(run_fn, sizeof(run_fn), "%s.run%zu", x->fn, x->n_runs)
+	    >= (int)sizeof(run_fn)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((fd = open(run_fn, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+		return -1;
+	unlink(run_fn);
+	if (!(x->runs[x->n_runs].fh = fdopen(fd, "w+b"))) {
+		close(fd);
+		return -1;
+	}
+	x->n_runs += 1;
+	if (!(refs = dnst_sort(chunk, n)))
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (!fwrite(refs[i], dnst_sz(refs[i]), 1, x->runs[x->n_runs-1].fh))
 			break;
 	}
-	fprintf(stderr, "%" PRIu32 " ... %" PRIu32 "\n", min_time, max_time);
-	min_t = min_time;
-	gmtime_r(&min_t, &min_tm);
-	strftime(min_timestr, sizeof(min_timestr), "%Y-%m-%dT%H:%M:%SZ", &min_tm);
-	max_t = max_time;
-	gmtime_r(&max_t, &max_tm);
-	strftime(max_timestr, sizeof(max_timestr), "%Y-%m-%dT%H:%M:%SZ", &max_tm);
-	fprintf(stderr, "%s ... %s\n", min_timestr, max_timestr);
-	min_tm.tm_mday += 1;
-	min_tm.tm_hour = 0;
-	min_tm.tm_min  = 0;
-	min_tm.tm_sec  = 0;
-	min_t = timegm(&min_tm);
-
-	if ((min_t > max_t && min_t - max_t > 300)
-	||  (max_t > min_t && max_t - min_t > 300)) {
-		strftime(min_timestr, sizeof(min_timestr), "%Y-%m-%dT%H:%M:%SZ", &min_tm);
-		fprintf(stderr, "end to far from %s\n", min_timestr);
-		if (dodel)
-			return fn ? -666 : 1;
+	free(refs);
+	return i < n || fflush(x->runs[x->n_runs - 1].fh) ? -1 : 0;
+}
+
+/* The next record of run, or NULL at the end (or on a read error) */
+static dnst *sort_run_next(sort_run *run)
+{
+	dnst *d;
+	ssize_t r;
+
+	if (run->cur)
+		run->pos += dnst_sz(run->cur);
+	run->cur = NULL;
+	for (;;) {
+		d = (dnst *)(run->buf + run->pos);
+		if (run->len - run->pos >= 16 && run->len - run->pos >= dnst_sz(d))
+			return (run->cur = d);
+
+		memmove(run->buf, run->buf + run->pos, run->len - run->pos);
+		run->len -= run->pos;
+		run->pos = 0;
+		if ((r = read( fileno(run->fh), run->buf + run->len
+		             , run->buf_sz - run->len)) < 0)
+			perror("Could not read sorted run");
+		if (r <= 0)
+			return NULL;
+		run->len += r;
 	}
-	if (sorted) {
-		fprintf(stderr, "File was already sorted\n");
-		return 1;
+}
+
+/* Sort with at most mem_limit bytes for the records.  Chunks of half that
+ * size are sorted into temporary runs (next to the output, unlinked once
+ * open), which are merged into the output with a loser tree, each read
+ * through an equal share of the other half.
+ */
+static int sort_ext_write(dnst_writer *w, void *arg)
+{
+	sort_ext *x = arg;
+	dnst_file *f = x->f;
+	size_t chunk_sz = x->mem_limit / 2, chunk_len = 0, n = 0, i, sz;
+	uint8_t *chunk;
+	uint64_t off;
+	loser_tree lt;
+	dnst **refs, *d;
+	int r = 0;
+
+	if (!(chunk = malloc(chunk_sz)))
+		return -1;
+	for ( off = f->recs_off; !r && (d = dnst_file_rec(f, off))
+	    ; off = dnst_file_next(f, off, d)) {
+		sz = dnst_sz(d);
+		if (chunk_len + sz > chunk_sz) {
+			r = sort_run_write(x, chunk, n);
+			chunk_len = n = 0;
+		}
+		memcpy(chunk + chunk_len, d, sz);
+		chunk_len += sz;
+		n += 1;
 	}
-	if (!(refs = malloc(i * sizeof(dnst *))))
+	if (r)
+		; /* pass */
+
+	else if (!x->n_runs) {
+		/* All records fit in a single chunk */
+		if (!(refs = dnst_sort(chunk, n)))
+			r = -1;
+		else for (i = 0; !r && i < n; i++)
+			r = dnst_writer_write(w, (uint8_t *)refs[i], dnst_sz(refs[i]));
+		free(refs);
+		free(chunk);
+		return r;
+
+	} else if (n)
+		r = sort_run_write(x, chunk, n);
+	free(chunk);
+	if (r)
 		return -1;
-	for ( d = (void *)buf, i = 0
-	    ; ((uint8_t *)d) + 16 < eob
-	    ; d = dnst_next(d), i++) {
 
-		refs[i] = d;
-		if (!dnst_fits(d, eob))
-			break;
+	sz = x->mem_limit / 2 / x->n_runs;
+	if (sz < 2 * (sizeof(dnst) + 65536))
+		sz = 2 * (sizeof(dnst) + 65536);
+	for (i = 0; i < x->n_runs; i++) {
+		if (!(x->runs[i].buf = malloc(sz))
+		||  lseek(fileno(x->runs[i].fh), 0, SEEK_SET) < 0)
+			return -1;
+		x->runs[i].buf_sz = sz;
+		(void) sort_run_next(&x->runs[i]);
 	}
-	qsort(refs, i, sizeof(dnst *), dnst_time_cmp);
-	for (j = 0, prev_time = 0; j < i; j++) {
-		if (refs[j]->time < prev_time)
-			printf("Jump back of %" PRIu32 "\n", (prev_time - refs[j]->time));
-		prev_time = refs[j]->time;
+	if (loser_tree_init(&lt, x->n_runs))
+		return -1;
+	for (i = 0; i < x->n_runs; i++)
+		if (x->runs[i].cur)
+			lt.key[i] = x->runs[i].cur->time;
+	loser_tree_play(&lt);
+	while (!r && lt.key[(i = loser_tree_winner(&lt))] != LOSER_TREE_DONE) {
+		d = x->runs[i].cur;
+		r = dnst_writer_write(w, (uint8_t *)d, dnst_sz(d));
+		lt.key[i] = (d = sort_run_next(&x->runs[i]))
+		          ? d->time : LOSER_TREE_DONE;
+		loser_tree_replay(&lt);
+	}
+	loser_tree_free(&lt);
+	return r;
+}
+
+static void sort_ext_free(sort_ext *x)
+{
+	size_t i;
+
+	for (i = 0; i < x->n_runs; i++) {
+		free(x->runs[i].buf);
+		if (x->runs[i].fh)
+			fclose(x->runs[i].fh);
+	}
+	free(x->runs);
+	x->runs = NULL;
+	x->n_runs = 0;
+}
+
+/* Sort the records in f and write them to fn as a version 2 file, with a
+ * sidecar index.  Sorted version 2 files are recognised from their footer
+ * without a scan, or from the sidecar index (idx->map).  Compressed files
+ * are decompressed in memory and written compressed.  Replies in a
+ * dictionary are put back in the records for sorting (so the sidecar index
+ * no longer applies), and interned again when written.  With mem_limit,
+ * the file is sorted with that much memory for the records, visiting the
+ * (compressed) input a record at a time.
+ */
+int sort_dnsts(dnst_file *f, dnst_idx *idx, const char *in_fn, const char *fn,
+    int dodel, size_t mem_limit, size_t n_threads)
+{
+	sort_mem m;
+	sort_ext x;
+	int sorted, r;
+
+	memset(&m, 0, sizeof(m));
+	m.f = f;
+	m.idx = idx;
+	m.n_threads = n_threads;
+	if (f->has_ftr) {
+		m.n = f->ftr.n_recs;
+		m.min_time = f->ftr.min_time;
+		m.max_time = f->ftr.max_time;
+		sorted = dnst_file_sorted(f);
+
+	} else if (idx->map) {
+		m.n = idx->n;
+		dnst_idx_scan(idx, &m.min_time, &m.max_time, &sorted);
+	} else
+		m.n = dnst_scan( f->recs, f->end - f->recs
+		               , &m.min_time, &m.max_time, &sorted);
+	if (dnst_check_day(m.min_time, m.max_time) && dodel)
+		return fn ? -666 : 1;
+
+	if (sorted) {
+		fprintf(stderr, "File was already sorted\n");
+		return 1;
 	}
 	if (!fn)
 		return 0;
-#if 0
-	if ((fd = open(fn, O_RDWR|O_CREAT, 0644)) < 0) {
-		fprintf(stderr, "Could not open \"%s\": %s\n", fn, strerror(errno));
-	}
 
-	for (j = 0; j < i; j++) {
-		write(fd, refs[j], dnst_sz(refs[j]));
+	if (mem_limit) {
+		memset(&x, 0, sizeof(x));
+		x.f = f;
+		x.fn = fn;
+		x.mem_limit = mem_limit;
+		r = sort_write(f, in_fn, fn, sort_ext_write, &x);
+		sort_ext_free(&x);
+		return r;
 	}
-	close(fd);
-#else
-	if (!(wr_buf = malloc(sz)))
-		perror("Could not malloc output file");
-	d = (void *)wr_buf;
-	for (j = 0; j < i; j++) {
-		memcpy(d, refs[j], dnst_sz(refs[j]));
-		d = (dnst *)(((uint8_t *)d) + dnst_sz(refs[j]));
+	if (f->dict)
+		m.idx = NULL;
+	if (dnst_file_expand(f)) {
+		fprintf(stderr, "Could not decompress \"%s\"\n", in_fn);
+		return -1;
 	}
-	if ((fd = open(fn, O_WRONLY|O_CREAT, 0644)) < 0) {
-		fprintf(stderr, "Could not open \"%s\": %s\n", fn, strerror(errno));
+	return sort_write(f, in_fn, fn, sort_mem_write, &m);
+}
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Compare sorting the records of f by reference with qsort (and copying
+ * them), with the counting sort (by n_threads threads too, when more than
+ * one) and with merging the runs, taking the best of rounds runs of each.
+ */
+int bench_dnsts(dnst_file *f, const char *in_fn, int rounds, size_t n_threads)
+{
+	uint8_t *q_buf = NULL, *c_buf = NULL, *p_buf = NULL, *m_buf = NULL;
+	size_t n, k, i, q_sz = 0, c_sz = 0, p_sz = 0, m_sz = 0;
+	uint32_t min_time, max_time;
+	double t, q_best = 0, c_best = 0, p_best = 0, m_best = 0;
+	int sorted, round, r = -1;
+	dnst **refs, *d;
+
+	if (rounds < 1)
+		rounds = 1;
+	if (dnst_file_expand(f)) {
+		fprintf(stderr, "Could not decompress \"%s\"\n", in_fn);
+		return -1;
 	}
-	assert(write(fd, wr_buf, sz) == sz);
-	close(fd);
-	free(wr_buf);
+	n = dnst_scan( f->recs, f->end - f->recs
+	             , &min_time, &max_time, &sorted);
+	k = dnst_runs(f->recs, n);
+	if (!(q_buf = malloc((f->end - f->recs) ? f->end - f->recs : 1))
+	||  !(c_buf = malloc((f->end - f->recs) ? f->end - f->recs : 1))
+	||  !(p_buf = malloc((f->end - f->recs) ? f->end - f->recs : 1))
+	||  !(m_buf = malloc((f->end - f->recs) ? f->end - f->recs : 1)))
+		perror("Could not malloc output buffers");
+
+	else for (r = 0, round = 0; !r && round < rounds; round++) {
+		t = bench_time();
+		if (!(refs = malloc((n ? n : 1) * sizeof(dnst *)))) {
+			r = -1;
+			break;
+		}
+		for (d = (void *)f->recs, i = 0; i < n; d = dnst_next(d), i++)
+			refs[i] = d;
+		dnst_qsort(refs, n);
+		q_sz = dnst_gather(q_buf, refs, n);
+		free(refs);
+		t = bench_time() - t;
+		if (!round || t < q_best)
+			q_best = t;
+
+		t = bench_time();
+		if ((c_sz = dnst_sort_copy( c_buf, f->recs, n
+		                          , min_time, max_time)) == (size_t)-1) {
+			fprintf(stderr, "Time range too large for counting sort\n");
+			r = -1;
+			break;
+		}
+		t = bench_time() - t;
+		if (!round || t < c_best)
+			c_best = t;
 
-#endif
-	return 0;
+		if (n_threads > 1) {
+			t = bench_time();
+			if ((p_sz = dnst_sort_copy_mt( p_buf, f->recs, n, min_time
+			                             , max_time, n_threads))
+			    == (size_t)-1) {
+				r = -1;
+				break;
+			}
+			t = bench_time() - t;
+			if (!round || t < p_best)
+				p_best = t;
+		}
+
+		t = bench_time();
+		if ((m_sz = dnst_merge_copy(m_buf, f->recs, n, k)) == (size_t)-1) {
+			r = -1;
+			break;
+		}
+		t = bench_time() - t;
+		if (!round || t < m_best)
+			m_best = t;
+	}
+	if (!r)
+		printf( "%s: %zu records in %zu runs%s, qsort %.3fs, "
+		        "counting sort %.3fs (%.1fx), merge %.3fs (%.1fx), "
+		        "output %s\n", in_fn, n, k, sorted ? " (sorted)" : ""
+		      , q_best, c_best, c_best > 0 ? q_best / c_best : 0.0
+		      , m_best, m_best > 0 ? q_best / m_best : 0.0
+		      , q_sz == c_sz && !memcmp(q_buf, c_buf, q_sz)
+		     && (n_threads < 2
+		        || (q_sz == p_sz && !memcmp(q_buf, p_buf, q_sz)))
+		     && q_sz == m_sz && !memcmp(q_buf, m_buf, q_sz)
+		      ? "identical" : "DIFFERS");
+	if (!r && n_threads > 1)
+		printf( "%s: counting sort with %zu threads %.3fs (%.1fx)\n"
+		      , in_fn, n_threads, p_best, p_best > 0 ? q_best / p_best : 0.0);
+	free(m_buf);
+	free(p_buf);
+	free(c_buf);
+	free(q_buf);
+	return r;
 }
 
 int main(int argc, const char **argv)
@@ -167,16 +498,41 @@ int main(int argc, const char **argv)
 	int fd = -1;
 	struct stat st;
 	uint8_t *buf = NULL;
+	dnst_file f;
+	dnst_idx idx;
+	char idx_fn[4096];
 	int r = 1;
 	int dodel = 1;
+	int bench = 0;
+	size_t mem_limit = 0;
+	size_t n_threads = 1;
+	const char *prog = argv[0];
 
 	if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
 		dodel = 0;
 		argc--;
 		argv++;
 	}
-	if (argc != 2 && argc != 3)
-		printf("usage: %s [ -d ] <file.dnst> [ <file.sdnst> ]\n", argv[0]);
+	if (argc >= 3 && strcmp(argv[1], "-m") == 0) {
+		mem_limit = strtoul(argv[2], NULL, 10) * 1024 * 1024;
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+		n_threads = strtoul(argv[2], NULL, 10);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+		bench = 1;
+		argc--;
+		argv++;
+	}
+	if ((argc != 2 && argc != 3) || n_threads < 1)
+		printf("usage: %s [ -d ] [ -m <megabytes> ] [ -j <threads> ] "
+		       "<file.dnst> [ <file.sdnst> ]\n"
+		       "       %s [ -j <threads> ] -b <file.dnst> [ <rounds> ]\n"
+		      , prog, prog);
 
 	else if ((fd = open(argv[1], O_RDONLY)) < 0)
 		perror("Could not open input file");
@@ -185,10 +541,30 @@ int main(int argc, const char **argv)
 		perror("Could not stat input file");
 
 	else if ((buf = mmap( NULL, st.st_size
-	                     , PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	                     , PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
 		perror("Could not mmap input file");
-	else {
-		r = sort_dnsts(buf, st.st_size, (argc == 3 ? argv[2] : 0), dodel);
+		buf = NULL;
+
+	} else if (dnst_file_init(&f, buf, st.st_size) < 0)
+		fprintf(stderr, "Unknown .dnst version\n");
+
+	else if (f.pre) {
+		fprintf(stderr, "Merged files are sorted by merge_dnst\n");
+		dnst_file_done(&f);
+
+	} else if (bench) {
+		r = bench_dnsts(&f, argv[1], argc == 3 ? atoi(argv[2]) : 5
+		               , n_threads) ? 1 : 0;
+		dnst_file_done(&f);
+	} else {
+		if (snprintf(idx_fn, sizeof(idx_fn), "%s.idx", argv[1])
+		    >= (int)sizeof(idx_fn)
+		||  dnst_idx_load(&idx, idx_fn, st.st_size))
+			memset(&idx, 0, sizeof(idx));
+		r = sort_dnsts(&f, &idx, argv[1], (argc == 3 ? argv[2] : 0), dodel,
+		    mem_limit, n_threads);
+		dnst_idx_free(&idx);
+		dnst_file_done(&f);
 	}
 
 	if (buf)
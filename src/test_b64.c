@@ -0,0 +1,184 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Compares b64_decode, and each of its vectorized paths, with b64_pton over
+ * every length up to TEST_B64_MAX_LEN, with every byte value at every
+ * position, and with target buffers that are too short.  b64.c is included
+ * to get at the paths, which are static.
+ */
+#include "b64.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_B64_MAX_LEN 160
+#define TEST_B64_GUARD    64 /* Bytes after the target that must stay put */
+
+typedef int (*b64_decode_fn)(char const *src, size_t srcsize,
+    uint8_t *target, size_t targsize);
+
+#ifdef B64_X86
+/* b64_decode with the blocks decoded by blocks */
+static int decode_with(b64_blocks_fn blocks, char const *src, size_t srcsize,
+    uint8_t *target, size_t targsize)
+{
+	uint8_t *o = target;
+	size_t done;
+	int r;
+
+	done = blocks(src, srcsize, &o, target + targsize);
+	if ((r = b64_pton( src + done, srcsize - done
+	                 , o, targsize - (o - target))) < 0)
+		return r;
+	return r + (int)(o - target);
+}
+
+static int decode_sse41(char const *src, size_t srcsize,
+    uint8_t *target, size_t targsize)
+{ return decode_with(b64_blocks_sse41, src, srcsize, target, targsize); }
+
+static int decode_avx2(char const *src, size_t srcsize,
+    uint8_t *target, size_t targsize)
+{ return decode_with(b64_blocks_avx2, src, srcsize, target, targsize); }
+#endif
+
+static struct {
+	const char    *name;
+	b64_decode_fn  decode;
+} decoders[3];
+static size_t n_decoders = 0;
+
+static size_t n_cases = 0;
+static size_t n_failed = 0;
+
+static void print_src(const char *src, size_t srcsize)
+{
+	size_t i;
+
+	for (i = 0; i < srcsize; i++)
+		fprintf(stderr, "%02x", (uint8_t)src[i]);
+	fprintf(stderr, "\n");
+}
+
+/* Decode src with all decoders into a target of targsize bytes */
+static void check_targsize(const char *src, size_t srcsize, size_t targsize)
+{
+	uint8_t ref[TEST_B64_MAX_LEN + TEST_B64_GUARD];
+	uint8_t buf[TEST_B64_MAX_LEN + TEST_B64_GUARD];
+	size_t i, j;
+	int r, ref_r;
+
+	memset(ref, 0xA5, sizeof(ref));
+	ref_r = b64_pton(src, srcsize, ref, targsize);
+	for (i = 0; i < n_decoders; i++) {
+		n_cases += 1;
+		memset(buf, 0xA5, sizeof(buf));
+		r = decoders[i].decode(src, srcsize, buf, targsize);
+		for (j = targsize; j < sizeof(buf) && buf[j] == 0xA5; j++)
+			; /* pass */
+		if (r == ref_r && (r <= 0 || memcmp(buf, ref, r) == 0)
+		&&  j == sizeof(buf))
+			continue;
+
+		if (n_failed++ < 10) {
+			fprintf(stderr, "%s returned %d instead of %d for "
+			                "%zu characters into %zu bytes%s: "
+			              , decoders[i].name, r, ref_r, srcsize
+			              , targsize, j < sizeof(buf)
+			              ? " (written past the target)" : "");
+			print_src(src, srcsize);
+		}
+	}
+}
+
+static void check(const char *src, size_t srcsize)
+{
+	uint8_t ref[TEST_B64_MAX_LEN];
+	int r = b64_pton(src, srcsize, ref, sizeof(ref));
+
+	check_targsize(src, srcsize, TEST_B64_MAX_LEN);
+	if (r <= 0)
+		return;
+	check_targsize(src, srcsize, r);
+	check_targsize(src, srcsize, r - 1);
+	check_targsize(src, srcsize, r / 2);
+}
+
+int main(void)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t rnd = 1;
+	size_t len, pos;
+	char *src;
+	int c;
+
+	decoders[n_decoders].name = "b64_decode";
+	decoders[n_decoders++].decode = b64_decode;
+#ifdef B64_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		decoders[n_decoders].name = "SSE4.1";
+		decoders[n_decoders++].decode = decode_sse41;
+	} else
+		fprintf(stderr, "No SSE4.1, so it is not tested\n");
+	if (__builtin_cpu_supports("avx2")) {
+		decoders[n_decoders].name = "AVX2";
+		decoders[n_decoders++].decode = decode_avx2;
+	} else
+		fprintf(stderr, "No AVX2, so it is not tested\n");
+#endif
+	for (len = 0; len <= TEST_B64_MAX_LEN; len++) {
+		/* Exactly len bytes, so reading past src can be caught */
+		if (!(src = malloc(len ? len : 1))) {
+			fprintf(stderr, "Could not allocate source\n");
+			return 1;
+		}
+		for (pos = 0; pos < len; pos++) {
+			rnd = rnd * 1103515245 + 12345;
+			src[pos] = b64[(rnd >> 16) % 64];
+		}
+		check(src, len);
+		for (pos = 0; pos < len; pos++) {
+			char prev = src[pos];
+
+			for (c = 0; c < 256; c++) {
+				src[pos] = (char)c;
+				check(src, len);
+			}
+			src[pos] = prev;
+		}
+		free(src);
+	}
+	printf("%zu cases, %zu failed\n", n_cases, n_failed);
+	return n_failed ? 1 : 0;
+}
@@ -0,0 +1,209 @@
+/* Copyright (c) 2018, NLnet Labs. All rights reserved.
+ * 
+ * This software is open source.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "dnst.h"
+#include "dnst-file.h"
+
+/* Write the sidecar index of a version 2 file that has none (yet) */
+static int index_dnst(const char *fn, const char *idx_fn, dnst_file *f,
+    uint64_t sz)
+{
+	dnst_idx idx;
+	dnst *d;
+	uint64_t off;
+	int r = 0;
+
+	if (!dnst_idx_load(&idx, idx_fn, sz)) {
+		fprintf(stderr, "\"%s\" is already version %d\n", fn, f->version);
+		dnst_idx_free(&idx);
+		return 0;
+	}
+	memset(&idx, 0, sizeof(idx));
+	for ( off = f->recs_off; !r && (d = dnst_file_rec(f, off))
+	    ; off = dnst_file_next(f, off, d))
+		r = dnst_idx_add(&idx, off, d);
+
+	if (r || dnst_idx_save(&idx, idx_fn, sz)) {
+		fprintf(stderr, "Could not write \"%s\": %s\n"
+		              , idx_fn, strerror(errno));
+		r = -1;
+	}
+	dnst_idx_free(&idx);
+	return r;
+}
+
+/* Rewrite fn as a version 2 file, with its replies in a dictionary and a
+ * sidecar index, keeping its timestamps.  The measurement ID for the header
+ * is taken from the name of the directory fn is in.  With compress,
+ * uncompressed version 2 files are rewritten too.
+ */
+static int upgrade_dnst(const char *fn, int compress)
+{
+	char tmp_fn[4096], idx_fn[4096];
+	int fd = -1;
+	struct stat st;
+	uint8_t *buf = NULL;
+	dnst_file f;
+	dnst_writer w;
+	dnst_idx idx;
+	dnst *d;
+	uint8_t *p;
+	size_t sz;
+	FILE *fh;
+	uint8_t flags;
+	struct timeval tv[2];
+	int r = -1;
+
+	memset(&f, 0, sizeof(f));
+	memset(&idx, 0, sizeof(idx));
+	if (snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", fn) >= (int)sizeof(tmp_fn)
+	||  snprintf(idx_fn, sizeof(idx_fn), "%s.idx", fn) >= (int)sizeof(idx_fn))
+		fprintf(stderr, "File name too large!\n");
+
+	else if ((fd = open(fn, O_RDONLY)) < 0)
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , fn, strerror(errno));
+
+	else if (fstat(fd, &st) < 0)
+		fprintf(stderr, "Could not stat \"%s\": %s\n"
+		              , fn, strerror(errno));
+
+	else if (st.st_size > 0 && (buf = mmap( NULL, st.st_size, PROT_READ
+	                                      , MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Could not mmap \"%s\": %s\n"
+		              , fn, strerror(errno));
+		buf = NULL;
+
+	} else if (dnst_file_init(&f, buf, st.st_size) < 0)
+		fprintf(stderr, "\"%s\" is of an unknown version\n", fn);
+
+	else if (f.version == DNST_FILE_VERSION && !f.has_ftr)
+		fprintf(stderr, "\"%s\" has no footer\n", fn);
+
+	else if (f.version == DNST_FILE_VERSION
+	     && (!compress || dnst_file_compressed(&f)))
+		r = index_dnst(fn, idx_fn, &f, st.st_size);
+
+	else if (dnst_file_expand(&f))
+		fprintf(stderr, "Could not read the replies of \"%s\"\n", fn);
+
+	else if (!(fh = fopen(tmp_fn, "wb")))
+		fprintf(stderr, "Could not open \"%s\": %s\n"
+		              , tmp_fn, strerror(errno));
+	else {
+		for ( p = f.recs
+		    ; p + f.pre + 16 < f.end
+		    &&  dnst_fits((d = (void *)(p + f.pre)), f.end)
+		    ; p = (uint8_t *)dnst_next(d))
+			; /* pass */
+		if ((sz = p - f.recs) < (size_t)(f.end - f.recs))
+			fprintf( stderr, "Dropping incomplete record at the end "
+			                 "of \"%s\"\n", fn);
+
+		flags = DNST_FILE_DICT | (compress ? DNST_FILE_LZ4 : 0);
+		if ((f.pre ? dnst_writer_start_merged( &w, fh, f.msm_ids
+		                                     , f.n_msms, flags, &idx)
+		           : dnst_writer_start( &w, fh, f.hdr.msm_id ? f.hdr.msm_id
+		                                        : dnst_file_msm_id(fn)
+		                              , flags, &idx))
+		||  dnst_writer_write(&w, f.recs, sz)
+		||  dnst_writer_finish(&w))
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+		else
+			r = 0;
+		dnst_writer_free(&w);
+
+		if (fclose(fh) && !r) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = -1;
+		}
+		tv[0].tv_sec = st.st_atime;
+		tv[0].tv_usec = 0;
+		tv[1].tv_sec = st.st_mtime;
+		tv[1].tv_usec = 0;
+		if (!r && utimes(tmp_fn, tv))
+			fprintf(stderr, "Warning: could not set time of \"%s\": "
+			                "%s\n", tmp_fn, strerror(errno));
+		if (!r && rename(tmp_fn, fn)) {
+			fprintf(stderr, "Could not rename \"%s\": %s\n"
+			              , tmp_fn, strerror(errno));
+			r = -1;
+		}
+		if (r)
+			unlink(tmp_fn);
+
+		else if (dnst_idx_save(&idx, idx_fn, w.off)) {
+			fprintf(stderr, "Could not write \"%s\": %s\n"
+			              , idx_fn, strerror(errno));
+			r = -1;
+		}
+	}
+	dnst_idx_free(&idx);
+	dnst_file_done(&f);
+	if (buf)
+		munmap(buf, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	return r;
+}
+
+int main(int argc, const char **argv)
+{
+	int i, r = 0;
+	int compress = 0;
+
+	if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
+		compress = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2) {
+		printf("usage: %s [ -z ] <file.dnst> [ ... ]\n", argv[0]);
+		return 1;
+	}
+	for (i = 1; i < argc; i++) {
+		if (upgrade_dnst(argv[i], compress))
+			r = 1;
+	}
+	return r;
+}